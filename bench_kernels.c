@@ -0,0 +1,339 @@
+/**************************************************************************************
+ * Description: This program checks every encode/decode/validate/pack/unpack kernel variant
+ * 		against the scalar kernel and reports the throughput of each one in GB/s.
+ * 		With --csv it instead sweeps message sizes from 16 bytes up and prints one
+ * 		CSV line per benchmark, variant and size: every kernel, otpCheckTexts,
+ * 		key generation and the socket helpers over a socketpair and over loopback.
+ *************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "otp_codec.h"
+#include "otp_rand.h"
+#include "otp_io.h"
+
+#define SWEEP_MIN 16 //smallest message of --csv; sizes grow 4 times per step
+#define SWEEP_MAX (64 << 20) //default largest message of --csv
+#define SOCKET_MAX (256 << 20) //largest message sent through a socket
+#define BATCH_SECONDS 1e-3 //a timed batch repeats the operation for at least this long
+
+//reporting error
+void error(const char* msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+//current time of the monotonic clock in seconds
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//fill buf with random characters of A-Z and space; every 4096th one is made invalid
+//so that the fallback path of the SIMD kernels is compared as well
+void fillText(char* buf, size_t n, int withInvalid)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		int c = rand() % 27;
+		buf[i] = c == 26 ? ' ' : (char)('A' + c);
+		if (withInvalid && i % 4096 == 4095)
+			buf[i] = (char)(rand() % 256);
+	}
+}
+
+//time stamp counter, 0 where there is none
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+//what a sweep benchmark works on
+struct sweep
+{
+	const struct otpKernel* kernel;
+	char *text, *key, *out;
+	unsigned char* packed;
+	struct otpRand rng;
+	int socketFD; //the sending end of the socket benchmark
+};
+
+static void runEncode(struct sweep* sw, size_t n) { sw->kernel->encode(sw->text, sw->key, sw->out, n); }
+static void runDecode(struct sweep* sw, size_t n) { sw->kernel->decode(sw->text, sw->key, sw->out, n); }
+static void runValidate(struct sweep* sw, size_t n) { if (sw->kernel->validate(sw->text, n) != n) error("valid text rejected"); }
+static void runPack(struct sweep* sw, size_t n) { sw->kernel->pack(sw->text, sw->packed, n); }
+static void runUnpack(struct sweep* sw, size_t n) { sw->kernel->unpack(sw->packed, sw->out, n); }
+static void runCheckTexts(struct sweep* sw, size_t n) { if (otpCheckTexts(sw->text, n, sw->key, n) != 1) error("valid text rejected"); }
+static void runKeygen(struct sweep* sw, size_t n) { otpRandKey(&sw->rng, sw->out, n); }
+
+//send an 8-byte length and n bytes with otpWriteToSocket, and wait for the reader's 1-byte ack
+static void runSocket(struct sweep* sw, size_t n)
+{
+	uint64_t length = n;
+	char ack;
+	if (otpWriteToSocket(sw->socketFD, (const char*)&length, sizeof(length)) < 0 ||
+	    otpWriteToSocket(sw->socketFD, sw->text, n) < 0 ||
+	    otpReadFromSocket(sw->socketFD, &ack, 1) < 0)
+		error("socket benchmark");
+}
+
+//the receiving end of the socket benchmark: read each message with otpReadFromSocket and ack it
+static void* socketReader(void* arg)
+{
+	int fd = *(int*)arg;
+	uint64_t length;
+	char* buf = malloc(SOCKET_MAX);
+	if (!buf)
+		error("Fail to allocate memory for benchmark buffers");
+	while (otpReadFromSocket(fd, (char*)&length, sizeof(length)) == 0 && otpReadFromSocket(fd, buf, length) == 0)
+		if (otpWriteToSocket(fd, "", 1) < 0)
+			break;
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/***********************************************************************************************
+ * Function: measure
+ * Description: This function times run on n bytes and prints one CSV line. The operation is
+ * 		repeated until a batch takes BATCH_SECONDS, so that small sizes are timed too, and
+ * 		the best of five batches is kept.
+ * Arguments: benchmark, variant: const char*, the first two CSV fields
+ * 	      run: the operation, run(sw, n)
+ * 	      sw: struct sweep*, its buffers
+ * 	      n: size_t, message size in bytes
+ * **********************************************************************************************/
+static void measure(const char* benchmark, const char* variant, void (*run)(struct sweep*, size_t),
+		    struct sweep* sw, size_t n)
+{
+	size_t iterations = 1, i;
+	double start, seconds, best = 1e30;
+	uint64_t startCycles, bestCycles = 0;
+	int batch;
+	while (1) //calibrate
+	{
+		start = now();
+		for (i = 0; i < iterations; i++)
+			run(sw, n);
+		if (now() - start >= BATCH_SECONDS || iterations >= ((size_t)1 << 30))
+			break;
+		iterations *= 2;
+	}
+	for (batch = 0; batch < 5; batch++)
+	{
+		start = now();
+		startCycles = cycles();
+		for (i = 0; i < iterations; i++)
+			run(sw, n);
+		seconds = now() - start;
+		if (seconds < best)
+		{
+			best = seconds;
+			bestCycles = cycles() - startCycles;
+		}
+	}
+	double bytes = (double)n * iterations;
+	printf("%s,%s,%zu,%.4f,%.3f,%.4f\n", benchmark, variant, n, best * 1e9 / bytes, bytes / best / 1e9, bestCycles / bytes);
+	fflush(stdout);
+}
+
+//connect a socket to a listener on 127.0.0.1. Returns the connected pair in fds
+static void loopbackPair(int fds[2])
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listenFD < 0 || bind(listenFD, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFD, 1) < 0 ||
+	    getsockname(listenFD, (struct sockaddr*)&addr, &len) < 0)
+		error("loopback listener");
+	if ((fds[0] = otpConnect("localhost", ntohs(addr.sin_port))) < 0 || (fds[1] = accept(listenFD, NULL, NULL)) < 0)
+		error("loopback connection");
+	close(listenFD);
+}
+
+/***********************************************************************************************
+ * Function: sweep
+ * Description: This function runs every benchmark on sizes from SWEEP_MIN to maxSize and prints
+ * 		them as CSV: benchmark,variant,bytes,ns_per_byte,gb_per_s,cycles_per_byte. The
+ * 		variant is the kernel, otpCheckTexts uses the default one, and cycles are those
+ * 		of the time stamp counter (0 without one).
+ * Arguments: maxSize: size_t, the largest message
+ * Return: 0; exits with 1 on errors
+ * **********************************************************************************************/
+static int sweep(size_t maxSize)
+{
+	static const struct { const char* name; void (*run)(struct sweep*, size_t); } kernelBenchmarks[] = {
+		{ "encode", runEncode }, { "decode", runDecode }, { "validate", runValidate },
+		{ "pack", runPack }, { "unpack", runUnpack },
+	};
+	struct sweep sw;
+	int nkernels, i, j, fds[2];
+	size_t n, socketMax = maxSize < SOCKET_MAX ? maxSize : SOCKET_MAX;
+	unsigned char seed[32] = { 0 };
+	pthread_t reader;
+	const struct otpKernel* kernels = otpKernels(&nkernels);
+
+	memset(&sw, 0, sizeof(sw));
+	sw.text = malloc(maxSize);
+	sw.key = malloc(maxSize);
+	sw.out = malloc(maxSize);
+	sw.packed = malloc(OTP_PACKED_LENGTH(maxSize));
+	if (!sw.text || !sw.key || !sw.out || !sw.packed)
+		error("Fail to allocate memory for benchmark buffers");
+	srand(1);
+	fillText(sw.text, maxSize, 0);
+	fillText(sw.key, maxSize, 0);
+	otpRandInit(&sw.rng, seed, 0);
+
+	printf("benchmark,variant,bytes,ns_per_byte,gb_per_s,cycles_per_byte\n");
+	for (i = 0; i < nkernels; i++)
+	{
+		sw.kernel = &kernels[i];
+		if (!sw.kernel->supported())
+			continue;
+		for (j = 0; j < (int)(sizeof(kernelBenchmarks) / sizeof(kernelBenchmarks[0])); j++)
+			for (n = SWEEP_MIN; n <= maxSize; n *= 4)
+				measure(kernelBenchmarks[j].name, sw.kernel->name, kernelBenchmarks[j].run, &sw, n);
+	}
+	for (n = SWEEP_MIN; n <= maxSize; n *= 4)
+		measure("checktexts", otpKernelName(), runCheckTexts, &sw, n);
+	for (n = SWEEP_MIN; n <= maxSize; n *= 4)
+		measure("keygen", "chacha20", runKeygen, &sw, n);
+
+	//the socket helpers, with the reader on its own thread
+	for (i = 0; i < 2; i++)
+	{
+		if (i == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+			error("socketpair");
+		if (i == 1)
+			loopbackPair(fds);
+		otpSizeSocketBuffers(fds[0], socketMax);
+		otpSizeSocketBuffers(fds[1], socketMax);
+		sw.socketFD = fds[0];
+		if (pthread_create(&reader, NULL, socketReader, &fds[1]) != 0)
+			error("socket reader");
+		for (n = SWEEP_MIN; n <= socketMax; n *= 4)
+			measure("socket", i == 0 ? "socketpair" : "loopback", runSocket, &sw, n);
+		close(fds[0]); //the reader sees EOF and exits
+		pthread_join(reader, NULL);
+	}
+
+	free(sw.text);
+	free(sw.key);
+	free(sw.out);
+	free(sw.packed);
+	return 0;
+}
+
+//USAGE: bench_kernels [megabytes]
+//       bench_kernels --csv [maxBytes]
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "--csv") == 0)
+		return sweep(argc > 2 ? (size_t)atoll(argv[2]) : SWEEP_MAX);
+
+	size_t n = (argc > 1 ? (size_t)atol(argv[1]) : 64) << 20;
+	int nkernels, i, j, rep, reps = 5;
+	size_t offset;
+	const struct otpKernel* kernels = otpKernels(&nkernels);
+	const struct otpKernel* scalar = &kernels[nkernels - 1];
+
+	char *text = malloc(n), *key = malloc(n), *out = malloc(n), *expected = malloc(n);
+	unsigned char *packed = malloc(OTP_PACKED_LENGTH(n)), *packedExpected = malloc(OTP_PACKED_LENGTH(n));
+	if (!text || !key || !out || !expected || !packed || !packedExpected)
+		error("Fail to allocate memory for benchmark buffers");
+
+	printf("default kernel: %s, message size: %zu bytes\n", otpKernelName(), n);
+	for (i = 0; i < nkernels; i++)
+	{
+		const struct otpKernel* kernel = &kernels[i];
+		double start, encodeTime = 1e30, decodeTime = 1e30, validateTime = 1e30, packTime = 1e30, unpackTime = 1e30;
+		if (!kernel->supported())
+		{
+			printf("%-8s not supported by this CPU\n", kernel->name);
+			continue;
+		}
+
+		//check that the output is byte-identical to the scalar kernel
+		srand(1);
+		fillText(text, n, 1);
+		fillText(key, n, 1);
+		if (scalar->encode(text, key, expected, n) != kernel->encode(text, key, out, n) ||
+		    memcmp(expected, out, n) != 0) { fprintf(stderr, "%s: encode mismatch\n", kernel->name); exit(1); }
+		if (scalar->decode(text, key, expected, n) != kernel->decode(text, key, out, n) ||
+		    memcmp(expected, out, n) != 0) { fprintf(stderr, "%s: decode mismatch\n", kernel->name); exit(1); }
+		if (scalar->pack(text, packedExpected, n) != kernel->pack(text, packed, n) ||
+		    memcmp(packedExpected, packed, OTP_PACKED_LENGTH(n)) != 0) { fprintf(stderr, "%s: pack mismatch\n", kernel->name); exit(1); }
+		scalar->unpack(packed, expected, n);
+		kernel->unpack(packed, out, n);
+		if (memcmp(expected, out, n) != 0) { fprintf(stderr, "%s: unpack mismatch\n", kernel->name); exit(1); }
+		//and that the first invalid character is found at the same place from anywhere
+		for (j = 0; j < 1000; j++)
+		{
+			offset = (size_t)rand() % n;
+			if (scalar->validate(text + offset, n - offset) != kernel->validate(text + offset, n - offset) ||
+			    scalar->encode(text + offset, key + offset, expected, n - offset < 8192 ? n - offset : 8192) !=
+			    kernel->encode(text + offset, key + offset, out, n - offset < 8192 ? n - offset : 8192))
+			{
+				fprintf(stderr, "%s: invalid character mismatch at offset %zu\n", kernel->name, offset);
+				exit(1);
+			}
+		}
+
+		//time valid input, keeping the best of several runs
+		fillText(text, n, 0);
+		fillText(key, n, 0);
+		for (rep = 0; rep < reps; rep++)
+		{
+			start = now();
+			kernel->encode(text, key, out, n);
+			if (now() - start < encodeTime) encodeTime = now() - start;
+			start = now();
+			kernel->decode(out, key, text, n);
+			if (now() - start < decodeTime) decodeTime = now() - start;
+			start = now();
+			if (kernel->validate(text, n) != n) { fprintf(stderr, "%s: valid text rejected\n", kernel->name); exit(1); }
+			if (now() - start < validateTime) validateTime = now() - start;
+			start = now();
+			kernel->pack(text, packed, n);
+			if (now() - start < packTime) packTime = now() - start;
+			start = now();
+			kernel->unpack(packed, out, n);
+			if (now() - start < unpackTime) unpackTime = now() - start;
+			if (memcmp(text, out, n) != 0) { fprintf(stderr, "%s: pack round trip mismatch\n", kernel->name); exit(1); }
+		}
+		printf("%-8s encode %7.2f GB/s   decode %7.2f GB/s   validate %7.2f GB/s   pack %7.2f GB/s   unpack %7.2f GB/s\n",
+				kernel->name, n / encodeTime / 1e9, n / decodeTime / 1e9, n / validateTime / 1e9,
+				n / packTime / 1e9, n / unpackTime / 1e9);
+	}
+
+	free(text);
+	free(key);
+	free(out);
+	free(expected);
+	free(packed);
+	free(packedExpected);
+	return 0;
+}
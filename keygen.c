@@ -1,17 +1,26 @@
 /**************************************************************************************
  * Author: Xiaoqiong Dong
  * Date: Nov 24, 2018
- * Description: This program creates a newline ended string of randomaly generated 
+ * Description: This program creates a newline ended string of randomaly generated
  * 		characters of A-Z and space. The number of random characters are passed
  * 		in commandline. The string is outputted to stdout.
+ * 		The characters come from a ChaCha20 stream seeded by getrandom() and
+ * 		are written in large blocks.
+ * 		With -o padfile the string is written to padfile instead, and with
+ * 		-j N it is generated by N threads, each filling its own region of
+ * 		the file from its own ChaCha20 stream.
  *************************************************************************************/
 
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
-#include <time.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include "otp_rand.h"
+
+#define KEYGEN_BUFSIZE (1 << 20) //characters generated per write
 
 /**************************************************************************************
  * Function: error
@@ -27,37 +36,180 @@ void error (const char* msg)
 	exit(1);
 }
 
+//write all n bytes of buf to fd, retrying on partial writes and interrupts
+void writeAll(int fd, const char* buf, size_t n)
+{
+	ssize_t written;
+	while (n > 0)
+	{
+		written = write(fd, buf, n);
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			error("ERROR writing to stdout");
+		}
+		buf += written;
+		n -= written;
+	}
+}
+
+//the region of the pad file generated by one worker thread
+struct region
+{
+	int fd;
+	const unsigned char* seed;
+	int stream; //the worker's own ChaCha20 stream number
+	long long start, length;
+};
+
+/**************************************************************************************
+ * Function: generateRegion
+ * Description: thread function that fills one region of the pad file with key
+ * 		characters from the region's own ChaCha20 stream
+ * Argument: arg, struct region*, the region to fill
+ * Return: NULL
+ * Postcondition: the region of the file holds random characters; the program exits
+ * 		  with 1 if writing fails
+ * ***********************************************************************************/
+void* generateRegion(void* arg)
+{
+	struct region* r = arg;
+	struct otpRand rng;
+	long long offset = r->start, end = r->start + r->length;
+	size_t chunk, done;
+	ssize_t written;
+	char* key = malloc(KEYGEN_BUFSIZE);
+	if (!key) error("ERROR allocating memory in keygen");
+
+	otpRandInit(&rng, r->seed, r->stream);
+	while (offset < end)
+	{
+		chunk = end - offset < KEYGEN_BUFSIZE ? (size_t)(end - offset) : KEYGEN_BUFSIZE;
+		otpRandKey(&rng, key, chunk);
+		for (done = 0; done < chunk; done += written)
+		{
+			written = pwrite(r->fd, key + done, chunk - done, offset + done);
+			if (written < 0)
+			{
+				if (errno == EINTR) { written = 0; continue; }
+				error("ERROR writing to pad file");
+			}
+		}
+		offset += chunk;
+	}
+	free(key);
+	return NULL;
+}
+
+/**************************************************************************************
+ * Function: generatePad
+ * Description: creates padfile holding n random characters and a new line character,
+ * 		split into nthreads regions that are generated in parallel
+ * Argument: padfile, const char*, the file to create or truncate
+ * 	     n, long long, the number of random characters
+ * 	     nthreads, int, the number of worker threads
+ * 	     seed, const unsigned char*, the seed shared by the workers' streams
+ * Return: N/A
+ * Postcondition: padfile is written, or the program exits with 1 on error
+ * ***********************************************************************************/
+void generatePad(const char* padfile, long long n, int nthreads, const unsigned char* seed)
+{
+	int fd = open(padfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) error("ERROR opening pad file");
+	//preallocate the whole file so the workers never extend it concurrently
+	int err = posix_fallocate(fd, 0, n + 1);
+	if (err == EOPNOTSUPP || err == EINVAL)
+		err = ftruncate(fd, n + 1) < 0 ? errno : 0;
+	if (err) { errno = err; error("ERROR allocating pad file"); }
+
+	pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+	struct region* regions = malloc(nthreads * sizeof(struct region));
+	if (!threads || !regions) error("ERROR allocating memory in keygen");
+	int i;
+	long long start = 0;
+	for (i = 0; i < nthreads; i++)
+	{
+		regions[i].fd = fd;
+		regions[i].seed = seed;
+		regions[i].stream = i + 1; //stream 0 is used by the single-threaded mode
+		regions[i].start = start;
+		regions[i].length = n / nthreads + (i < n % nthreads);
+		start += regions[i].length;
+		if ((err = pthread_create(&threads[i], NULL, generateRegion, &regions[i])) != 0)
+		{
+			errno = err;
+			error("ERROR creating worker thread");
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (pwrite(fd, "\n", 1, n) != 1)
+		error("ERROR writing to pad file");
+	if (close(fd) < 0)
+		error("ERROR closing pad file");
+	free(threads);
+	free(regions);
+}
+
+//USAGE: keygen [-j threads] [-o padfile] length
 int main(int argc, char* argv[])
 {
+	int opt, nthreads = 1;
+	const char* padfile = NULL;
+	while ((opt = getopt(argc, argv, "j:o:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'j': nthreads = atoi(optarg);
+				  break;
+			case 'o': padfile = optarg;
+				  break;
+			default: optind = argc; //print the usage below
+				 break;
+		}
+	}
+
 	//checking the commandline
-	if (argc < 2)
+	if (optind != argc - 1 || nthreads < 1 || (nthreads > 1 && !padfile))
 	{
-		fprintf(stderr, "USAGE: %s length\n", argv[0]);
+		fprintf(stderr, "USAGE: %s [-j threads -o padfile] length\n", argv[0]);
+		exit(1);
+	}
+
+	char* end;
+	errno = 0;
+	long long n = strtoll(argv[optind], &end, 10);
+	if (errno || *end != '\0' || n < 0)
+	{
+		fprintf(stderr, "%s: invalid length \"%s\"\n", argv[0], argv[optind]);
 		exit(1);
 	}
 
-	int n = atoi(argv[1]);
 	//seed the random generator
-	srand(time(0));
-	
-	//print out randomaly generated characters one by one
-	int i, c;
-	char key;
-	for (i=0; i<n; i++)
+	struct otpRand rng;
+	unsigned char seed[32];
+	if (otpRandSeed(&rng, seed) < 0)
+		error("ERROR seeding the random generator");
+
+	if (padfile)
 	{
-		c = rand() % 27; //27 valid characters: A-Z and space
-		if (c >= 0 && c <= 25)   // A-Z
-			key = (char)(c + 65);
-		else	// space
-			key = ' ';
-		if (write(STDOUT_FILENO, &key, 1) < 0)
-			error("ERROR writing to stdout");
+		generatePad(padfile, n, nthreads, seed);
+		return 0;
 	}
 
-	//write a new line character at the end
-	key = '\n';
-	if (write(STDOUT_FILENO, &key, 1) < 0)
-		error("ERROR writing to stdout");
+	//generate the characters a buffer at a time, ending with a new line character
+	char* key = malloc(KEYGEN_BUFSIZE + 1);
+	if (!key) error("ERROR allocating memory in keygen");
+	size_t chunk;
+	do {
+		chunk = n < KEYGEN_BUFSIZE ? (size_t)n : KEYGEN_BUFSIZE;
+		otpRandKey(&rng, key, chunk);
+		n -= chunk;
+		if (n == 0)
+			key[chunk++] = '\n';
+		writeAll(STDOUT_FILENO, key, chunk);
+	} while (n > 0);
+	free(key);
 	return 0;
 }
-
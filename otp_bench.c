@@ -0,0 +1,1183 @@
+/**************************************************************************************
+ * Description: This program puts load on otp_enc_d, otp_dec_d or otp_d and reports
+ * 		the throughput and the latency distribution of the requests. It speaks
+ * 		the wire protocol itself: protocol v2 (plain or packed) over persistent
+ * 		connections, or the original protocol with a connection per request,
+ * 		all driven from a few epoll threads (or, with --engine, from the client
+ * 		library's own engine, otpV2TransferAll). Requests are issued closed loop
+ * 		(each connection keeps --depth requests in flight) or open loop (at
+ * 		--rate requests/s whatever the replies do), with sizes drawn from a
+ * 		distribution or replayed from a trace of sizes and arrival times.
+ * 		Latencies go into a log-linear histogram (HDR style, within 0.4%).
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "otp_codec.h"
+#include "otp_io.h"
+#include "otp_protocol.h"
+#include "otp_rand.h"
+
+#define HIST_SUB_BITS 8 //each power of two is split into 128 buckets
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+#define PACKED_WINDOW OTP_PACKED_LENGTH(OTP_STREAM_WINDOW)
+#define MAX_EVENTS 256
+
+enum wire { WIRE_V1, WIRE_V2, WIRE_PACKED };
+enum outcome { OUTCOME_OK, OUTCOME_REFUSED, OUTCOME_BUSY, OUTCOME_FAILED };
+enum sizeKind { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP, SIZE_LOGNORMAL, SIZE_MIX };
+
+//latencies in ns: values below 256 exactly, larger ones in 128 buckets per power of two
+struct histogram
+{
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t n, min, max;
+};
+
+//the message sizes of --size
+struct sizeDist
+{
+	enum sizeKind kind;
+	double a, b; //fixed: a; uniform: a to b; exp: mean a; lognormal: median a, sigma b
+	int n; //mix: n sizes, each with its cumulative weight
+	uint64_t* sizes;
+	double* weights;
+};
+
+//a line of a --trace file: arrival time (or -1) and size
+struct traceEntry
+{
+	double at;
+	uint64_t length;
+};
+
+//a request: when it arrived (or was issued, closed loop) and its size
+struct pending
+{
+	double start;
+	uint64_t length;
+};
+
+//one connection of a worker (with --v1 one request slot, with a connection per request)
+struct connection
+{
+	int fd; //-1 while a --v1 slot is idle
+	int connected; //--v1: the non-blocking connect has finished
+	uint32_t generation; //--v1: tells events of the slot's earlier sockets apart
+	struct pending* slots; //request i is in slots[i % depth]
+	uint64_t issued, uploadedN, completedN; //requests so far
+	uint64_t sent, received; //bytes of the request being uploaded and the one being downloaded
+	uint64_t upLength; //everything the request being uploaded sends
+	uint64_t downPayload; //bytes of transformed text of the request being downloaded
+	unsigned char upFrame[OTP_FRAME_LENGTH], downFrame[OTP_FRAME_LENGTH];
+	unsigned char* stage; //packed: the last, partial window of the request being uploaded
+	uint64_t staged; //its length
+};
+
+//the run, shared by its workers
+struct bench
+{
+	enum wire wire;
+	int op; //OTP_V2_OP_ENCODE or OTP_V2_OP_DECODE
+	const char *host, *handshake;
+	struct sockaddr_in address; //of the daemon
+	int connections, depth, threads;
+	double rate; //open loop: requests/s, 0 for closed loop
+	int poisson; //open loop: exponential gaps between arrivals instead of fixed ones
+	double duration; //seconds of issuing requests, 0 for no limit
+	uint64_t requests; //requests to issue, 0 for no limit
+	struct sizeDist sizes;
+	struct traceEntry* trace;
+	size_t nTrace;
+	int timedTrace; //the trace has arrival times
+	int engine; //the workers run their connections with otpV2TransferAll
+	char* pattern; //OTP_STREAM_WINDOW characters: every window of text and key
+	unsigned char* packedPattern; //and packed
+	double start, end;
+};
+
+//a thread of the run, with its share of the connections and of the requests
+struct worker
+{
+	struct bench* bench;
+	int index, epollFD;
+	struct connection* conns;
+	int nConns, cursor; //cursor: the connection next offered an arrival
+	uint64_t budget; //requests left to issue
+	int stopped; //no more requests are issued
+	uint64_t inFlight;
+	struct pending* backlog; //open loop: arrivals waiting for a free connection
+	size_t backlogHead, backlogCount, backlogSize, backlogMax;
+	double nextArrival;
+	size_t traceNext;
+	uint64_t rng;
+	char* sink; //transformed text is received here and dropped
+	struct histogram hist;
+	uint64_t outcomes[4], bytes;
+	double last; //time of the last completion
+	pthread_t thread;
+};
+
+//reporting error
+void error(const char* msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+//current time of the monotonic clock in seconds
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//splitmix64: a uniform double in [0, 1) from the worker's generator
+static double uniform(uint64_t* state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return ((z ^ (z >> 31)) >> 11) * 0x1.0p-53;
+}
+
+//histogram bucket of v
+static int histIndex(uint64_t v)
+{
+	int shift;
+	if (v < 2 * HIST_HALF)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+	return shift * HIST_HALF + (v >> shift);
+}
+
+//the middle of histogram bucket i
+static uint64_t histValue(int i)
+{
+	int shift;
+	if (i < 2 * HIST_HALF)
+		return i;
+	shift = i / HIST_HALF - 1;
+	return ((uint64_t)(i - shift * HIST_HALF) << shift) + ((1ULL << shift) - 1) / 2;
+}
+
+static void histRecord(struct histogram* h, uint64_t v)
+{
+	h->counts[histIndex(v)]++;
+	if (h->n++ == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void histMerge(struct histogram* into, const struct histogram* h)
+{
+	int i;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		into->counts[i] += h->counts[i];
+	if (h->n && (into->n == 0 || h->min < into->min))
+		into->min = h->min;
+	if (h->max > into->max)
+		into->max = h->max;
+	into->n += h->n;
+}
+
+//the smallest value at least a fraction p of the values are not above
+static uint64_t histPercentile(const struct histogram* h, double p)
+{
+	uint64_t rank = (uint64_t)ceil(p * h->n), seen = 0, v;
+	int i;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if ((seen += h->counts[i]) >= rank)
+			break;
+	v = histValue(i);
+	return v < h->min ? h->min : v > h->max ? h->max : v;
+}
+
+//a size with an optional K, M or G suffix (powers of 1024). Returns 0 if s is not one
+static uint64_t parseSize(const char* s, char** end)
+{
+	uint64_t n = strtoull(s, end, 10);
+	if (*end == s)
+		return 0;
+	switch (**end)
+	{
+		case 'K': n <<= 10; (*end)++; break;
+		case 'M': n <<= 20; (*end)++; break;
+		case 'G': n <<= 30; (*end)++; break;
+	}
+	return n;
+}
+
+/***********************************************************************************************
+ * Function: parseSizes
+ * Description: This function reads a --size spec: N (fixed), uniform:A:B, exp:MEAN,
+ * 		lognormal:MEDIAN:SIGMA or mix:N@W,N@W,... (N chosen with weight W). Sizes take a
+ * 		K, M or G suffix.
+ * Arguments: spec: const char*, the spec
+ * 	      dist: struct sizeDist*, filled in
+ * Return: 0, or -1 if the spec is malformed
+ * **********************************************************************************************/
+static int parseSizes(const char* spec, struct sizeDist* dist)
+{
+	char* end;
+	const char* p;
+	double total = 0;
+	memset(dist, 0, sizeof(*dist));
+	if (strncmp(spec, "uniform:", 8) == 0)
+	{
+		dist->kind = SIZE_UNIFORM;
+		dist->a = parseSize(spec + 8, &end);
+		if (*end != ':')
+			return -1;
+		dist->b = parseSize(end + 1, &end);
+		return *end || dist->a < 1 || dist->b < dist->a ? -1 : 0;
+	}
+	if (strncmp(spec, "exp:", 4) == 0)
+	{
+		dist->kind = SIZE_EXP;
+		dist->a = parseSize(spec + 4, &end);
+		return *end || dist->a < 1 ? -1 : 0;
+	}
+	if (strncmp(spec, "lognormal:", 10) == 0)
+	{
+		dist->kind = SIZE_LOGNORMAL;
+		dist->a = parseSize(spec + 10, &end);
+		if (*end != ':')
+			return -1;
+		dist->b = strtod(end + 1, &end);
+		return *end || dist->a < 1 || dist->b < 0 ? -1 : 0;
+	}
+	if (strncmp(spec, "mix:", 4) == 0)
+	{
+		dist->kind = SIZE_MIX;
+		for (p = spec + 4, dist->n = 1; (p = strchr(p, ',')); p++)
+			dist->n++;
+		dist->sizes = malloc(dist->n * sizeof(uint64_t));
+		dist->weights = malloc(dist->n * sizeof(double));
+		if (!dist->sizes || !dist->weights)
+			error("Fail to allocate memory for the sizes");
+		for (p = spec + 4, dist->n = 0; *p; p = end + (*end == ','))
+		{
+			dist->sizes[dist->n] = parseSize(p, &end);
+			if (*end != '@' || dist->sizes[dist->n] < 1)
+				return -1;
+			total += strtod(end + 1, &end);
+			dist->weights[dist->n++] = total;
+			if (*end && *end != ',')
+				return -1;
+		}
+		return dist->n && total > 0 ? 0 : -1;
+	}
+	dist->kind = SIZE_FIXED;
+	dist->a = parseSize(spec, &end);
+	return *end || dist->a < 1 ? -1 : 0;
+}
+
+//a size from the distribution, at least 1
+static uint64_t drawSize(const struct sizeDist* dist, uint64_t* rng)
+{
+	double x = dist->a, u;
+	int i;
+	switch (dist->kind)
+	{
+		case SIZE_FIXED: break;
+		case SIZE_UNIFORM: x = dist->a + floor(uniform(rng) * (dist->b - dist->a + 1));
+				   break;
+		case SIZE_EXP: x = -dist->a * log(1 - uniform(rng));
+			       break;
+		case SIZE_LOGNORMAL: u = uniform(rng); //Box-Muller
+				     x = dist->a * exp(dist->b * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * uniform(rng)));
+				     break;
+		case SIZE_MIX: u = uniform(rng) * dist->weights[dist->n - 1];
+			       for (i = 0; i < dist->n - 1 && u >= dist->weights[i]; i++);
+			       x = dist->sizes[i];
+			       break;
+	}
+	return x < 1 ? 1 : x > 9e9 ? 9e9 : (uint64_t)x; //the original protocol's length field has 10 digits
+}
+
+/***********************************************************************************************
+ * Function: loadTrace
+ * Description: This function reads a --trace file. Each line is "seconds length" (the request
+ * 		arrives that many seconds after the start) or just "length"; all lines must be of
+ * 		the same kind, and '#' starts a comment.
+ * Arguments: path: const char*, the trace file
+ * 	      b: struct bench*, gets the entries
+ * Postcondition: the program exits with 1 if the file cannot be read or is malformed
+ * **********************************************************************************************/
+static void loadTrace(const char* path, struct bench* b)
+{
+	FILE* file = fopen(path, "r");
+	char* line = NULL;
+	size_t size = 0, capacity = 0, lineNo = 0;
+	double first, second;
+	int fields, timed = -1;
+	if (!file)
+		error("Fail to open the trace");
+	while (getline(&line, &size, file) > 0)
+	{
+		lineNo++;
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		fields = sscanf(line, "%lf %lf", &first, &second);
+		if (fields <= 0)
+			continue;
+		if ((timed >= 0 && fields - 1 != timed) || first < 0 || (fields == 2 && second < 1))
+		{
+			fprintf(stderr, "%s:%zu: expected \"seconds length\" or \"length\" on every line\n", path, lineNo);
+			exit(1);
+		}
+		timed = fields - 1;
+		if (b->nTrace == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 1024;
+			if (!(b->trace = realloc(b->trace, capacity * sizeof(struct traceEntry))))
+				error("Fail to allocate memory for the trace");
+		}
+		b->trace[b->nTrace].at = timed ? first : -1;
+		b->trace[b->nTrace++].length = timed ? second : first;
+	}
+	free(line);
+	fclose(file);
+	if (b->nTrace == 0)
+	{
+		fprintf(stderr, "%s: no requests in the trace\n", path);
+		exit(1);
+	}
+	b->timedTrace = timed;
+}
+
+//the size of the worker's next request
+static uint64_t nextSize(struct worker* w)
+{
+	struct bench* b = w->bench;
+	uint64_t length;
+	if (!b->trace)
+		return drawSize(&b->sizes, &w->rng);
+	//an untimed trace is cycled through; a timed one ends the run (see advanceArrival)
+	length = b->trace[w->traceNext % b->nTrace].length;
+	w->traceNext += b->threads;
+	return length;
+}
+
+//requests a connection can still take
+static uint64_t freeSlots(const struct worker* w, const struct connection* c)
+{
+	uint64_t busy = c->issued - (c->uploadedN < c->completedN ? c->uploadedN : c->completedN);
+	if (w->bench->wire == WIRE_V1 && c->fd >= 0)
+		return 0;
+	return w->bench->depth - busy;
+}
+
+//start a --v1 request's connection; it joins the worker's epoll once connect has begun
+static void openRequest(struct worker* w, struct connection* c)
+{
+	struct epoll_event event;
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd < 0)
+		error("BENCH: ERROR opening socket");
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	if (connect(c->fd, (struct sockaddr*)&w->bench->address, sizeof(w->bench->address)) < 0 && errno != EINPROGRESS)
+		error("BENCH: ERROR connecting");
+	c->connected = 0;
+	c->generation++;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.u64 = (uint64_t)c->generation << 32 | (uint64_t)(c - w->conns);
+	if (epoll_ctl(w->epollFD, EPOLL_CTL_ADD, c->fd, &event) < 0)
+		error("BENCH: ERROR adding a socket to epoll");
+}
+
+//hand request p to connection c, which has a free slot
+static void issue(struct worker* w, struct connection* c, struct pending p)
+{
+	c->slots[c->issued++ % w->bench->depth] = p;
+	w->inFlight++;
+	if (w->bench->wire == WIRE_V1)
+		openRequest(w, c);
+}
+
+//the oldest arrival waiting for a connection, removed
+static struct pending takeBacklog(struct worker* w)
+{
+	struct pending p = w->backlog[w->backlogHead];
+	w->backlogHead = (w->backlogHead + 1) % w->backlogSize;
+	w->backlogCount--;
+	return p;
+}
+
+static void addBacklog(struct worker* w, struct pending p)
+{
+	size_t i;
+	struct pending* grown;
+	if (w->backlogCount == w->backlogSize)
+	{
+		//unroll the ring into a buffer twice the size
+		if (!(grown = malloc((w->backlogSize ? 2 * w->backlogSize : 1024) * sizeof(struct pending))))
+			error("Fail to allocate memory for the backlog");
+		for (i = 0; i < w->backlogCount; i++)
+			grown[i] = w->backlog[(w->backlogHead + i) % w->backlogSize];
+		free(w->backlog);
+		w->backlog = grown;
+		w->backlogHead = 0;
+		w->backlogSize = w->backlogSize ? 2 * w->backlogSize : 1024;
+	}
+	w->backlog[(w->backlogHead + w->backlogCount++) % w->backlogSize] = p;
+	if (w->backlogCount > w->backlogMax)
+		w->backlogMax = w->backlogCount;
+}
+
+//give connection c new requests if it has room: the next ones of a closed loop, or waiting arrivals
+static void refill(struct worker* w, struct connection* c)
+{
+	struct pending p;
+	while (freeSlots(w, c) > 0)
+	{
+		if (w->bench->rate > 0 || w->bench->timedTrace)
+		{
+			if (w->backlogCount == 0)
+				return;
+			p = takeBacklog(w);
+		}
+		else
+		{
+			if (w->stopped)
+				return;
+			p.start = now();
+			p.length = nextSize(w);
+			if (--w->budget == 0)
+				w->stopped = 1;
+		}
+		issue(w, c, p);
+	}
+}
+
+//account for the request at the head of connection c
+static void finish(struct worker* w, struct connection* c, enum outcome outcome)
+{
+	struct pending* p = &c->slots[c->completedN % w->bench->depth];
+	double t = now();
+	w->outcomes[outcome]++;
+	if (outcome == OUTCOME_OK)
+	{
+		histRecord(&w->hist, (uint64_t)((t - p->start) * 1e9));
+		w->bytes += p->length;
+	}
+	w->last = t;
+	w->inFlight--;
+	c->completedN++;
+	c->received = 0;
+	if (w->bench->wire == WIRE_V1)
+	{
+		if (c->uploadedN < c->completedN) //cut short by the daemon
+		{
+			c->uploadedN++;
+			c->sent = 0;
+		}
+		close(c->fd);
+		c->fd = -1;
+	}
+	refill(w, c);
+}
+
+//what connection c sends next. Returns 0 if it has nothing to send
+static int uploadSegment(struct worker* w, struct connection* c, const char** segment, size_t* len)
+{
+	static const char nul = '\0';
+	struct bench* b = w->bench;
+	struct pending* p;
+	struct otpFrame frame;
+	uint64_t pos, unit, window, wire, within;
+	const unsigned char* packed;
+	if (c->uploadedN == c->issued)
+		return 0;
+	p = &c->slots[c->uploadedN % b->depth];
+	if (c->sent == 0 && b->wire == WIRE_V1)
+	{
+		//handshake and length field (with the text's '\0'), then text, '\0', key, '\0'
+		memset(c->upFrame, 0, sizeof(c->upFrame));
+		memcpy(c->upFrame, b->handshake, OTP_HANDSHAKE_LENGTH);
+		snprintf((char*)c->upFrame + OTP_HANDSHAKE_LENGTH, OTP_LENGTH_FIELD, "%llu", (unsigned long long)p->length + 1);
+		c->upLength = OTP_HANDSHAKE_LENGTH + OTP_LENGTH_FIELD + 2 * (p->length + 1);
+	}
+	else if (c->sent == 0)
+	{
+		frame.id = (uint32_t)c->uploadedN;
+		frame.code = b->op;
+		frame.flags = OTP_V2_FLAG_CHECK;
+		frame.length = p->length;
+		otpPackFrame(c->upFrame, &frame);
+		c->upLength = OTP_FRAME_LENGTH + 2 * (b->wire == WIRE_PACKED ? OTP_PACKED_LENGTH(p->length) : p->length);
+	}
+	if (b->wire == WIRE_V1)
+	{
+		if (c->sent < OTP_HANDSHAKE_LENGTH + OTP_LENGTH_FIELD)
+		{
+			*segment = (const char*)c->upFrame + c->sent;
+			*len = OTP_HANDSHAKE_LENGTH + OTP_LENGTH_FIELD - c->sent;
+			return 1;
+		}
+		within = (c->sent - OTP_HANDSHAKE_LENGTH - OTP_LENGTH_FIELD) % (p->length + 1);
+		if (within == p->length)
+		{
+			*segment = &nul;
+			*len = 1;
+		}
+		else
+		{
+			*segment = b->pattern + within % OTP_STREAM_WINDOW;
+			*len = OTP_STREAM_WINDOW - within % OTP_STREAM_WINDOW;
+			if (*len > p->length - within)
+				*len = p->length - within;
+		}
+		return 1;
+	}
+	if (c->sent < OTP_FRAME_LENGTH)
+	{
+		*segment = (const char*)c->upFrame + c->sent;
+		*len = OTP_FRAME_LENGTH - c->sent;
+		return 1;
+	}
+	//text and key alternate window by window; both are the pattern
+	pos = c->sent - OTP_FRAME_LENGTH;
+	unit = 2 * (b->wire == WIRE_PACKED ? PACKED_WINDOW : OTP_STREAM_WINDOW);
+	window = p->length - pos / unit * OTP_STREAM_WINDOW;
+	if (window > OTP_STREAM_WINDOW)
+		window = OTP_STREAM_WINDOW;
+	wire = b->wire == WIRE_PACKED ? OTP_PACKED_LENGTH(window) : window;
+	within = pos % unit % wire;
+	if (b->wire != WIRE_PACKED)
+		*segment = b->pattern + within;
+	else
+	{
+		packed = b->packedPattern;
+		if (window < OTP_STREAM_WINDOW)
+		{
+			if (c->staged != window)
+				otpPack(b->pattern, c->stage, window);
+			c->staged = window;
+			packed = c->stage;
+		}
+		*segment = (const char*)packed + within;
+	}
+	*len = wire - within;
+	return 1;
+}
+
+//account for r bytes of the segment uploadSegment gave
+static void uploaded(struct connection* c, size_t r)
+{
+	if ((c->sent += r) == c->upLength)
+	{
+		c->uploadedN++;
+		c->sent = 0;
+	}
+}
+
+//where connection c receives next. Returns 0 if it waits for no reply
+static int downloadSegment(struct worker* w, struct connection* c, char** buf, size_t* len)
+{
+	struct bench* b = w->bench;
+	uint64_t head = b->wire == WIRE_V1 ? OTP_HANDSHAKE_LENGTH : OTP_FRAME_LENGTH, left;
+	if (c->completedN == c->issued)
+		return 0;
+	if (c->received < head)
+	{
+		*buf = (char*)c->downFrame + c->received;
+		*len = head - c->received;
+	}
+	else if (c->received < head + c->downPayload)
+	{
+		left = head + c->downPayload - c->received;
+		*buf = w->sink;
+		*len = left < PACKED_WINDOW ? left : PACKED_WINDOW;
+	}
+	else
+	{
+		*buf = (char*)c->downFrame + (c->received - head - c->downPayload);
+		*len = 2 * OTP_FRAME_LENGTH + c->downPayload - c->received;
+	}
+	return 1;
+}
+
+//account for r > 0 bytes received where downloadSegment said, finishing the request once its
+//reply is in
+static void downloaded(struct worker* w, struct connection* c, size_t r)
+{
+	struct bench* b = w->bench;
+	struct pending* p = &c->slots[c->completedN % b->depth];
+	struct otpFrame frame;
+	c->received += r;
+	if (b->wire == WIRE_V1)
+	{
+		if (c->received == OTP_HANDSHAKE_LENGTH)
+		{
+			c->downPayload = p->length + 1;
+			if (memcmp(c->downFrame, b->handshake, OTP_HANDSHAKE_LENGTH) != 0)
+				finish(w, c, memcmp(c->downFrame, OTP_BUSY, OTP_HANDSHAKE_LENGTH) == 0 ? OUTCOME_BUSY : OUTCOME_FAILED);
+		}
+		else if (c->received == OTP_HANDSHAKE_LENGTH + c->downPayload)
+			finish(w, c, OUTCOME_OK);
+		return;
+	}
+	if (c->received != OTP_FRAME_LENGTH && c->received != 2 * OTP_FRAME_LENGTH + c->downPayload)
+		return;
+	otpUnpackFrame(c->downFrame, &frame);
+	if (frame.id != (uint32_t)c->completedN)
+	{
+		fprintf(stderr, "BENCH: the daemon sent a reply out of order\n");
+		exit(1);
+	}
+	if (c->received == OTP_FRAME_LENGTH)
+	{
+		c->downPayload = b->wire == WIRE_PACKED ? OTP_PACKED_LENGTH(p->length) : p->length;
+		if (frame.code != OTP_V2_OK) //no payload and no check frame follow
+			finish(w, c, OUTCOME_REFUSED);
+	}
+	else
+		finish(w, c, frame.code == OTP_V2_OK ? OUTCOME_OK : OUTCOME_REFUSED);
+}
+
+//connection c failed: a --v1 request fails (or was turned away busy), a v2 run cannot go on
+static void lost(struct worker* w, struct connection* c, const char* why)
+{
+	if (w->bench->wire != WIRE_V1)
+	{
+		fprintf(stderr, "BENCH: %s: %s\n", why, strerror(errno));
+		exit(1);
+	}
+	finish(w, c, OUTCOME_FAILED);
+}
+
+//move connection c's data until the socket would block
+static void pump(struct worker* w, struct connection* c)
+{
+	const char* segment;
+	char* buf;
+	size_t len;
+	ssize_t r;
+	int fd, moved = 1;
+	while (moved && c->fd >= 0 && c->connected)
+	{
+		moved = 0;
+		fd = c->fd;
+		if (uploadSegment(w, c, &segment, &len))
+		{
+			r = send(fd, segment, len, MSG_NOSIGNAL);
+			if (r > 0)
+			{
+				uploaded(c, r);
+				moved = 1;
+			}
+			else if (errno == EINTR)
+				moved = 1;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				if (w->bench->wire != WIRE_V1)
+					lost(w, c, "ERROR writing to socket");
+				//the daemon may have turned the request away: read why
+				c->sent = 0;
+				c->uploadedN++;
+				moved = 1;
+			}
+		}
+		if (c->fd == fd && downloadSegment(w, c, &buf, &len))
+		{
+			r = recv(fd, buf, len, 0);
+			if (r > 0)
+			{
+				downloaded(w, c, r);
+				moved = 1;
+			}
+			else if (r < 0 && errno == EINTR)
+				moved = 1;
+			else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				if (r == 0)
+					errno = ECONNRESET;
+				lost(w, c, "ERROR reading from socket");
+			}
+		}
+	}
+}
+
+//offer the waiting arrivals to the connections with room, round robin
+static void dispatch(struct worker* w)
+{
+	int tried;
+	for (tried = 0; w->backlogCount > 0 && tried < w->nConns; tried++)
+	{
+		struct connection* c = &w->conns[w->cursor];
+		w->cursor = (w->cursor + 1) % w->nConns;
+		if (freeSlots(w, c) == 0)
+			continue;
+		issue(w, c, takeBacklog(w));
+		pump(w, c);
+		tried = -1; //start over: the others may have room too
+	}
+}
+
+//the time of the worker's next arrival after the current one
+static void advanceArrival(struct worker* w)
+{
+	struct bench* b = w->bench;
+	double perWorker = b->rate / b->threads;
+	if (b->timedTrace)
+	{
+		if (w->traceNext >= b->nTrace)
+			w->stopped = 1;
+		else
+			w->nextArrival = b->start + b->trace[w->traceNext].at;
+	}
+	else if (b->poisson)
+		w->nextArrival += -log(1 - uniform(&w->rng)) / perWorker;
+	else
+		w->nextArrival += 1 / perWorker;
+}
+
+//wait up to timeout seconds (forever if negative) for events, at ns resolution where the C
+//library and kernel have epoll_pwait2
+static int waitEvents(int epollFD, struct epoll_event* events, double timeout)
+{
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+	static int noPwait2;
+	struct timespec ts;
+	int n;
+	if (!noPwait2)
+	{
+		ts.tv_sec = timeout;
+		ts.tv_nsec = (timeout - ts.tv_sec) * 1e9;
+		n = epoll_pwait2(epollFD, events, MAX_EVENTS, timeout < 0 ? NULL : &ts, NULL);
+		if (n >= 0 || errno != ENOSYS)
+			return n;
+		noPwait2 = 1;
+	}
+#endif
+#endif
+	return epoll_wait(epollFD, events, MAX_EVENTS, timeout < 0 ? -1 : (int)ceil(timeout * 1e3));
+}
+
+/***********************************************************************************************
+ * Function: runWorker
+ * Description: This function is a worker thread. It issues its share of the requests on its
+ * 		connections until its budget or the run's time is used up, then waits for the
+ * 		replies still due. Open loop, a request that arrives while every connection is
+ * 		full waits in a backlog, and its latency counts from its arrival, so a slow
+ * 		daemon cannot hide its delays by slowing the arrivals down.
+ * Arguments: arg: struct worker*, the worker, with its connections set up
+ * Return: NULL
+ * **********************************************************************************************/
+static void* runWorker(void* arg)
+{
+	struct worker* w = arg;
+	struct bench* b = w->bench;
+	struct epoll_event events[MAX_EVENTS];
+	struct connection* c;
+	struct pending p;
+	double t, timeout;
+	int i, n, openLoop = b->rate > 0 || b->timedTrace;
+
+	if (openLoop)
+	{
+		//the workers' arrivals interleave
+		w->nextArrival = b->start + w->index / (b->rate > 0 ? b->rate : 1);
+		if (b->timedTrace)
+			advanceArrival(w);
+	}
+	else
+		for (i = 0; i < w->nConns; i++)
+		{
+			refill(w, &w->conns[i]);
+			pump(w, &w->conns[i]);
+		}
+	while (1)
+	{
+		t = now();
+		if (!w->stopped && b->duration > 0 && t >= b->end)
+			w->stopped = 1;
+		while (openLoop && !w->stopped && w->nextArrival <= t)
+		{
+			p.start = w->nextArrival;
+			p.length = nextSize(w);
+			addBacklog(w, p);
+			if (--w->budget == 0)
+				w->stopped = 1;
+			advanceArrival(w);
+			if (b->duration > 0 && w->nextArrival >= b->end)
+				w->stopped = 1;
+		}
+		dispatch(w);
+		if (w->stopped && w->inFlight == 0 && w->backlogCount == 0)
+			break;
+		timeout = -1; //until a reply moves
+		if (!w->stopped && openLoop)
+			timeout = w->nextArrival > t ? w->nextArrival - t : 0;
+		else if (!w->stopped && b->duration > 0)
+			timeout = b->end > t ? b->end - t : 0;
+		n = waitEvents(w->epollFD, events, timeout);
+		if (n < 0 && errno != EINTR)
+			error("BENCH: ERROR waiting for events");
+		for (i = 0; i < n; i++)
+		{
+			c = &w->conns[events[i].data.u64 & 0xffffffff];
+			if (events[i].data.u64 >> 32 != c->generation || c->fd < 0)
+				continue; //an earlier socket of a --v1 slot
+			if (!c->connected)
+			{
+				int err = 0;
+				getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &(socklen_t){ sizeof(int) });
+				if (err)
+				{
+					errno = err;
+					lost(w, c, "ERROR connecting");
+					continue;
+				}
+				c->connected = 1;
+			}
+			pump(w, c);
+		}
+	}
+	return NULL;
+}
+
+/***********************************************************************************************
+ * Function: runEngine
+ * Description: This function is a worker of --engine. Instead of its own epoll loop it hands all
+ * 		its connections to otpV2TransferAll, the engine of the client library, which
+ * 		drives them from this one thread. Each round gives every connection --depth
+ * 		requests and runs them in one call. A request completes when the call returns,
+ * 		so its latency is that of its round. Rounds go on until the budget or the run's
+ * 		time is used up.
+ * Arguments: arg: struct worker*, the worker, with its v2 connections set up
+ * Return: NULL
+ * **********************************************************************************************/
+static void* runEngine(void* arg)
+{
+	struct worker* w = arg;
+	struct bench* b = w->bench;
+	size_t slots = (size_t)w->nConns * b->depth, i, j, k;
+	struct otpChannel* channels = calloc(w->nConns, sizeof(struct otpChannel));
+	struct otpRequest* requests = calloc(slots, sizeof(struct otpRequest));
+	uint64_t* outSizes = calloc(slots, sizeof(uint64_t));
+	uint64_t textSize = OTP_STREAM_WINDOW, length;
+	char *text = malloc(textSize), *out;
+	double start, t;
+	if (!channels || !requests || !outSizes || !text)
+		error("Fail to allocate memory for the requests");
+	memcpy(text, b->pattern, OTP_STREAM_WINDOW);
+	while (!w->stopped)
+	{
+		for (i = 0; i < (size_t)w->nConns; i++)
+		{
+			channels[i] = (struct otpChannel){ w->conns[i].fd, b->op, b->wire == WIRE_PACKED, requests + i * b->depth, 0 };
+			for (j = 0; j < (size_t)b->depth && !w->stopped; j++)
+			{
+				length = nextSize(w);
+				if (--w->budget == 0)
+					w->stopped = 1;
+				//text and key are the same characters: every window is the pattern
+				for (; textSize < length; textSize += OTP_STREAM_WINDOW)
+				{
+					if (!(text = realloc(text, textSize + OTP_STREAM_WINDOW)))
+						error("Fail to allocate memory for the requests");
+					memcpy(text + textSize, b->pattern, OTP_STREAM_WINDOW);
+				}
+				k = i * b->depth + j;
+				out = requests[k].out;
+				if (length > outSizes[k])
+				{
+					if (!(out = realloc(out, length)))
+						error("Fail to allocate memory for the requests");
+					outSizes[k] = length;
+				}
+				requests[k] = (struct otpRequest){ text, text, out, length, OTP_V2_OK, 0, 0, 0 };
+				channels[i].n++;
+			}
+		}
+		start = now();
+		if (otpV2TransferAll(channels, w->nConns) < 0)
+		{
+			perror("BENCH: ERROR in the client engine");
+			for (i = 0; i < (size_t)w->nConns; i++)
+				w->outcomes[OUTCOME_FAILED] += channels[i].n;
+			break;
+		}
+		t = now();
+		for (i = 0; i < (size_t)w->nConns; i++)
+			for (j = 0; j < channels[i].n; j++)
+			{
+				struct otpRequest* request = &channels[i].requests[j];
+				if (request->status != OTP_V2_OK)
+				{
+					w->outcomes[OUTCOME_REFUSED]++;
+					continue;
+				}
+				w->outcomes[OUTCOME_OK]++;
+				histRecord(&w->hist, (uint64_t)((t - start) * 1e9));
+				w->bytes += request->length;
+			}
+		w->last = t;
+		if (b->duration > 0 && t >= b->end)
+			w->stopped = 1;
+	}
+	for (k = 0; k < slots; k++)
+		free(requests[k].out);
+	free(requests);
+	free(outSizes);
+	free(channels);
+	free(text);
+	return NULL;
+}
+
+//open worker w's connections (v2: with their handshake) and its epoll
+static void setUpWorker(struct bench* b, struct worker* w, int index)
+{
+	struct epoll_event event;
+	char answer[OTP_HANDSHAKE_LENGTH];
+	int i;
+	w->bench = b;
+	w->index = index;
+	w->rng = 0x6f74705f62656e63ULL + index;
+	w->traceNext = index;
+	w->nConns = b->connections / b->threads + (index < b->connections % b->threads);
+	w->budget = b->requests ? b->requests / b->threads + ((uint64_t)index < b->requests % b->threads) : UINT64_MAX;
+	w->stopped = w->budget == 0 || w->nConns == 0;
+	w->conns = calloc(w->nConns, sizeof(struct connection));
+	w->sink = malloc(PACKED_WINDOW);
+	w->epollFD = epoll_create1(0);
+	if (!w->conns || !w->sink)
+		error("Fail to allocate memory for the connections");
+	if (w->epollFD < 0)
+		error("BENCH: ERROR creating epoll");
+	for (i = 0; i < w->nConns; i++)
+	{
+		struct connection* c = &w->conns[i];
+		c->fd = -1;
+		c->slots = malloc(b->depth * sizeof(struct pending));
+		if (!c->slots || (b->wire == WIRE_PACKED && !(c->stage = malloc(PACKED_WINDOW))))
+			error("Fail to allocate memory for the connections");
+		if (b->wire == WIRE_V1)
+			continue;
+		c->fd = otpConnect(b->host, ntohs(b->address.sin_port));
+		if (c->fd < 0)
+			error("BENCH: ERROR connecting");
+		if (send(c->fd, b->handshake, OTP_HANDSHAKE_LENGTH, MSG_NOSIGNAL) < 0 ||
+		    otpReadFromSocket(c->fd, answer, OTP_HANDSHAKE_LENGTH) < 0)
+			error("BENCH: ERROR exchanging the handshake");
+		if (memcmp(answer, b->handshake, OTP_HANDSHAKE_LENGTH) != 0)
+		{
+			fprintf(stderr, "BENCH: the daemon answered \"%.3s\" to \"%s\"%s\n", answer, b->handshake,
+				memcmp(answer, OTP_BUSY, OTP_HANDSHAKE_LENGTH) == 0 ? ": it is busy, use fewer --connections" :
+				"; it serves the other op, or is an original daemon (--v1)");
+			exit(1);
+		}
+		if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+			error("BENCH: ERROR setting up a socket");
+		c->connected = 1;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.u64 = i;
+		if (epoll_ctl(w->epollFD, EPOLL_CTL_ADD, c->fd, &event) < 0)
+			error("BENCH: ERROR adding a socket to epoll");
+	}
+}
+
+//print the totals of the workers
+static void report(struct bench* b, struct worker* workers)
+{
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char* names[] = { "p50", "p90", "p99", "p99.9" };
+	struct histogram* all = calloc(1, sizeof(struct histogram));
+	uint64_t outcomes[4] = { 0 }, bytes = 0, total;
+	double last = b->start, seconds;
+	size_t backlogMax = 0;
+	int i, j;
+	if (!all)
+		error("Fail to allocate memory for the histogram");
+	for (i = 0; i < b->threads; i++)
+	{
+		histMerge(all, &workers[i].hist);
+		for (j = 0; j < 4; j++)
+			outcomes[j] += workers[i].outcomes[j];
+		bytes += workers[i].bytes;
+		if (workers[i].last > last)
+			last = workers[i].last;
+		if (workers[i].backlogMax > backlogMax)
+			backlogMax = workers[i].backlogMax;
+	}
+	total = outcomes[0] + outcomes[1] + outcomes[2] + outcomes[3];
+	seconds = last > b->start ? last - b->start : 1e-9;
+	printf("%llu requests in %.3f s: %.1f requests/s, %.2f MB/s of text\n", (unsigned long long)total, seconds,
+	       outcomes[OUTCOME_OK] / seconds, bytes / seconds / 1e6);
+	printf("ok %llu, refused %llu, busy %llu, failed %llu\n", (unsigned long long)outcomes[OUTCOME_OK],
+	       (unsigned long long)outcomes[OUTCOME_REFUSED], (unsigned long long)outcomes[OUTCOME_BUSY],
+	       (unsigned long long)outcomes[OUTCOME_FAILED]);
+	if (all->n)
+	{
+		printf("latency us: min %.1f", all->min / 1e3);
+		for (i = 0; i < 4; i++)
+			printf("  %s %.1f", names[i], histPercentile(all, percentiles[i]) / 1e3);
+		printf("  max %.1f\n", all->max / 1e3);
+	}
+	if (b->rate > 0 || b->timedTrace)
+		printf("open loop: %.1f requests/s offered, at most %zu waiting for a connection\n",
+		       b->timedTrace ? b->nTrace / (b->trace[b->nTrace - 1].at > 0 ? b->trace[b->nTrace - 1].at : 1e-9) : b->rate,
+		       backlogMax);
+	free(all);
+}
+
+//print the usage and exit
+static void usage(const char* name)
+{
+	fprintf(stderr, "USAGE: %s [--host H] [--op enc|dec] [--v1 | --packed] [--connections N] [--depth N]\n"
+			"\t[--threads N] [--rate R [--poisson] | --engine] [--duration S] [--requests N]\n"
+			"\t[--size N | uniform:A:B | exp:MEAN | lognormal:MEDIAN:SIGMA | mix:N@W,...] [--trace file] port\n",
+		name);
+	exit(1);
+}
+
+//USAGE: otp_bench [options] port
+int main(int argc, char* argv[])
+{
+	static const struct option options[] = {
+		{ "host", required_argument, NULL, 'h' },
+		{ "op", required_argument, NULL, 'o' },
+		{ "v1", no_argument, NULL, '1' },
+		{ "packed", no_argument, NULL, 'k' },
+		{ "connections", required_argument, NULL, 'c' },
+		{ "depth", required_argument, NULL, 'd' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "poisson", no_argument, NULL, 'p' },
+		{ "duration", required_argument, NULL, 'D' },
+		{ "requests", required_argument, NULL, 'n' },
+		{ "size", required_argument, NULL, 's' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "engine", no_argument, NULL, 'e' },
+		{ NULL, 0, NULL, 0 },
+	};
+	static const char* handshakes[3][2] = { { "enc", "dec" }, { OTP_V2_ENC, OTP_V2_DEC },
+						{ OTP_V2_PACKED_ENC, OTP_V2_PACKED_DEC } };
+	struct bench b;
+	struct worker* workers;
+	struct hostent* host;
+	struct otpRand rng;
+	unsigned char seed[32] = { 0 };
+	const char* sizeSpec = "1000";
+	int i, opt, durationGiven = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.host = "localhost";
+	b.wire = WIRE_V2;
+	b.op = OTP_V2_OP_ENCODE;
+	b.connections = 8;
+	b.depth = 1;
+	b.threads = 1;
+	b.duration = 10;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'h': b.host = optarg;
+				  break;
+			case 'o': if (strcmp(optarg, "enc") != 0 && strcmp(optarg, "dec") != 0) usage(argv[0]);
+				  b.op = strcmp(optarg, "enc") == 0 ? OTP_V2_OP_ENCODE : OTP_V2_OP_DECODE;
+				  break;
+			case '1': b.wire = WIRE_V1;
+				  break;
+			case 'k': b.wire = WIRE_PACKED;
+				  break;
+			case 'c': b.connections = atoi(optarg);
+				  if (b.connections < 1) usage(argv[0]);
+				  break;
+			case 'd': b.depth = atoi(optarg);
+				  if (b.depth < 1) usage(argv[0]);
+				  break;
+			case 't': b.threads = atoi(optarg);
+				  if (b.threads < 1) usage(argv[0]);
+				  break;
+			case 'r': b.rate = atof(optarg);
+				  if (b.rate <= 0) usage(argv[0]);
+				  break;
+			case 'p': b.poisson = 1;
+				  break;
+			case 'D': b.duration = atof(optarg);
+				  if (b.duration < 0) usage(argv[0]);
+				  durationGiven = 1;
+				  break;
+			case 'n': b.requests = strtoull(optarg, NULL, 10);
+				  if (b.requests < 1) usage(argv[0]);
+				  break;
+			case 's': sizeSpec = optarg;
+				  break;
+			case 'T': loadTrace(optarg, &b);
+				  break;
+			case 'e': b.engine = 1;
+				  break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || (b.wire == WIRE_V1 && b.depth > 1) || (b.timedTrace && b.rate > 0) ||
+	    (b.engine && (b.wire == WIRE_V1 || b.rate > 0 || b.timedTrace))) //the engine runs closed loop v2
+		usage(argv[0]);
+	if (parseSizes(sizeSpec, &b.sizes) < 0)
+	{
+		fprintf(stderr, "%s: invalid --size \"%s\"\n", argv[0], sizeSpec);
+		exit(1);
+	}
+	//a request count or a timed trace ends the run by itself
+	if (!durationGiven && (b.requests || b.timedTrace))
+		b.duration = 0;
+	if (b.threads > b.connections)
+		b.threads = b.connections;
+	b.handshake = handshakes[b.wire][b.op];
+	memset(&b.address, 0, sizeof(b.address));
+	b.address.sin_family = AF_INET;
+	b.address.sin_port = htons(atoi(argv[optind]));
+	if (!(host = gethostbyname(b.host)))
+	{
+		fprintf(stderr, "%s: unknown host %s\n", argv[0], b.host);
+		exit(1);
+	}
+	memcpy(&b.address.sin_addr.s_addr, host->h_addr, host->h_length);
+
+	//every window of text and key is the same random one
+	b.pattern = malloc(OTP_STREAM_WINDOW);
+	b.packedPattern = malloc(PACKED_WINDOW);
+	workers = calloc(b.threads, sizeof(struct worker));
+	if (!b.pattern || !b.packedPattern || !workers)
+		error("Fail to allocate memory for the benchmark");
+	otpRandInit(&rng, seed, 0);
+	otpRandKey(&rng, b.pattern, OTP_STREAM_WINDOW);
+	otpPack(b.pattern, b.packedPattern, OTP_STREAM_WINDOW);
+
+	for (i = 0; i < b.threads; i++)
+		setUpWorker(&b, &workers[i], i);
+	b.start = now();
+	b.end = b.start + b.duration;
+	for (i = 0; i < b.threads; i++)
+		if ((errno = pthread_create(&workers[i].thread, NULL, b.engine ? runEngine : runWorker, &workers[i])) != 0)
+			error("BENCH: ERROR creating a worker thread");
+	for (i = 0; i < b.threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	report(&b, workers);
+	return 0;
+}
@@ -0,0 +1,873 @@
+/**************************************************************************************
+ * Description: Client side shared by otp_enc and otp_dec. The two programs differ
+ * 		only in the handshake they send and the names in their messages, so
+ * 		both hand their command line to otpClientMain.
+ *************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "otp_codec.h"
+#include "otp_io.h"
+#include "otp_protocol.h"
+#include "otp_client.h"
+
+//reporting error
+static void error(const char* msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+//validate a mapped file in chunks, dropping each chunk from memory once checked
+#define SCAN_CHUNK (4 << 20)
+
+/***********************************************************************************************
+ * Function: scanMapped
+ * Description: This function checks the characters at the start of a mapped file, chunk by
+ * 		chunk, and releases the pages behind it so the client's memory stays small
+ * 		whatever the file size. It stops at the first '\n', the end of the file or limit.
+ * 		Without check it only looks for the '\n', leaving the characters to the daemon.
+ * Arguments: data: const char*, the mapping
+ * 	      size: size_t, the file size
+ * 	      limit: size_t, the most characters to check
+ * 	      check: int, 1 to check the characters
+ * Return: the number of valid characters before the stop, or -1 if an invalid character comes first
+ * **********************************************************************************************/
+static long long scanMapped(const char* data, size_t size, size_t limit, int check)
+{
+	size_t pos = 0, chunk, valid;
+	const char* newline;
+	long page = sysconf(_SC_PAGESIZE);
+	if (limit > size)
+		limit = size;
+	madvise((void*)data, size, MADV_SEQUENTIAL);
+	while (pos < limit)
+	{
+		chunk = limit - pos < SCAN_CHUNK ? limit - pos : SCAN_CHUNK;
+		if (check)
+			valid = otpValidate(data + pos, chunk);
+		else
+			valid = (newline = memchr(data + pos, '\n', chunk)) ? (size_t)(newline - (data + pos)) : chunk;
+		if (valid < chunk)
+			return data[pos + valid] == '\n' ? (long long)(pos + valid) : -1;
+		pos += chunk;
+		//whole pages before pos are checked; sendfile reads them from the page cache later
+		madvise((void*)data, pos / page * page, MADV_DONTNEED);
+	}
+	return pos;
+}
+
+//what tells otp_enc and otp_dec apart
+struct clientNames
+{
+	const char* text; //"plaintext" or "ciphertext"
+	const char* out; //the other one
+	const char* handshake; //"enc" or "dec"
+	const char* v2Handshake; //"en2" or "de2"
+	const char* packedHandshake; //"enp" or "dep"
+	const char* otherHandshake; //handshake of the other daemon
+	const char* otherDaemon; //"otp_dec_d" or "otp_enc_d"
+};
+
+/***********************************************************************************************
+ * Function: exchangeHandshake
+ * Description: This function sends a handshake and checks the daemon's answer
+ * Arguments: socketFD: int, the connected socket
+ * 	      sent: const char*, the handshake to send
+ * 	      names: const struct clientNames*, this client
+ * 	      portNumber: int, the daemon's port, for messages
+ * Return: 1 if the daemon answered with sent, 0 if it answered with the original handshake
+ * 	   of this client; the program exits with 2 if the daemon is the wrong one or busy
+ * **********************************************************************************************/
+static int exchangeHandshake(int socketFD, const char* sent, const struct clientNames* names, int portNumber)
+{
+	int charsWritten, charsRead;
+	charsWritten = send(socketFD, sent, OTP_HANDSHAKE_LENGTH, MSG_NOSIGNAL);
+	if (charsWritten < 0) error("CLIENT: ERROR writing to socket");
+
+	//receive verification message from server
+	char buffer[OTP_HANDSHAKE_LENGTH + 1];
+	memset(buffer, '\0', sizeof(buffer));
+	charsRead = otpReadFromSocket(socketFD, buffer, OTP_HANDSHAKE_LENGTH);
+	if (charsRead < 0) error("CLIENT: ERROR reading from socket");
+	if (strcmp(buffer, sent) == 0)
+		return 1;
+	if (strcmp(buffer, names->handshake) == 0)
+		return 0;
+	// If the server is not the matching daemon, exit
+	if (strcmp(buffer, names->otherHandshake) == 0)
+		fprintf(stderr, "ERROR: Could not contact %s on port %d\n", names->otherDaemon, portNumber);
+	else if (strcmp(buffer, OTP_BUSY) == 0)
+		fprintf(stderr, "ERROR: the daemon on port %d is busy, try again later\n", portNumber);
+	else
+		fprintf(stderr, "ERROR: Could not contact port %d\n", portNumber);
+	exit(2);
+}
+
+//one line of a batch manifest
+struct batchItem
+{
+	char *textFile, *keyFile, *outFile;
+	size_t length; //characters of text
+	double seconds; //time of the round trip the item was part of
+	const char* failure; //NULL if the item was transformed and written
+};
+
+//a batch run, shared by its connection threads
+struct batch
+{
+	struct batchItem* items;
+	size_t n;
+	size_t next; //first item not yet claimed by a connection
+	int port, depth;
+	enum otpOp op;
+	const struct clientNames* names;
+};
+
+//seconds on the monotonic clock
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//read the first line of a file without its '\n'. Returns the line (to be freed) or NULL
+static char* readLine(const char* path, size_t* length)
+{
+	FILE* file = fopen(path, "r");
+	char* line = NULL;
+	size_t len = 0;
+	if (!file)
+		return NULL;
+	if (getline(&line, &len, file) == -1)
+	{
+		free(line);
+		line = NULL;
+	}
+	else
+		*length = strcspn(line, "\n");
+	fclose(file);
+	if (line)
+		line[*length] = '\0';
+	return line;
+}
+
+/***********************************************************************************************
+ * Function: batchConnection
+ * Description: This function is one connection of a batch run. It claims up to depth items at a
+ * 		time, reads and checks their files, sends them to the daemon as pipelined v2 requests
+ * 		and writes the results to the items' output files, until no item is left.
+ * Arguments: arg: void*, the struct batch
+ * Postcondition: each claimed item has its length, seconds and failure set
+ * Return: NULL; exits with 1 on connection errors, 2 if the daemon is wrong, busy or not v2
+ * **********************************************************************************************/
+static void* batchConnection(void* arg)
+{
+	struct batch* batch = arg;
+	int socketFD = otpConnect("localhost", batch->port);
+	int op = batch->op == OTP_ENCODE ? OTP_V2_OP_ENCODE : OTP_V2_OP_DECODE;
+	struct otpRequest* requests = calloc(batch->depth, sizeof(struct otpRequest));
+	struct batchItem** sent = calloc(batch->depth, sizeof(struct batchItem*));
+	size_t first, i, nsent, lenKey;
+	char* key;
+	double start;
+	if (!requests || !sent)
+		error("Fail to allocate memory for the batch");
+	if (socketFD < 0) error("CLIENT: ERROR connecting");
+	if (!exchangeHandshake(socketFD, batch->names->v2Handshake, batch->names, batch->port))
+	{
+		fprintf(stderr, "ERROR: the daemon on port %d does not run batches\n", batch->port);
+		exit(2);
+	}
+
+	while ((first = __atomic_fetch_add(&batch->next, batch->depth, __ATOMIC_RELAXED)) < batch->n)
+	{
+		//read and check the claimed items; the bad ones are reported and left out
+		nsent = 0;
+		for (i = first; i < batch->n && i < first + batch->depth; i++)
+		{
+			struct batchItem* item = &batch->items[i];
+			struct otpRequest* request = &requests[nsent];
+			memset(request, 0, sizeof(*request));
+			if (!(request->text = readLine(item->textFile, &item->length)))
+				item->failure = "cannot read the text";
+			else if (!(key = readLine(item->keyFile, &lenKey)))
+				item->failure = "cannot read the key";
+			else
+			{
+				request->key = key;
+				switch (otpCheckTexts(request->text, item->length, key, lenKey))
+				{
+					case -1: item->failure = "key is too short"; break;
+					case -2: item->failure = "text has invalid characters"; break;
+					case -3: item->failure = "key has invalid characters"; break;
+				}
+				if (!item->failure && !(request->out = calloc(item->length + 1, 1)))
+					error("Fail to allocate memory for the batch");
+			}
+			if (item->failure)
+			{
+				free((char*)request->text);
+				free((char*)request->key);
+				continue;
+			}
+			request->length = item->length;
+			sent[nsent++] = item;
+		}
+
+		//all of them in flight on this connection at once
+		start = now();
+		if (nsent > 0 && otpV2Transfer(socketFD, op, requests, nsent) < 0)
+			error("CLIENT: ERROR talking to the daemon");
+		for (i = 0; i < nsent; i++)
+		{
+			struct batchItem* item = sent[i];
+			FILE* out;
+			item->seconds = now() - start;
+			if (requests[i].status == OTP_V2_BAD_TEXT)
+				item->failure = "the daemon found invalid characters in the text";
+			else if (requests[i].status == OTP_V2_BAD_KEY)
+				item->failure = "the daemon found invalid characters in the key";
+			else if (requests[i].status != OTP_V2_OK)
+				item->failure = "refused by the daemon";
+			else if (!(out = fopen(item->outFile, "w")))
+				item->failure = "cannot open the output";
+			else
+			{
+				if (fprintf(out, "%s\n", requests[i].out) < 0)
+					item->failure = "cannot write the output";
+				if (fclose(out) != 0)
+					item->failure = "cannot write the output";
+			}
+			free((char*)requests[i].text);
+			free((char*)requests[i].key);
+			free(requests[i].out);
+		}
+	}
+	close(socketFD);
+	free(requests);
+	free(sent);
+	return NULL;
+}
+
+/***********************************************************************************************
+ * Function: runBatch
+ * Description: This function runs every item of a manifest through a few persistent v2
+ * 		connections, each keeping up to depth requests in flight, and reports each item's
+ * 		throughput and the total. The manifest has one "textFile keyFile outFile" per line;
+ * 		blank lines and lines starting with '#' are skipped.
+ * Arguments: manifest: const char*, the manifest file
+ * 	      port: int, the daemon's port
+ * 	      connections: int, connections (and threads) to use
+ * 	      depth: int, requests in flight per connection
+ * 	      op: enum otpOp, the op of this client
+ * 	      names: const struct clientNames*, this client
+ * Return: 0 if every item was transformed, 1 otherwise; exits with 1 on errors
+ * **********************************************************************************************/
+static int runBatch(const char* manifest, int port, int connections, int depth, enum otpOp op,
+		    const struct clientNames* names)
+{
+	struct batch batch = { NULL, 0, 0, port, depth, op, names };
+	size_t capacity = 0, len = 0, i, total = 0, failed = 0;
+	char *line = NULL, *text, *key, *out, *rest;
+	pthread_t* threads;
+	double start, seconds;
+	int t;
+
+	FILE* file = fopen(manifest, "r");
+	if (!file)
+		error("Fail to open the manifest");
+	while (getline(&line, &len, file) != -1)
+	{
+		text = strtok_r(line, " \t\n", &rest);
+		if (!text || text[0] == '#')
+			continue;
+		key = strtok_r(NULL, " \t\n", &rest);
+		out = strtok_r(NULL, " \t\n", &rest);
+		if (!key || !out || strtok_r(NULL, " \t\n", &rest))
+		{
+			fprintf(stderr, "manifest \"%s\": line %zu is not \"%sFile keyFile outFile\"\n",
+				manifest, batch.n + 1, names->text);
+			exit(1);
+		}
+		if (batch.n == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 64;
+			if (!(batch.items = realloc(batch.items, capacity * sizeof(struct batchItem))))
+				error("Fail to allocate memory for the batch");
+		}
+		struct batchItem item = { strdup(text), strdup(key), strdup(out), 0, 0, NULL };
+		batch.items[batch.n++] = item;
+	}
+	free(line);
+	fclose(file);
+
+	//no more connections than there are items to share between them
+	if ((size_t)connections > (batch.n + depth - 1) / depth)
+		connections = batch.n ? (batch.n + depth - 1) / depth : 1;
+	if (!(threads = calloc(connections, sizeof(pthread_t))))
+		error("Fail to allocate memory for the batch");
+	start = now();
+	for (t = 0; t < connections; t++)
+		if (pthread_create(&threads[t], NULL, batchConnection, &batch) != 0)
+			error("Fail to start a batch connection");
+	for (t = 0; t < connections; t++)
+		pthread_join(threads[t], NULL);
+	seconds = now() - start;
+
+	for (i = 0; i < batch.n; i++)
+	{
+		struct batchItem* item = &batch.items[i];
+		if (item->failure)
+		{
+			fprintf(stderr, "%s: %s\n", item->textFile, item->failure);
+			failed++;
+		}
+		else
+		{
+			printf("%s -> %s: %zu characters in %.3f ms (%.1f MB/s)\n", item->textFile, item->outFile,
+			       item->length, item->seconds * 1e3, item->seconds > 0 ? item->length / item->seconds / 1e6 : 0.0);
+			total += item->length;
+		}
+		free(item->textFile);
+		free(item->keyFile);
+		free(item->outFile);
+	}
+	printf("%zu of %zu files, %zu characters in %.3f s (%.1f MB/s) over %d connections\n",
+	       batch.n - failed, batch.n, total, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0, connections);
+	free(batch.items);
+	free(threads);
+	return failed ? 1 : 0;
+}
+
+//exit with a message if otpCheckTexts found the text or key invalid
+static void reportInvalid(int valid, const struct clientNames* names, const char* textFile, const char* keyFile)
+{
+	if (valid >= 0)
+		return;
+	switch (valid)
+	{
+		case -1: fprintf(stderr, "key \"%s\" is too short\n", keyFile);
+			 break;
+		case -2: fprintf(stderr, "%s \"%s\" has invalid characters\n", names->text, textFile);
+			 break;
+		default: fprintf(stderr, "key \"%s\" has invalid characters\n", keyFile);
+			 break;
+	}
+	exit(1);
+}
+
+//whether a v2 transfer that failed with err lost its connection, and can go on over a new one
+static int resumable(int err)
+{
+	return err == ECONNRESET || err == EPIPE || err == ECONNREFUSED || err == ECONNABORTED ||
+	       err == ETIMEDOUT || err == ENETRESET || err == ENETUNREACH || err == EHOSTUNREACH;
+}
+
+//wait before resume number tries (from 1): 0.1 s, then twice as long each time, at most 5 s
+#define RETRY_DELAY_US 100000
+#define RETRY_DELAY_MAX_US 5000000
+static void backOff(int tries)
+{
+	uint64_t us = tries > 6 ? RETRY_DELAY_MAX_US : (uint64_t)RETRY_DELAY_US << (tries - 1);
+	if (us > RETRY_DELAY_MAX_US)
+		us = RETRY_DELAY_MAX_US;
+	struct timespec delay = { us / 1000000, us % 1000000 * 1000 };
+	nanosleep(&delay, NULL);
+}
+
+//exit with a message if the daemon refused a v2 request
+static void checkStatus(int status, const struct clientNames* names, int portNumber, unsigned long pad, unsigned long long offset)
+{
+	switch (status)
+	{
+		case OTP_V2_OK: return;
+		case OTP_V2_NO_PAD: fprintf(stderr, "ERROR: the daemon on port %d has no pad %lu\n", portNumber, pad);
+				    exit(1);
+		case OTP_V2_KEY_RANGE: fprintf(stderr, "ERROR: pad %lu is too short for offset %llu\n", pad, offset);
+				       exit(1);
+		case OTP_V2_KEY_USED: fprintf(stderr, "ERROR: pad %lu has been used past offset %llu\n", pad, offset);
+				      exit(1);
+		case OTP_V2_BAD_TEXT: fprintf(stderr, "ERROR: the daemon on port %d found invalid characters in the %s\n",
+					      portNumber, names->text);
+				      exit(1);
+		case OTP_V2_BAD_KEY: fprintf(stderr, "ERROR: the daemon on port %d found invalid characters in the key\n",
+					     portNumber);
+				     exit(1);
+		default: fprintf(stderr, "ERROR: Could not contact %s on port %d\n", names->otherDaemon, portNumber);
+			 exit(2);
+	}
+}
+
+//one part of a sharded message, with its own connection and thread
+struct shard
+{
+	char host[256];
+	int port;
+	int op; //OTP_V2_OP_ENCODE or OTP_V2_OP_DECODE
+	const struct clientNames* names;
+	struct otpFileRequest request;
+};
+
+//send one shard over its own connection
+static void* shardConnection(void* arg)
+{
+	struct shard* shard = arg;
+	int socketFD = otpConnect(shard->host, shard->port);
+	if (socketFD < 0) error("CLIENT: ERROR connecting");
+	if (!exchangeHandshake(socketFD, shard->names->v2Handshake, shard->names, shard->port))
+	{
+		fprintf(stderr, "ERROR: the daemon on port %d does not run shards\n", shard->port);
+		exit(2);
+	}
+	if (otpV2TransferFile(socketFD, shard->op, &shard->request) < 0)
+		error("CLIENT: ERROR talking to the daemon");
+	checkStatus(shard->request.status, shard->names, shard->port, 0, 0);
+	close(socketFD);
+	return NULL;
+}
+
+//append a file to stdout, from the page cache when sendfile can write to stdout
+static void copyToStdout(int fd, uint64_t length)
+{
+	char buf[16384];
+	off_t offset = 0;
+	ssize_t r;
+	while ((uint64_t)offset < length)
+	{
+		r = sendfile(STDOUT_FILENO, fd, &offset, length - offset);
+		if (r < 0 && errno == EINVAL)
+		{
+			r = pread(fd, buf, length - offset < sizeof(buf) ? length - offset : sizeof(buf), offset);
+			if (r > 0 && write(STDOUT_FILENO, buf, r) != r)
+				r = -1;
+			if (r > 0)
+				offset += r;
+		}
+		if (r <= 0)
+			error("CLIENT: ERROR writing the output");
+	}
+}
+
+/***********************************************************************************************
+ * Function: runShards
+ * Description: This function splits a mapped message and its key into shards of whole windows,
+ * 		sends each over its own v2 connection at the same time, round-robin over the endpoints,
+ * 		and writes the transformed text to stdout in order. Shards write straight to their place
+ * 		when stdout is a regular file; otherwise the first one goes to stdout and the others to
+ * 		temporary files that follow it once all are done.
+ * Arguments: textFD, keyFD: int, the text and key files, already checked
+ * 	      length: size_t, characters of text
+ * 	      endpoints: const char**, "port" or "host:port" of each daemon
+ * 	      nEndpoints: int, the number of endpoints
+ * 	      shards: int, the number of shards wanted; fewer are used for short messages
+ * 	      op: enum otpOp, the op of this client
+ * 	      names: const struct clientNames*, this client
+ * Postcondition: the transformed text is on stdout, without the final '\n'
+ * Return: none; exits with 1 on errors, 2 if a daemon is wrong, busy or not v2
+ * **********************************************************************************************/
+static void runShards(int textFD, int keyFD, size_t length, const char** endpoints, int nEndpoints, int shards,
+		      enum otpOp op, const struct clientNames* names)
+{
+	struct stat outStat;
+	int i, seekable;
+	uint64_t shardLength = (length + shards - 1) / shards;
+	off_t base = -1;
+	//whole windows, so each shard's windows line up with the unsharded stream
+	shardLength = (shardLength + OTP_STREAM_WINDOW - 1) / OTP_STREAM_WINDOW * OTP_STREAM_WINDOW;
+	shards = (length + shardLength - 1) / shardLength;
+	struct shard* parts = calloc(shards, sizeof(struct shard));
+	pthread_t* threads = calloc(shards, sizeof(pthread_t));
+	if (!parts || !threads)
+		error("Fail to allocate memory for the shards");
+
+	//pwrite at an offset needs a regular stdout that is not in append mode
+	fflush(stdout);
+	seekable = fstat(STDOUT_FILENO, &outStat) == 0 && S_ISREG(outStat.st_mode) &&
+		   !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) && (base = lseek(STDOUT_FILENO, 0, SEEK_CUR)) >= 0;
+	for (i = 0; i < shards; i++)
+	{
+		struct shard* shard = &parts[i];
+		const char* endpoint = endpoints[i % nEndpoints];
+		const char* colon = strrchr(endpoint, ':');
+		snprintf(shard->host, sizeof(shard->host), "%.*s", colon ? (int)(colon - endpoint) : 9,
+			 colon ? endpoint : "localhost");
+		shard->port = atoi(colon ? colon + 1 : endpoint);
+		shard->op = op == OTP_ENCODE ? OTP_V2_OP_ENCODE : OTP_V2_OP_DECODE;
+		shard->names = names;
+		shard->request.textFD = textFD;
+		shard->request.keyFD = keyFD;
+		shard->request.start = i * shardLength;
+		shard->request.length = length - i * shardLength < shardLength ? length - i * shardLength : shardLength;
+		shard->request.outFD = STDOUT_FILENO;
+		shard->request.outOffset = seekable ? (int64_t)(base + i * shardLength) : -1;
+		if (!seekable && i > 0)
+		{
+			FILE* temp = tmpfile();
+			if (!temp)
+				error("CLIENT: ERROR creating a temporary file");
+			shard->request.outFD = dup(fileno(temp));
+			fclose(temp);
+		}
+		if (pthread_create(&threads[i], NULL, shardConnection, shard) != 0)
+			error("Fail to start a shard connection");
+	}
+	for (i = 0; i < shards; i++)
+		pthread_join(threads[i], NULL);
+
+	//put the pieces together
+	if (seekable)
+		lseek(STDOUT_FILENO, base + length, SEEK_SET);
+	else
+		for (i = 1; i < shards; i++)
+		{
+			copyToStdout(parts[i].request.outFD, parts[i].request.length);
+			close(parts[i].request.outFD);
+		}
+	free(parts);
+	free(threads);
+}
+
+/***********************************************************************************************
+ * Function: otpClientMain
+ * Description: This function is the main() of otp_enc and otp_dec. It reads the text and key,
+ * 		checks them, has the daemon on localhost:port transform the text and prints the
+ * 		result to stdout. It uses protocol v2 when the daemon supports it, and otherwise falls back
+ * 		to sending the whole text and key before reading the reply. Regular files are mapped
+ * 		rather than read in, and with v2 go to the daemon with sendfile while the reply is
+ * 		spliced to stdout, so the client's memory does not grow with the message. With
+ * 		--packed the windows travel 5 bits per character (see otpV2TransferPacked).
+ * Arguments: argc, argv: the client's command line: textFile keyFile port, or -p pad:offset textFile
+ * 	      port to use the key at offset in a pad loaded by the daemon, or --batch manifest port
+ * 	      to run many files (see runBatch)
+ * 	      op: enum otpOp, OTP_ENCODE for otp_enc and OTP_DECODE for otp_dec
+ * Return: 0 on success; exits with 1 on bad input or errors, 2 if the daemon is wrong or busy
+ * **********************************************************************************************/
+int otpClientMain(int argc, char* argv[], enum otpOp op)
+{
+	static const struct clientNames encNames = { "plaintext", "ciphertext", "enc", OTP_V2_ENC, OTP_V2_PACKED_ENC,
+							     "dec", "otp_dec_d" };
+	static const struct clientNames decNames = { "ciphertext", "plaintext", "dec", OTP_V2_DEC, OTP_V2_PACKED_DEC,
+							     "enc", "otp_enc_d" };
+	const struct clientNames* names = op == OTP_ENCODE ? &encNames : &decNames;
+	static const struct option options[] = {
+		{ "batch", required_argument, NULL, 'b' },
+		{ "connections", required_argument, NULL, 'c' },
+		{ "depth", required_argument, NULL, 'd' },
+		{ "shards", required_argument, NULL, 's' },
+		{ "endpoint", required_argument, NULL, 'e' },
+		{ "no-precheck", no_argument, NULL, 'n' },
+		{ "packed", no_argument, NULL, 'k' },
+		{ "retries", required_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 },
+	};
+	int opt, socketFD, portNumber, usePad = 0, badUsage = 0, connections = 4, depth = 8, shards = 0, nEndpoints = 1, precheck = 1;
+	int packed = 0, packedWire = 0, retries = 3;
+	const char** endpoints = calloc(argc + 1, sizeof(char*)); //the port argument, then each --endpoint
+	unsigned long pad = 0;
+	unsigned long long offset = 0;
+	const char* manifest = NULL;
+	char message[64];
+	char* end;
+
+	//-p pad:offset takes the key from a pad the daemon holds instead of a key file
+	while ((opt = getopt_long(argc, argv, "p:", options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': pad = strtoul(optarg, &end, 10);
+				  if (*end == ':')
+					  offset = strtoull(end + 1, &end, 10);
+				  usePad = *end == '\0';
+				  badUsage |= !usePad;
+				  break;
+			case 'b': manifest = optarg;
+				  break;
+			case 'c': connections = atoi(optarg);
+				  badUsage |= connections < 1;
+				  break;
+			case 'd': depth = atoi(optarg);
+				  badUsage |= depth < 1;
+				  break;
+			case 's': shards = atoi(optarg);
+				  badUsage |= shards < 1;
+				  break;
+			case 'e': endpoints[nEndpoints++] = optarg;
+				  break;
+			case 'n': precheck = 0;
+				  break;
+			case 'k': packed = 1;
+				  break;
+			case 'r': retries = atoi(optarg);
+				  badUsage |= retries < 0;
+				  break;
+			default: badUsage = 1;
+		}
+	}
+	//a pad hands out its key ranges in order, so shards would be refused
+	if (!endpoints || badUsage || argc - optind != (manifest ? 1 : usePad ? 2 : 3) || (manifest && usePad) ||
+	    (usePad && (shards > 1 || nEndpoints > 1))) //check usage & args
+	{
+		fprintf(stderr, "USAGE: %s [--no-precheck] [--packed] [--retries N] [--shards N] [--endpoint host:port]...\n"
+				"       %sFile keyFile port\n"
+				"       %s [--packed] -p pad:offset %sFile port\n"
+				"       %s --batch manifest [--connections N] [--depth N] port\n",
+				argv[0], names->text, argv[0], names->text, argv[0]);
+		exit(1);
+	}
+	endpoints[0] = argv[argc - 1];
+	if (shards == 0)
+		shards = nEndpoints;
+	if (manifest)
+		return runBatch(manifest, atoi(argv[optind]), connections, depth, op, names);
+	const char* textFile = argv[optind];
+	const char* keyFile = usePad ? NULL : argv[optind + 1];
+	const char* port = argv[argc - 1];
+
+	/*open the files, read in text and key, and check for validity*/
+	//open the files
+	int textFD, keyFD = -1;
+	snprintf(message, sizeof(message), "Fail to open the %s file", names->text);
+	if ((textFD = open(textFile, O_RDONLY)) < 0)
+		error(message);
+	if (keyFile && (keyFD = open(keyFile, O_RDONLY)) < 0)
+		error("Fail to open the key file");
+	//regular files are mapped instead of read in, and sent from the page cache with sendfile
+	struct stat textStat, keyStat;
+	int mapped = fstat(textFD, &textStat) == 0 && S_ISREG(textStat.st_mode) && textStat.st_size > 0 &&
+		     (keyFD < 0 || (fstat(keyFD, &keyStat) == 0 && S_ISREG(keyStat.st_mode) && keyStat.st_size > 0));
+	char *text = NULL, *key = NULL;
+	size_t lenText;
+	int valid = 1;
+	if (mapped)
+	{
+		if ((text = mmap(NULL, textStat.st_size, PROT_READ, MAP_PRIVATE, textFD, 0)) == MAP_FAILED)
+			error(message);
+		//the text runs up to its first '\n'; only as much key as it needs is looked at
+		long long n = scanMapped(text, textStat.st_size, textStat.st_size, precheck);
+		lenText = n < 0 ? 0 : n;
+		if (n < 0)
+			valid = -2;
+		else if (keyFD >= 0)
+		{
+			if ((key = mmap(NULL, keyStat.st_size, PROT_READ, MAP_PRIVATE, keyFD, 0)) == MAP_FAILED)
+				error("Fail to read key");
+			n = scanMapped(key, keyStat.st_size, lenText, precheck);
+			valid = n < 0 ? -3 : (size_t)n < lenText ? -1 : 1;
+		}
+	}
+	else
+	{
+		FILE *ftext, *fkey;
+		size_t len = 0;
+		snprintf(message, sizeof(message), "Fail to read %s", names->text);
+		if (!(ftext = fdopen(textFD, "r")) || getline(&text, &len, ftext) == -1)
+			error(message);
+		text[strcspn(text, "\n")] = '\0';
+		lenText = strlen(text);
+		if (keyFD >= 0)
+		{
+			len = 0;
+			if (!(fkey = fdopen(keyFD, "r")) || getline(&key, &len, fkey) == -1)
+				error("Fail to read key");
+			key[strcspn(key, "\n")] = '\0';
+		}
+		//check for validity; a key from a pad is checked by the daemon, and so is everything with --no-precheck
+		if (!precheck)
+			valid = key && strlen(key) < lenText ? -1 : 1;
+		else if (!key)
+			valid = otpValidate(text, lenText) == lenText ? 1 : -2;
+		else
+			valid = otpCheckTexts(text, lenText, key, strlen(key));
+	}
+	reportInvalid(valid, names, textFile, keyFile);
+
+	//large mapped messages can go in shards, side by side
+	if (mapped && shards > 1 && lenText > OTP_STREAM_WINDOW)
+	{
+		if (!precheck) //shards write their results before the daemons' check frames come
+			reportInvalid(otpCheckTexts(text, lenText, key, lenText), names, textFile, keyFile);
+		runShards(textFD, keyFD, lenText, endpoints, nEndpoints, shards, op, names);
+		putchar('\n');
+		fflush(stdout);
+		munmap(text, textStat.st_size);
+		munmap(key, keyStat.st_size);
+		free(endpoints);
+		return 0;
+	}
+	free(endpoints);
+
+	char* out = NULL;
+	snprintf(message, sizeof(message), "Fail to allocate memory for %s", names->out);
+	if ((!mapped || packed) && !(out = (char*)calloc(lenText + 1, sizeof(char)))) //exit if fail to allocate memory
+		error(message);
+	//with --no-precheck the daemon's check frame comes after the result, so a mapped message's result
+	//is taken back from a regular stdout if the check fails, and goes to a temporary file first otherwise
+	int outFD = STDOUT_FILENO, held = 0;
+	off_t outStart = -1;
+	if (mapped && !out && !precheck)
+	{
+		struct stat outStat;
+		fflush(stdout);
+		if (fstat(STDOUT_FILENO, &outStat) == 0 && S_ISREG(outStat.st_mode) &&
+		    !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND))
+			outStart = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		if (outStart < 0)
+		{
+			FILE* temp = tmpfile();
+			if (!temp)
+				error("CLIENT: ERROR creating a temporary file");
+			outFD = dup(fileno(temp));
+			fclose(temp);
+			held = 1;
+		}
+	}
+
+	//connect to server and ask for protocol v2, packed with --packed if the daemon knows it
+	portNumber = atoi(port); //get the port number, conver to an integer from a string
+	socketFD = otpConnect("localhost", portNumber);
+	if (socketFD < 0) error("CLIENT: ERROR connecting");
+	if (packed && !(packedWire = exchangeHandshake(socketFD, names->packedHandshake, names, portNumber)))
+	{
+		close(socketFD);
+		socketFD = otpConnect("localhost", portNumber);
+		if (socketFD < 0) error("CLIENT: ERROR connecting");
+	}
+	if (packedWire || exchangeHandshake(socketFD, names->v2Handshake, names, portNumber))
+	{
+		//one request; text and key go window by window while the result comes back. Every window
+		//that comes back is done, so when the connection drops only the rest of the message goes
+		//again, as a new request over a new connection
+		int v2op = op == OTP_ENCODE ? OTP_V2_OP_ENCODE : OTP_V2_OP_DECODE, status, result, tries = 0;
+		size_t done = 0, resumedAt = 0;
+		while (1)
+		{
+			if (socketFD < 0)
+				result = -1; //errno is otpConnect's
+			else if (mapped && !out)
+			{
+				//straight from the files to the socket, and from the socket to stdout
+				struct otpFileRequest request = { textFD, keyFD, done, lenText - done, outFD, -1,
+								  OTP_V2_OK, pad, offset, 0 };
+				fflush(stdout);
+				result = otpV2TransferFile(socketFD, v2op, &request);
+				status = request.status;
+				done += request.done;
+			}
+			else
+			{
+				struct otpRequest request = { text + done, key ? key + done : NULL, out + done, lenText - done,
+							      OTP_V2_OK, pad, offset, 0 };
+				//packed windows are made in memory, so a mapped message is read through its mapping
+				result = packedWire ? otpV2TransferPacked(socketFD, v2op, &request, 1) :
+						      otpV2Transfer(socketFD, v2op, &request, 1);
+				status = request.status;
+				done += request.done;
+			}
+			//a pad's key range is claimed whole by the first request, so it cannot be asked for again
+			if (result == 0 || !key || !resumable(errno) || tries == retries)
+				break;
+			tries++;
+			fprintf(stderr, "CLIENT: connection lost after %zu of %zu characters, resuming (%d of %d)\n",
+				done, lenText, tries, retries);
+			if (socketFD >= 0)
+				close(socketFD);
+			backOff(tries);
+			resumedAt = done;
+			socketFD = otpConnect("localhost", portNumber);
+			if (socketFD >= 0 && !exchangeHandshake(socketFD, packedWire ? names->packedHandshake : names->v2Handshake,
+								names, portNumber))
+			{
+				fprintf(stderr, "ERROR: the daemon on port %d no longer speaks protocol v2\n", portNumber);
+				exit(2);
+			}
+		}
+		if (result < 0)
+			error("CLIENT: ERROR talking to the daemon");
+		//the check frames of the requests that were cut off never came
+		int valid = !precheck && resumedAt > 0 ? otpCheckTexts(text, resumedAt, key, resumedAt) : 1;
+		if (outStart >= 0 && (status != OTP_V2_OK || valid < 0))
+		{
+			//nothing of an invalid message stays in stdout
+			if (ftruncate(STDOUT_FILENO, outStart) < 0 || lseek(STDOUT_FILENO, outStart, SEEK_SET) < 0)
+				perror("CLIENT: ERROR taking back the output");
+		}
+		checkStatus(status, names, portNumber, pad, offset);
+		reportInvalid(valid, names, textFile, keyFile);
+		if (held)
+		{
+			copyToStdout(outFD, lenText);
+			close(outFD);
+		}
+	}
+	else
+	{
+		//the daemon does not speak v2 and closed the connection: start over with the original protocol
+		if (!key)
+		{
+			fprintf(stderr, "ERROR: the daemon on port %d does not hold pads\n", portNumber);
+			exit(2);
+		}
+		if (!out && !(out = (char*)calloc(lenText + 1, sizeof(char))))
+			error(message);
+		if (!precheck) //an original daemon does not check
+			reportInvalid(otpCheckTexts(text, lenText, key, lenText), names, textFile, keyFile);
+		close(socketFD);
+		socketFD = otpConnect("localhost", portNumber);
+		if (socketFD < 0) error("CLIENT: ERROR connecting");
+		if (!exchangeHandshake(socketFD, names->handshake, names, portNumber))
+			exit(2);
+		// send the length of the text (with its '\0'), the text and the key in one call
+		char textLength[OTP_LENGTH_FIELD + 1] = { 0 }, nul = '\0'; //'\0'-padded
+		if (snprintf(textLength, sizeof(textLength), "%zu", lenText + 1) >= (int)sizeof(textLength))
+		{
+			fprintf(stderr, "ERROR: the %s is too long for the daemon on port %d\n", names->text, portNumber);
+			exit(1);
+		}
+		struct iovec request[5] = { { textLength, OTP_LENGTH_FIELD }, { text, lenText }, { &nul, 1 },
+					    { key, lenText }, { &nul, 1 } };
+		otpSizeSocketBuffers(socketFD, 2 * (lenText + 1));
+		snprintf(message, sizeof(message), "CLIENT: ERROR writing %s to socket", names->text);
+		if (otpWritevToSocket(socketFD, request, 5) < 0) error(message);
+
+		//receive the transformed text from server
+		if (otpReadFromSocket(socketFD, out, lenText + 1) < 0) error("CLIENT: ERROR reading from socket");
+	}
+	if (out)
+		printf("%s\n", out);
+	else
+		putchar('\n'); //the text itself went to stdout with splice
+	fflush(stdout);
+
+	//close down
+	if (mapped)
+	{
+		munmap(text, textStat.st_size);
+		if (key)
+			munmap(key, keyStat.st_size);
+	}
+	else
+	{
+		free(text);
+		free(key);
+	}
+	free(out);
+
+	close(socketFD);
+
+	return 0;
+}
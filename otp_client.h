@@ -0,0 +1,14 @@
+/**************************************************************************************
+ * Description: Client side shared by otp_enc and otp_dec. The clients differ only in
+ * 		the handshake they send and the names in their messages, so both hand
+ * 		their command line to otpClientMain.
+ *************************************************************************************/
+
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include "otp_codec.h"
+
+int otpClientMain(int argc, char* argv[], enum otpOp op);
+
+#endif
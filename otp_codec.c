@@ -0,0 +1,747 @@
+/**************************************************************************************
+ * Description: One-time pad encode/decode kernels. Every variant maps A-Z to 0-25
+ * 		and space to 26, adds (encode) or subtracts (decode) the key modulo 27
+ * 		and maps the result back. The SIMD variants replace the division by
+ * 		compare-and-subtract; a block holding any character outside the
+ * 		alphabet is handed to the scalar kernel so that the output is always
+ * 		byte-identical to the scalar code. Every kernel also returns the position
+ * 		of the first character of text or key outside the alphabet, so that
+ * 		checking the input costs no pass of its own.
+ * 		A "table" variant looks up 27x27 tables computed at compile time.
+ * 		The packed wire format stores 8 symbols in 5 bytes: symbol j of a group
+ * 		of 8 takes bits 5j..5j+4 of the group's 40 bits, little-endian, and a
+ * 		short last group takes only the bytes its bits need.
+ *************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "otp_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OTP_X86 1
+#include <immintrin.h>
+#endif
+
+//1 if c is in the alphabet A-Z and space
+static inline int isSymbol(char c)
+{
+	return (unsigned char)(c - 'A') < 26 || c == ' ';
+}
+
+/********************************************************************************************
+ * Function: encodeScalar
+ * Description: This function uses one-time pad method to encode plaintext with key, one
+ * 		character at a time
+ * Arguments: plaintext: const char*, n characters of plaintext
+ * 	      key: const char*, at least n characters of key
+ * 	      ciphertext: char*, n characters that will be modified to ciphertext
+ * 	      n: size_t, the number of characters to encode
+ * Precondition: the memory of ciphertext is allocated
+ * Postcondition: ciphertext is modified to the encoded message from plaintext using key
+ * Return: the position of the first character of plaintext or key outside the alphabet, or n
+ * *****************************************************************************************/
+static size_t encodeScalar(const char* plaintext, const char* key, char* ciphertext, size_t n)
+{
+	size_t i, invalid = n;
+	int p, k, c;
+	for (i = 0; i < n; i++)
+	{
+		if (invalid == n && !(isSymbol(plaintext[i]) && isSymbol(key[i])))
+			invalid = i;
+		// get the numerical value of char of plaintext
+		p = (int)plaintext[i] - 65;
+		if (p < 0) //space
+			p = 26;
+		//get the numerical value of char of key
+		k = (int)key[i] - 65;
+		if (k < 0) //space
+			k = 26;
+		//get the ASCII of char of ciphertext
+		c = (p + k) % 27 + 65;
+		if (c > 90) // space
+			c = 32;
+		ciphertext[i] = (char)c;
+	}
+	return invalid;
+}
+
+/********************************************************************************************
+ * Function: decodeScalar
+ * Description: This function uses one-time pad method to decode ciphertext with key, one
+ * 		character at a time
+ * Arguments: ciphertext: const char*, n characters of ciphertext
+ * 	      key: const char*, at least n characters of key
+ * 	      plaintext: char*, n characters that will store the decoded message
+ * 	      n: size_t, the number of characters to decode
+ * Precondition: the memory of plaintext is allocated
+ * Postcondition: plaintext is modified to the deciphered message from ciphertext using key
+ * Return: the position of the first character of ciphertext or key outside the alphabet, or n
+ * *****************************************************************************************/
+static size_t decodeScalar(const char* ciphertext, const char* key, char* plaintext, size_t n)
+{
+	size_t i, invalid = n;
+	int c, k, d;
+	for (i = 0; i < n; i++)
+	{
+		if (invalid == n && !(isSymbol(ciphertext[i]) && isSymbol(key[i])))
+			invalid = i;
+		// get the numerical value of char of ciphertext
+		c = (int)ciphertext[i] - 65;
+		if (c < 0) //space
+			c = 26;
+		// get the numerical value of char of key
+		k = (int)key[i] - 65;
+		if (k < 0) //space
+			k = 26;
+		//get the ASCII of char of plaintext
+		d = (c - k + 27) % 27 + 65;
+		if (d > 90) //space
+			d = 32;
+		plaintext[i] = (char)d;
+	}
+	return invalid;
+}
+
+//position of the first character outside the alphabet, or n
+static size_t validateScalar(const char* text, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+	{
+		if (!isSymbol(text[i]))
+			return i;
+	}
+	return n;
+}
+
+static int supportedScalar(void) { return 1; }
+
+/*------------------------------------ lookup tables -----------------------------------*/
+
+//the tables below are expanded by the preprocessor and computed by the compiler
+#define SYMBOL(i) ((i) == 26 ? ' ' : 'A' + (i))
+#define ENC(p, k) SYMBOL(((p) + (k)) % 27)
+#define DEC(c, k) SYMBOL(((c) - (k) + 27) % 27)
+#define ROW(F, a) { F(a, 0), F(a, 1), F(a, 2), F(a, 3), F(a, 4), F(a, 5), F(a, 6), F(a, 7), \
+		F(a, 8), F(a, 9), F(a, 10), F(a, 11), F(a, 12), F(a, 13), F(a, 14), F(a, 15), \
+		F(a, 16), F(a, 17), F(a, 18), F(a, 19), F(a, 20), F(a, 21), F(a, 22), F(a, 23), \
+		F(a, 24), F(a, 25), F(a, 26) }
+#define TABLE(F) { ROW(F, 0), ROW(F, 1), ROW(F, 2), ROW(F, 3), ROW(F, 4), ROW(F, 5), ROW(F, 6), \
+		ROW(F, 7), ROW(F, 8), ROW(F, 9), ROW(F, 10), ROW(F, 11), ROW(F, 12), ROW(F, 13), \
+		ROW(F, 14), ROW(F, 15), ROW(F, 16), ROW(F, 17), ROW(F, 18), ROW(F, 19), ROW(F, 20), \
+		ROW(F, 21), ROW(F, 22), ROW(F, 23), ROW(F, 24), ROW(F, 25), ROW(F, 26) }
+
+//encodeTable[p][k] is the ciphertext character of symbols p and k
+static const char encodeTable[OTP_NSYMBOLS][OTP_NSYMBOLS] = TABLE(ENC);
+//decodeTable[c][k] is the plaintext character of symbols c and k
+static const char decodeTable[OTP_NSYMBOLS][OTP_NSYMBOLS] = TABLE(DEC);
+//symbol of each index
+static const char symbolChar[OTP_NSYMBOLS] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+//index of each character, OTP_INVALID outside the alphabet
+static const unsigned char symbolIndex[256] = {
+	[0 ... 255] = OTP_INVALID,
+	['A'] = 0, ['B'] = 1, ['C'] = 2, ['D'] = 3, ['E'] = 4, ['F'] = 5, ['G'] = 6, ['H'] = 7,
+	['I'] = 8, ['J'] = 9, ['K'] = 10, ['L'] = 11, ['M'] = 12, ['N'] = 13, ['O'] = 14,
+	['P'] = 15, ['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21,
+	['W'] = 22, ['X'] = 23, ['Y'] = 24, ['Z'] = 25, [' '] = 26,
+};
+
+//character of each 5-bit value; 27-31 are not symbols and unpack to characters outside the alphabet,
+//like fromIndex of the SIMD variants
+static const char unpackChar[32] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ \\]^_`";
+
+//pack n characters into OTP_PACKED_LENGTH(n) bytes. A character outside the alphabet is packed as 31.
+//Returns the position of the first of them, or n
+static size_t packScalar(const char* text, unsigned char* packed, size_t n)
+{
+	size_t i, j, group, invalid = n;
+	uint64_t bits;
+	unsigned char index;
+	for (i = 0; i < n; i += 8)
+	{
+		group = n - i < 8 ? n - i : 8;
+		bits = 0;
+		for (j = 0; j < group; j++)
+		{
+			index = symbolIndex[(unsigned char)text[i + j]];
+			if (index == OTP_INVALID && invalid == n)
+				invalid = i + j;
+			bits |= (uint64_t)(index & 31) << (5 * j);
+		}
+		for (j = 0; j < (group * 5 + 7) / 8; j++)
+			*packed++ = (unsigned char)(bits >> (8 * j));
+	}
+	return invalid;
+}
+
+//unpack n characters from OTP_PACKED_LENGTH(n) bytes
+static void unpackScalar(const unsigned char* packed, char* text, size_t n)
+{
+	size_t i, j, group, bytes;
+	uint64_t bits;
+	for (i = 0; i < n; i += 8)
+	{
+		group = n - i < 8 ? n - i : 8;
+		bytes = (group * 5 + 7) / 8;
+		bits = 0;
+		for (j = 0; j < bytes; j++)
+			bits |= (uint64_t)packed[j] << (8 * j);
+		packed += bytes;
+		for (j = 0; j < group; j++)
+			text[i + j] = unpackChar[(bits >> (5 * j)) & 31];
+	}
+}
+
+//encode with the 27x27 table, one character at a time
+static size_t encodeTableKernel(const char* plaintext, const char* key, char* ciphertext, size_t n)
+{
+	size_t i, invalid = n;
+	unsigned char p, k;
+	for (i = 0; i < n; i++)
+	{
+		p = symbolIndex[(unsigned char)plaintext[i]];
+		k = symbolIndex[(unsigned char)key[i]];
+		if (p == OTP_INVALID || k == OTP_INVALID)
+		{
+			encodeScalar(plaintext + i, key + i, ciphertext + i, 1);
+			if (invalid == n)
+				invalid = i;
+		}
+		else
+			ciphertext[i] = encodeTable[p][k];
+	}
+	return invalid;
+}
+
+//decode with the 27x27 table, one character at a time
+static size_t decodeTableKernel(const char* ciphertext, const char* key, char* plaintext, size_t n)
+{
+	size_t i, invalid = n;
+	unsigned char c, k;
+	for (i = 0; i < n; i++)
+	{
+		c = symbolIndex[(unsigned char)ciphertext[i]];
+		k = symbolIndex[(unsigned char)key[i]];
+		if (c == OTP_INVALID || k == OTP_INVALID)
+		{
+			decodeScalar(ciphertext + i, key + i, plaintext + i, 1);
+			if (invalid == n)
+				invalid = i;
+		}
+		else
+			plaintext[i] = decodeTable[c][k];
+	}
+	return invalid;
+}
+
+#ifdef OTP_X86
+
+/*---------------------------------------- SSE2 ----------------------------------------*/
+
+//map 16 characters to symbol indices; returns 0 if any of them is outside the alphabet
+static inline int toIndexSSE2(__m128i chars, __m128i* index)
+{
+	__m128i t = _mm_sub_epi8(chars, _mm_set1_epi8('A'));
+	__m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(25)), t);
+	__m128i space = _mm_cmpeq_epi8(chars, _mm_set1_epi8(' '));
+	if (_mm_movemask_epi8(_mm_or_si128(letter, space)) != 0xFFFF)
+		return 0;
+	*index = _mm_or_si128(_mm_andnot_si128(space, t), _mm_and_si128(space, _mm_set1_epi8(26)));
+	return 1;
+}
+
+//map 16 symbol indices back to characters
+static inline __m128i fromIndexSSE2(__m128i index)
+{
+	__m128i space = _mm_cmpeq_epi8(index, _mm_set1_epi8(26));
+	__m128i letter = _mm_add_epi8(index, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(space, letter), _mm_and_si128(space, _mm_set1_epi8(' ')));
+}
+
+static size_t encodeSSE2(const char* plaintext, const char* key, char* ciphertext, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m128i p, k, s;
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		if (!toIndexSSE2(_mm_loadu_si128((const __m128i*)(plaintext + i)), &p) ||
+		    !toIndexSSE2(_mm_loadu_si128((const __m128i*)(key + i)), &k))
+		{
+			at = encodeScalar(plaintext + i, key + i, ciphertext + i, 16);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		//(p + k) % 27 with p + k <= 52
+		s = _mm_add_epi8(p, k);
+		s = _mm_sub_epi8(s, _mm_and_si128(_mm_cmpgt_epi8(s, _mm_set1_epi8(26)), _mm_set1_epi8(27)));
+		_mm_storeu_si128((__m128i*)(ciphertext + i), fromIndexSSE2(s));
+	}
+	at = encodeScalar(plaintext + i, key + i, ciphertext + i, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+static size_t decodeSSE2(const char* ciphertext, const char* key, char* plaintext, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m128i c, k, d;
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		if (!toIndexSSE2(_mm_loadu_si128((const __m128i*)(ciphertext + i)), &c) ||
+		    !toIndexSSE2(_mm_loadu_si128((const __m128i*)(key + i)), &k))
+		{
+			at = decodeScalar(ciphertext + i, key + i, plaintext + i, 16);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		//(c - k + 27) % 27 with -26 <= c - k <= 26
+		d = _mm_sub_epi8(c, k);
+		d = _mm_add_epi8(d, _mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), d), _mm_set1_epi8(27)));
+		_mm_storeu_si128((__m128i*)(plaintext + i), fromIndexSSE2(d));
+	}
+	at = decodeScalar(ciphertext + i, key + i, plaintext + i, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+//position of the first character outside the alphabet, or n, 16 characters at a time
+static size_t validateSSE2(const char* text, size_t n)
+{
+	size_t i;
+	__m128i chars, t;
+	int valid;
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		chars = _mm_loadu_si128((const __m128i*)(text + i));
+		t = _mm_sub_epi8(chars, _mm_set1_epi8('A'));
+		valid = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(25)), t),
+						      _mm_cmpeq_epi8(chars, _mm_set1_epi8(' '))));
+		if (valid != 0xFFFF)
+			return i + __builtin_ctz(~valid);
+	}
+	return i + validateScalar(text + i, n - i);
+}
+
+static int supportedSSE2(void) { return __builtin_cpu_supports("sse2"); }
+
+/*---------------------------------------- AVX2 ----------------------------------------*/
+
+__attribute__((target("avx2")))
+static inline int toIndexAVX2(__m256i chars, __m256i* index)
+{
+	__m256i t = _mm256_sub_epi8(chars, _mm256_set1_epi8('A'));
+	__m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(25)), t);
+	__m256i space = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' '));
+	if (_mm256_movemask_epi8(_mm256_or_si256(letter, space)) != -1)
+		return 0;
+	*index = _mm256_blendv_epi8(t, _mm256_set1_epi8(26), space);
+	return 1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fromIndexAVX2(__m256i index)
+{
+	__m256i space = _mm256_cmpeq_epi8(index, _mm256_set1_epi8(26));
+	__m256i letter = _mm256_add_epi8(index, _mm256_set1_epi8('A'));
+	return _mm256_blendv_epi8(letter, _mm256_set1_epi8(' '), space);
+}
+
+__attribute__((target("avx2")))
+static size_t encodeAVX2(const char* plaintext, const char* key, char* ciphertext, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m256i p, k, s;
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		if (!toIndexAVX2(_mm256_loadu_si256((const __m256i*)(plaintext + i)), &p) ||
+		    !toIndexAVX2(_mm256_loadu_si256((const __m256i*)(key + i)), &k))
+		{
+			at = encodeScalar(plaintext + i, key + i, ciphertext + i, 32);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		s = _mm256_add_epi8(p, k);
+		s = _mm256_sub_epi8(s, _mm256_and_si256(_mm256_cmpgt_epi8(s, _mm256_set1_epi8(26)),
+					_mm256_set1_epi8(27)));
+		_mm256_storeu_si256((__m256i*)(ciphertext + i), fromIndexAVX2(s));
+	}
+	at = encodeSSE2(plaintext + i, key + i, ciphertext + i, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+__attribute__((target("avx2")))
+static size_t decodeAVX2(const char* ciphertext, const char* key, char* plaintext, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m256i c, k, d;
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		if (!toIndexAVX2(_mm256_loadu_si256((const __m256i*)(ciphertext + i)), &c) ||
+		    !toIndexAVX2(_mm256_loadu_si256((const __m256i*)(key + i)), &k))
+		{
+			at = decodeScalar(ciphertext + i, key + i, plaintext + i, 32);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		d = _mm256_sub_epi8(c, k);
+		d = _mm256_add_epi8(d, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), d),
+					_mm256_set1_epi8(27)));
+		_mm256_storeu_si256((__m256i*)(plaintext + i), fromIndexAVX2(d));
+	}
+	at = decodeSSE2(ciphertext + i, key + i, plaintext + i, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+__attribute__((target("avx2")))
+static size_t validateAVX2(const char* text, size_t n)
+{
+	size_t i;
+	__m256i chars, t;
+	unsigned valid;
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		chars = _mm256_loadu_si256((const __m256i*)(text + i));
+		t = _mm256_sub_epi8(chars, _mm256_set1_epi8('A'));
+		valid = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(25)), t),
+							     _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' '))));
+		if (valid != 0xFFFFFFFFu)
+			return i + __builtin_ctz(~valid);
+	}
+	return i + validateSSE2(text + i, n - i);
+}
+
+//pack 32 characters at a time: pairs of 5-bit indices become 10 bits, pairs of those 20 bits and
+//pairs of those the 40 bits of a group of 8, whose 5 bytes are then gathered per 128-bit lane
+__attribute__((target("avx2")))
+static size_t packAVX2(const char* text, unsigned char* packed, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m256i index, bits;
+	const __m256i gather = _mm256_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1,
+						0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+	unsigned char block[32];
+	for (i = 0; i + 32 <= n; i += 32, packed += 20)
+	{
+		if (!toIndexAVX2(_mm256_loadu_si256((const __m256i*)(text + i)), &index))
+		{
+			at = packScalar(text + i, packed, 32);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		bits = _mm256_maddubs_epi16(index, _mm256_set1_epi16(0x2001)); //a + 32b
+		bits = _mm256_madd_epi16(bits, _mm256_set1_epi32(0x04000001)); //a + 1024b
+		bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0xFFFFF)),
+				       _mm256_and_si256(_mm256_srli_epi64(bits, 12), _mm256_set1_epi64x(0xFFFFF00000)));
+		_mm256_storeu_si256((__m256i*)block, _mm256_shuffle_epi8(bits, gather));
+		memcpy(packed, block, 10);
+		memcpy(packed + 10, block + 16, 10);
+	}
+	at = packScalar(text + i, packed, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+//unpack 32 characters at a time, the steps of packAVX2 backwards
+__attribute__((target("avx2")))
+static void unpackAVX2(const unsigned char* packed, char* text, size_t n)
+{
+	size_t i;
+	__m256i bits;
+	const __m256i spread = _mm256_setr_epi8(0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1,
+						0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1);
+	//each iteration reads 26 bytes; the 16 characters left after it keep that inside the input
+	for (i = 0; i + 48 <= n; i += 32, packed += 20)
+	{
+		bits = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)packed)),
+					       _mm_loadu_si128((const __m128i*)(packed + 10)), 1);
+		bits = _mm256_shuffle_epi8(bits, spread);
+		bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0xFFFFF)),
+				       _mm256_and_si256(_mm256_slli_epi64(bits, 12), _mm256_set1_epi64x(0xFFFFF00000000)));
+		bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x3FF)),
+				       _mm256_and_si256(_mm256_slli_epi32(bits, 6), _mm256_set1_epi32(0x3FF0000)));
+		bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi16(0x1F)),
+				       _mm256_and_si256(_mm256_slli_epi16(bits, 3), _mm256_set1_epi16(0x1F00)));
+		_mm256_storeu_si256((__m256i*)(text + i), fromIndexAVX2(bits));
+	}
+	unpackScalar(packed, text + i, n - i);
+}
+
+static int supportedAVX2(void) { return __builtin_cpu_supports("avx2"); }
+
+/*--------------------------------------- AVX-512 --------------------------------------*/
+
+__attribute__((target("avx512f,avx512bw")))
+static inline int toIndexAVX512(__m512i chars, __m512i* index)
+{
+	__m512i t = _mm512_sub_epi8(chars, _mm512_set1_epi8('A'));
+	__mmask64 letter = _mm512_cmplt_epu8_mask(t, _mm512_set1_epi8(26));
+	__mmask64 space = _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8(' '));
+	if ((letter | space) != ~(__mmask64)0)
+		return 0;
+	*index = _mm512_mask_blend_epi8(space, t, _mm512_set1_epi8(26));
+	return 1;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i fromIndexAVX512(__m512i index)
+{
+	__mmask64 space = _mm512_cmpeq_epi8_mask(index, _mm512_set1_epi8(26));
+	__m512i letter = _mm512_add_epi8(index, _mm512_set1_epi8('A'));
+	return _mm512_mask_blend_epi8(space, letter, _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t encodeAVX512(const char* plaintext, const char* key, char* ciphertext, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m512i p, k, s;
+	for (i = 0; i + 64 <= n; i += 64)
+	{
+		if (!toIndexAVX512(_mm512_loadu_si512((const void*)(plaintext + i)), &p) ||
+		    !toIndexAVX512(_mm512_loadu_si512((const void*)(key + i)), &k))
+		{
+			at = encodeScalar(plaintext + i, key + i, ciphertext + i, 64);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		s = _mm512_add_epi8(p, k);
+		s = _mm512_mask_sub_epi8(s, _mm512_cmpgt_epi8_mask(s, _mm512_set1_epi8(26)),
+				s, _mm512_set1_epi8(27));
+		_mm512_storeu_si512((void*)(ciphertext + i), fromIndexAVX512(s));
+	}
+	at = encodeAVX2(plaintext + i, key + i, ciphertext + i, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t decodeAVX512(const char* ciphertext, const char* key, char* plaintext, size_t n)
+{
+	size_t i, at, invalid = n;
+	__m512i c, k, d;
+	for (i = 0; i + 64 <= n; i += 64)
+	{
+		if (!toIndexAVX512(_mm512_loadu_si512((const void*)(ciphertext + i)), &c) ||
+		    !toIndexAVX512(_mm512_loadu_si512((const void*)(key + i)), &k))
+		{
+			at = decodeScalar(ciphertext + i, key + i, plaintext + i, 64);
+			if (invalid == n)
+				invalid = i + at;
+			continue;
+		}
+		d = _mm512_sub_epi8(c, k);
+		d = _mm512_mask_add_epi8(d, _mm512_cmplt_epi8_mask(d, _mm512_setzero_si512()),
+				d, _mm512_set1_epi8(27));
+		_mm512_storeu_si512((void*)(plaintext + i), fromIndexAVX512(d));
+	}
+	at = decodeAVX2(ciphertext + i, key + i, plaintext + i, n - i);
+	return invalid == n ? i + at : invalid;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t validateAVX512(const char* text, size_t n)
+{
+	size_t i;
+	__m512i chars;
+	__mmask64 valid;
+	for (i = 0; i + 64 <= n; i += 64)
+	{
+		chars = _mm512_loadu_si512((const void*)(text + i));
+		valid = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(chars, _mm512_set1_epi8('A')), _mm512_set1_epi8(26)) |
+			_mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8(' '));
+		if (valid != ~(__mmask64)0)
+			return i + __builtin_ctzll(~valid);
+	}
+	return i + validateAVX2(text + i, n - i);
+}
+
+static int supportedAVX512(void)
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+#endif /* OTP_X86 */
+
+//all variants, fastest first
+static const struct otpKernel kernels[] = {
+#ifdef OTP_X86
+	{ "avx512", supportedAVX512, encodeAVX512, decodeAVX512, validateAVX512, packAVX2, unpackAVX2 },
+	{ "avx2", supportedAVX2, encodeAVX2, decodeAVX2, validateAVX2, packAVX2, unpackAVX2 },
+	{ "sse2", supportedSSE2, encodeSSE2, decodeSSE2, validateSSE2, packScalar, unpackScalar },
+#endif
+	{ "table", supportedScalar, encodeTableKernel, decodeTableKernel, validateScalar, packScalar, unpackScalar },
+	{ "scalar", supportedScalar, encodeScalar, decodeScalar, validateScalar, packScalar, unpackScalar },
+};
+#define NKERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+//the kernel used by otpEncode/otpDecode
+static const struct otpKernel* activeKernel = &kernels[NKERNELS - 1];
+
+/********************************************************************************************
+ * Function: selectKernelAtStartup
+ * Description: Runs before main() and picks the fastest kernel supported by the CPU. The
+ * 		environment variable OTP_KERNEL can name a variant to use instead.
+ * *****************************************************************************************/
+__attribute__((constructor))
+static void selectKernelAtStartup(void)
+{
+	int i;
+	const char* forced = getenv("OTP_KERNEL");
+#ifdef OTP_X86
+	__builtin_cpu_init();
+#endif
+	if (forced && otpSelectKernel(forced) == 0)
+		return;
+	for (i = 0; i < NKERNELS; i++)
+	{
+		if (kernels[i].supported())
+		{
+			activeKernel = &kernels[i];
+			return;
+		}
+	}
+}
+
+/********************************************************************************************
+ * Function: otpEncode
+ * Description: This function uses one-time pad method to encode plaintext with key
+ * Arguments: plaintext: const char*, n characters of plaintext
+ * 	      key: const char*, at least n characters of key
+ * 	      ciphertext: char*, n characters that will be modified to ciphertext
+ * 	      n: size_t, the number of characters to encode
+ * Precondition: the memory of ciphertext is allocated. The buffers need not be '\0' ended.
+ * Postcondition: ciphertext is modified to the encoded message from plaintext using key
+ * Return: the position of the first character of plaintext or key outside the alphabet, or n
+ * *****************************************************************************************/
+size_t otpEncode(const char* plaintext, const char* key, char* ciphertext, size_t n)
+{
+	return activeKernel->encode(plaintext, key, ciphertext, n);
+}
+
+/********************************************************************************************
+ * Function: otpDecode
+ * Description: This function uses one-time pad method to decode ciphertext with key
+ * Arguments: ciphertext: const char*, n characters of ciphertext
+ * 	      key: const char*, at least n characters of key
+ * 	      plaintext: char*, n characters that will store the decoded message
+ * 	      n: size_t, the number of characters to decode
+ * Precondition: the memory of plaintext is allocated. The buffers need not be '\0' ended.
+ * Postcondition: plaintext is modified to the deciphered message from ciphertext using key
+ * Return: the position of the first character of ciphertext or key outside the alphabet, or n
+ * *****************************************************************************************/
+size_t otpDecode(const char* ciphertext, const char* key, char* plaintext, size_t n)
+{
+	return activeKernel->decode(ciphertext, key, plaintext, n);
+}
+
+//encode (OTP_ENCODE) or decode (OTP_DECODE) n characters of text with key into out. Returns the
+//position of the first character of text or key outside the alphabet, or n if all are valid
+size_t otpTransform(enum otpOp op, const char* text, const char* key, char* out, size_t n)
+{
+	if (op == OTP_ENCODE)
+		return activeKernel->encode(text, key, out, n);
+	return activeKernel->decode(text, key, out, n);
+}
+
+/********************************************************************************************
+ * Function: otpValidate
+ * Description: This function looks for the first character of text outside A-Z and space
+ * Arguments: text: const char*, n characters to check
+ * 	      n: size_t, the number of characters to check
+ * Return: the position of the first invalid character, or n if all of them are valid
+ * *****************************************************************************************/
+size_t otpValidate(const char* text, size_t n)
+{
+	return activeKernel->validate(text, n);
+}
+
+//pack n characters of text into the OTP_PACKED_LENGTH(n) bytes of packed, 5 bits each. Returns the
+//position of the first character outside the alphabet (packed as a value no symbol has), or n
+size_t otpPack(const char* text, unsigned char* packed, size_t n)
+{
+	return activeKernel->pack(text, packed, n);
+}
+
+//unpack n characters of text from packed; values that are no symbol become characters outside the
+//alphabet, so that the transforms report them
+void otpUnpack(const unsigned char* packed, char* text, size_t n)
+{
+	activeKernel->unpack(packed, text, n);
+}
+
+/********************************************************************************************
+ * Function: otpCheckTexts
+ * Description: This function checks the validity of a text and its key. Only the lenText
+ * 		characters of key that the text uses are checked.
+ * Arguments: text: const char*, lenText characters of plaintext or ciphertext
+ * 	      lenText: size_t, the length of text
+ * 	      key: const char*, lenKey characters of key
+ * 	      lenKey: size_t, the length of key
+ * Return: 1: valid inputs
+ * 	   -1: key length < text length
+ * 	   -2: text has invalid character
+ * 	   -3: key has invalid character
+ * *****************************************************************************************/
+int otpCheckTexts(const char* text, size_t lenText, const char* key, size_t lenKey)
+{
+	if (lenText > lenKey)
+		return -1;
+	if (otpValidate(text, lenText) != lenText)
+		return -2;
+	if (otpValidate(key, lenText) != lenText)
+		return -3;
+	return 1;
+}
+
+//map n characters of text to symbol indices 0-26 (A-Z, space). Returns the position of the
+//first character outside the alphabet, whose index is OTP_INVALID, or n if all are valid
+size_t otpToIndex(const char* text, unsigned char* index, size_t n)
+{
+	size_t i, firstInvalid = n;
+	for (i = 0; i < n; i++)
+	{
+		index[i] = symbolIndex[(unsigned char)text[i]];
+		if (index[i] == OTP_INVALID && firstInvalid == n)
+			firstInvalid = i;
+	}
+	return firstInvalid;
+}
+
+//map n symbol indices 0-26 back to the characters A-Z and space
+void otpFromIndex(const unsigned char* index, char* text, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		text[i] = symbolChar[index[i]];
+}
+
+//list all kernel variants compiled in, fastest first; nkernels receives the count
+const struct otpKernel* otpKernels(int* nkernels)
+{
+	*nkernels = NKERNELS;
+	return kernels;
+}
+
+//name of the kernel used by otpEncode/otpDecode
+const char* otpKernelName(void)
+{
+	return activeKernel->name;
+}
+
+//use the named kernel from now on. Returns 0 on success, -1 if unknown or unsupported
+int otpSelectKernel(const char* name)
+{
+	int i;
+	for (i = 0; i < NKERNELS; i++)
+	{
+		if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported())
+		{
+			activeKernel = &kernels[i];
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,47 @@
+/**************************************************************************************
+ * Description: One-time pad codec over the 27 character alphabet A-Z and space.
+ * 		The encode/decode kernels come in scalar, SSE2, AVX2 and AVX-512
+ * 		variants; the fastest one the CPU supports is chosen at startup.
+ *************************************************************************************/
+
+#ifndef OTP_CODEC_H
+#define OTP_CODEC_H
+
+#include <stddef.h>
+
+#define OTP_NSYMBOLS 27 //A-Z and space
+#define OTP_INVALID 0xFF //symbol index of a character outside the alphabet
+#define OTP_PACKED_LENGTH(n) ((n) / 8 * 5 + ((n) % 8 * 5 + 7) / 8) //bytes of n packed characters
+
+//operations of otpTransform
+enum otpOp { OTP_ENCODE, OTP_DECODE };
+
+//a kernel variant, usable by benchmarks to run one variant directly
+struct otpKernel
+{
+	const char* name;
+	int (*supported)(void); //1 if the CPU can run this variant
+	//the transforms return the position of the first invalid character of text or key, or n
+	size_t (*encode)(const char* plaintext, const char* key, char* ciphertext, size_t n);
+	size_t (*decode)(const char* ciphertext, const char* key, char* plaintext, size_t n);
+	size_t (*validate)(const char* text, size_t n);
+	size_t (*pack)(const char* text, unsigned char* packed, size_t n);
+	void (*unpack)(const unsigned char* packed, char* text, size_t n);
+};
+
+size_t otpEncode(const char* plaintext, const char* key, char* ciphertext, size_t n);
+size_t otpDecode(const char* ciphertext, const char* key, char* plaintext, size_t n);
+size_t otpTransform(enum otpOp op, const char* text, const char* key, char* out, size_t n);
+
+size_t otpValidate(const char* text, size_t n);
+size_t otpPack(const char* text, unsigned char* packed, size_t n);
+void otpUnpack(const unsigned char* packed, char* text, size_t n);
+int otpCheckTexts(const char* text, size_t lenText, const char* key, size_t lenKey);
+size_t otpToIndex(const char* text, unsigned char* index, size_t n);
+void otpFromIndex(const unsigned char* index, char* text, size_t n);
+
+const struct otpKernel* otpKernels(int* nkernels);
+const char* otpKernelName(void);
+int otpSelectKernel(const char* name);
+
+#endif
@@ -0,0 +1,17 @@
+/**************************************************************************************
+ * Description: This program encodes and decodes for otp_enc and otp_dec clients alike:
+ * 		each connection gets the op its handshake asks for, and each v2 request
+ * 		the op in its frame. Every port given serves both ops, so "otp_d 5001
+ * 		5002" stands in for otp_enc_d on 5001 and otp_dec_d on 5002 with one set
+ * 		of processes, limits and counters.
+ * 		The server itself is shared with otp_enc_d and otp_dec_d and lives in
+ * 		otp_server.c.
+ *************************************************************************************/
+
+#include "otp_server.h"
+
+//USAGE: program_name [--epoll [--threads N]] [--workers N [--pin]] port_number [port_number...]
+int main(int argc, char* argv[])
+{
+	return otpServerMain(argc, argv, OTP_OP_BIT(OTP_ENCODE) | OTP_OP_BIT(OTP_DECODE));
+}
@@ -0,0 +1,876 @@
+/**************************************************************************************
+ * Description: Event-driven server for otp_enc_d and otp_dec_d. A fixed set of
+ * 		threads each run an epoll loop over non-blocking connections. The
+ * 		listening socket is in every thread's epoll set with EPOLLEXCLUSIVE, so
+ * 		one thread wakes per new connection and accepts a batch with accept4.
+ * 		Each listening socket is registered as a connection in CONN_LISTENING.
+ * 		Each connection walks through the wire protocol as a state machine:
+ * 		handshake, handshake reply, length, payload, key, reply. In the
+ * 		streaming mode it instead alternates between receiving a window of
+ * 		text and key and sending the transformed window, and protocol v2 runs
+ * 		the streaming steps once per request frame until the client closes.
+ * 		--max-conns and --queue are split evenly between the threads. Past its
+ * 		share of connections a thread parks new ones without reading them, and
+ * 		past its share of the queue it rejects them with OTP_BUSY.
+ * 		With --uring the same state machine runs on an io_uring per thread instead
+ * 		(see otpServeUring): a multishot accept per listening socket, one
+ * 		recv or send in flight per connection, and the operations of every
+ * 		connection that moved submitted together with the wait for the next
+ * 		completions, in one io_uring_enter.
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include "otp_io.h"
+#include "otp_server.h"
+#include "otp_ring.h"
+
+#define ACCEPT_BATCH 64 //connections accepted per wakeup of the listening socket
+#define MAX_EVENTS 256 //events handled per epoll_wait
+#define RING_ENTRIES 256 //submission queue entries of a thread's io_uring
+#define RING_SLOTS 16 //registered window buffers of a thread's io_uring
+#define SLOT_SIZE (3 * OTP_STREAM_WINDOW + 2 * OTP_PACKED_LENGTH(OTP_STREAM_WINDOW)) //text, key, out, packed
+
+static void error(const char* msg){ perror(msg); exit(1); } //Error function to report issues
+
+//where a connection is in the wire protocol
+enum connState
+{
+	CONN_LISTENING, //not a connection: one of the daemon's listening sockets
+	CONN_HANDSHAKE, //receiving "enc"/"dec" or another handshake
+	CONN_HANDSHAKE_REPLY, //sending our own handshake back
+	CONN_LENGTH, //receiving the ASCII length field
+	CONN_PAYLOAD, //receiving the text
+	CONN_KEY, //receiving the key
+	CONN_REPLY, //sending the transformed text
+	CONN_STREAM_WINDOW, //streaming: receiving a window of text followed by its key
+	CONN_STREAM_REPLY, //streaming: sending the transformed window
+	CONN_V2_FRAME, //v2: receiving a request frame, or the client closing between requests
+	CONN_V2_KEYREF, //v2: receiving the key reference of a request whose key is in a pad
+	CONN_V2_REPLY_FRAME, //v2: sending the reply frame, then stream the request's windows
+	CONN_V2_CHECK_FRAME, //v2: sending the check frame after the windows of a checked request
+};
+
+struct connection
+{
+	int fd;
+	enum connState state;
+	int rejected; //the handshake did not match: close after replying
+	enum otpOp op; //what the client asked for; per request with v2
+	int stream; //the client asked for the streaming mode
+	int v2; //the client speaks protocol v2
+	int packed; //v2: windows travel packed, through the key buffer
+	int discard; //v2: skip the windows of a request that is refused
+	int textOnly; //v2: the request's key comes from a pad, only the text is sent
+	const char* padKey; //v2: the rest of the request's key in the mapped pad
+	int checked; //v2: the request asked for a check frame
+	struct otpFrame check; //v2: the request's check result; streaming: whether it is still valid
+	uint64_t position; //streaming: characters of the message transformed so far
+	uint32_t events; //the epoll events currently asked for
+	char field[OTP_LENGTH_FIELD + 1]; //handshake or length field being received
+	unsigned char frame[OTP_FRAME_LENGTH]; //v2 frame being received or sent
+	unsigned char keyRef[OTP_KEYREF_LENGTH]; //v2 key reference being received
+	char *text, *key, *out; //v1: out is text, transformed in place
+	size_t textSize, keySize, outSize; //what text, key and out were taken from the pool for; 0 for out with v1
+	size_t length; //message length; in the streaming mode, what is left of it
+	size_t window; //streaming: length of the current window
+	size_t done; //bytes of the current step received or sent so far
+	const char* sendBuf; //what the current send step sends
+	size_t sendLength;
+	struct connection* next; //next parked connection
+	struct ring* ring; //uring: the thread's ring, NULL with epoll
+	struct otpPool* pool; //the thread's buffer pool
+	char* slot; //uring: the registered buffer holding text, key and out, NULL if they are on the heap
+	int pending; //uring: a recv or send of this connection is in flight
+	int failed; //uring: the last one failed, or the peer closed the connection
+	int64_t acceptedAt; //for the queue stage
+	struct otpStageTimer timer; //the stages of the request being served
+	int textIn; //streaming and v2: the text of the window being received is in, the key is not
+	struct otpPeer peer; //the client, for the trace
+	int inRequest; //a request was started and not traced yet
+	uint64_t total; //the request's length, for the trace
+};
+
+//one server thread and its epoll set
+struct epollThread
+{
+	struct otpServer* server;
+	int epollFD;
+	int active, maxActive; //connections being served and this thread's limit
+	struct connection *parkedHead, *parkedTail; //accepted connections waiting for a slot
+	int parked, maxParked;
+	struct ring* ring; //uring: NULL with epoll
+	struct otpPool pool; //request buffers, reused from one connection to the next
+};
+
+static void startConnection(struct epollThread* thread, struct connection* conn);
+
+#ifdef OTP_URING
+//an io_uring of one server thread and its registered buffers
+struct ring
+{
+	struct otpRing io;
+	char* slab; //RING_SLOTS buffers of SLOT_SIZE, registered as fixed buffer 0; NULL if not registered
+	char* freeSlots[RING_SLOTS];
+	int nFree;
+};
+
+//set up a server thread's ring. The window buffers of its first RING_SLOTS streaming and v2
+//connections are registered, so that their reads and writes do not pin and unpin pages every
+//time; a ring whose buffers cannot be registered (RLIMIT_MEMLOCK) works without them.
+//Returns -1 with errno set if the kernel has no io_uring or refuses one
+static int ringSetup(struct ring* ring)
+{
+	int i;
+	size_t length = RING_SLOTS * SLOT_SIZE;
+	memset(ring, 0, sizeof(*ring));
+	if (otpRingSetup(&ring->io, RING_ENTRIES) < 0)
+		return -1;
+	ring->slab = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->slab == MAP_FAILED || otpRingRegister(&ring->io, ring->slab, length) < 0)
+	{
+		if (ring->slab != MAP_FAILED)
+			munmap(ring->slab, length);
+		ring->slab = NULL;
+		return 0;
+	}
+	for (i = 0; i < RING_SLOTS; i++)
+		ring->freeSlots[ring->nFree++] = ring->slab + (size_t)i * SLOT_SIZE;
+	return 0;
+}
+
+//queue a multishot accept on a listening socket; its completions carry the listener
+static void ringAccept(struct ring* ring, struct connection* listener)
+{
+	struct io_uring_sqe* sqe = otpRingGet(&ring->io, listener->fd, listener);
+	if (!sqe) error("ERROR queueing accept on io_uring");
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+//uring: the step is complete once completions have brought conn->done up to want; until then one
+//recv or send of the rest stays in flight. Returns like receiveStep and sendStep
+static int ringStep(struct connection* conn, int isSend, const char* buf, size_t want)
+{
+	struct io_uring_sqe* sqe;
+	if (conn->done >= want)
+	{
+		conn->done = 0;
+		return 1;
+	}
+	if (conn->failed)
+		return -1;
+	if (conn->pending)
+		return 0;
+	if (!(sqe = otpRingGet(&conn->ring->io, conn->fd, conn)))
+		return -1;
+	sqe->addr = (uintptr_t)(buf + conn->done);
+	sqe->len = want - conn->done < (1u << 30) ? want - conn->done : (1u << 30);
+	if (conn->slot && buf >= conn->slot && buf < conn->slot + SLOT_SIZE)
+	{
+		//the window buffers are registered: no page pinning
+		sqe->opcode = isSend ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+		sqe->off = (uint64_t)-1;
+	}
+	else
+	{
+		sqe->opcode = isSend ? IORING_OP_SEND : IORING_OP_RECV;
+		sqe->msg_flags = isSend ? MSG_NOSIGNAL : MSG_WAITALL;
+	}
+	conn->pending = 1;
+	return 0;
+}
+
+//a free registered buffer, or NULL
+static char* ringTakeSlot(struct ring* ring)
+{
+	return ring->nFree > 0 ? ring->freeSlots[--ring->nFree] : NULL;
+}
+
+static void ringPutSlot(struct ring* ring, char* slot)
+{
+	ring->freeSlots[ring->nFree++] = slot;
+}
+#else
+struct ring { int fd; };
+static int ringStep(struct connection* conn, int isSend, const char* buf, size_t want)
+{
+	(void)conn; (void)isSend; (void)buf; (void)want;
+	return -1;
+}
+static char* ringTakeSlot(struct ring* ring) { (void)ring; return NULL; }
+static void ringPutSlot(struct ring* ring, char* slot) { (void)ring; (void)slot; }
+#endif
+
+//give a streaming or v2 connection its window buffers: a registered slot if its ring has one free,
+//otherwise the thread's pool. Returns -1 if out of memory
+static int windowBuffers(struct connection* conn)
+{
+	if (conn->ring && (conn->slot = ringTakeSlot(conn->ring)))
+	{
+		conn->text = conn->slot;
+		conn->out = conn->slot + 2 * OTP_STREAM_WINDOW;
+		conn->key = conn->slot + 3 * OTP_STREAM_WINDOW;
+		return 0;
+	}
+	//one window of text and key and one transformed window, and packed text and key windows
+	conn->textSize = 2 * OTP_STREAM_WINDOW;
+	conn->outSize = OTP_STREAM_WINDOW;
+	conn->keySize = conn->packed ? 2 * OTP_PACKED_LENGTH(OTP_STREAM_WINDOW) : 0;
+	conn->text = otpPoolGet(conn->pool, conn->textSize);
+	conn->out = otpPoolGet(conn->pool, conn->outSize);
+	if (conn->packed)
+		conn->key = otpPoolGet(conn->pool, conn->keySize);
+	return conn->text && conn->out && (!conn->packed || conn->key) ? 0 : -1;
+}
+
+//free a connection and its buffers and close its socket, then start a parked connection
+static void closeConnection(struct epollThread* thread, struct connection* conn)
+{
+	if (conn->inRequest)
+		otpTraceRequest(thread->server->stats, &conn->timer, &conn->peer, conn->op, conn->total, OTP_OUTCOME_FAILED);
+	close(conn->fd); //also removes it from the epoll set
+	if (conn->slot)
+		ringPutSlot(conn->ring, conn->slot);
+	else
+	{
+		otpPoolPut(conn->pool, conn->text, conn->textSize);
+		otpPoolPut(conn->pool, conn->key, conn->keySize);
+		otpPoolPut(conn->pool, conn->out, conn->outSize);
+	}
+	free(conn);
+	thread->active--;
+	otpStatsAdd(thread->server->stats, inFlight, -1);
+
+	if (thread->parkedHead)
+	{
+		conn = thread->parkedHead;
+		thread->parkedHead = conn->next;
+		if (!thread->parkedHead)
+			thread->parkedTail = NULL;
+		thread->parked--;
+		otpStatsAdd(thread->server->stats, queued, -1);
+		startConnection(thread, conn);
+	}
+}
+
+//receive into buf until want bytes are there. Returns 1 when complete, 0 if the socket has no
+//more data for now, -1 on error or if the peer closed the connection
+static int receiveStep(struct connection* conn, char* buf, size_t want)
+{
+	ssize_t n;
+	if (conn->ring)
+		return ringStep(conn, 0, buf, want);
+	while (conn->done < want)
+	{
+		n = recv(conn->fd, buf + conn->done, want - conn->done, 0);
+		if (n > 0)
+			conn->done += n;
+		else if (n == 0)
+			return -1;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else if (errno != EINTR)
+			return -1;
+	}
+	conn->done = 0;
+	return 1;
+}
+
+//send the pending buffer. Returns 1 when all of it is sent, 0 if the socket is full, -1 on error
+static int sendStep(struct connection* conn)
+{
+	ssize_t n;
+	if (conn->ring)
+		return ringStep(conn, 1, conn->sendBuf, conn->sendLength);
+	while (conn->done < conn->sendLength)
+	{
+		n = send(conn->fd, conn->sendBuf + conn->done, conn->sendLength - conn->done, MSG_NOSIGNAL);
+		if (n >= 0)
+			conn->done += n;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else if (errno != EINTR)
+			return -1;
+	}
+	conn->done = 0;
+	return 1;
+}
+
+//keep the connection's request, which ended with outcome, in the trace
+static void traceRequest(const struct otpServer* server, struct connection* conn, enum otpOutcome outcome)
+{
+	otpTraceRequest(server->stats, &conn->timer, &conn->peer, conn->op, conn->total, outcome);
+	conn->inRequest = 0;
+}
+
+//account for an answered streaming or v2 request: its stages and whether its input was valid
+static void requestDone(const struct otpServer* server, struct connection* conn)
+{
+	if (conn->check.code != OTP_V2_OK)
+		otpStatsAdd(server->stats, invalid, 1);
+	traceRequest(server, conn, conn->check.code != OTP_V2_OK ? OTP_OUTCOME_INVALID : OTP_OUTCOME_OK);
+	otpStatsRequest(server->stats, &conn->timer, conn->position);
+	otpStatsAdd(server->stats, completed, 1);
+}
+
+//switch to a send step for buf
+static void startSend(struct connection* conn, enum connState state, const char* buf, size_t n)
+{
+	conn->state = state;
+	conn->sendBuf = buf;
+	conn->sendLength = n;
+	conn->done = 0;
+}
+
+/****************************************************************************************************
+ * Function: advance
+ * Description: This function moves a connection through the protocol as far as its socket allows
+ * Arguments: server: const struct otpServer*, the daemon
+ * 	      conn: struct connection*, the connection
+ * Return: 0 if the connection waits for its socket, -1 if it is finished or failed and must be
+ * 	   closed
+ * ****************************************************************************************************/
+static int advance(const struct otpServer* server, struct connection* conn)
+{
+	int r;
+	while (1)
+	{
+		switch (conn->state)
+		{
+			case CONN_LISTENING:
+				return 0; //never advanced, see epollLoop
+			case CONN_HANDSHAKE:
+			{
+				if ((r = receiveStep(conn, conn->field, OTP_HANDSHAKE_LENGTH)) <= 0) return r;
+				enum otpWire wire = otpMatchHandshake(server, conn->field, &conn->op);
+				conn->stream = wire == OTP_WIRE_STREAM;
+				conn->v2 = wire == OTP_WIRE_V2 || wire == OTP_WIRE_V2_PACKED;
+				conn->packed = wire == OTP_WIRE_V2_PACKED;
+				conn->rejected = wire == OTP_WIRE_REJECT;
+				//answer with the client's own handshake if we serve it
+				startSend(conn, CONN_HANDSHAKE_REPLY, conn->rejected ? server->handshake : conn->field,
+						OTP_HANDSHAKE_LENGTH);
+				break;
+			}
+			case CONN_HANDSHAKE_REPLY:
+				if ((r = sendStep(conn)) <= 0) return r;
+				if (conn->rejected) return -1; //not our client
+				otpStageMark(&conn->timer, OTP_STAGE_HANDSHAKE);
+				if (conn->v2)
+				{
+					otpStatsStages(server->stats, &conn->timer); //each request is timed on its own
+					//one window of text and key and one transformed window for every request
+					if (windowBuffers(conn) < 0) return -1;
+					conn->state = CONN_V2_FRAME;
+					break;
+				}
+				conn->inRequest = 1;
+				conn->state = CONN_LENGTH;
+				break;
+			case CONN_LENGTH:
+				if ((r = receiveStep(conn, conn->field, OTP_LENGTH_FIELD)) <= 0) return r;
+				conn->field[OTP_LENGTH_FIELD] = '\0';
+				if (conn->stream)
+				{
+					//one window of text and key and one transformed window, whatever the length
+					long long length = otpStreamLength(conn->field);
+					if (length < 0) return -1;
+					conn->length = conn->total = length;
+					if (windowBuffers(conn) < 0) return -1;
+					conn->state = CONN_STREAM_WINDOW;
+					break;
+				}
+				{
+					long long length = otpStreamLength(conn->field);
+					if (length <= 0) return -1;
+					conn->length = length;
+				}
+				conn->total = conn->length - 1; //the field counts the text's '\0'
+				conn->textSize = conn->keySize = conn->length;
+				conn->text = otpPoolGet(conn->pool, conn->textSize);
+				conn->key = otpPoolGet(conn->pool, conn->keySize);
+				if (!conn->text || !conn->key) return -1;
+				conn->state = CONN_PAYLOAD;
+				break;
+			case CONN_PAYLOAD:
+				if ((r = receiveStep(conn, conn->text, conn->length)) <= 0) return r;
+				otpStageMark(&conn->timer, OTP_STAGE_TEXT);
+				conn->state = CONN_KEY;
+				break;
+			case CONN_KEY:
+				if ((r = receiveStep(conn, conn->key, conn->length)) <= 0) return r;
+				otpStageMark(&conn->timer, OTP_STAGE_KEY);
+				{
+					//no error reply in the original protocol: bad input closes the connection
+					size_t length = strnlen(conn->text, conn->length); //the client sends the text with its '\0'
+					if (otpTransform(conn->op, conn->text, conn->key, conn->text, length) != length)
+					{
+						otpStatsAdd(server->stats, invalid, 1);
+						traceRequest(server, conn, OTP_OUTCOME_INVALID);
+						return -1;
+					}
+					conn->position = length;
+					memset(conn->text + length, '\0', conn->length - length); //the reply ends in '\0' like the text
+				}
+				otpStageMark(&conn->timer, OTP_STAGE_TRANSFORM);
+				startSend(conn, CONN_REPLY, conn->text, conn->length);
+				break;
+			case CONN_REPLY:
+				if ((r = sendStep(conn)) <= 0) return r;
+				otpStageMark(&conn->timer, OTP_STAGE_REPLY);
+				traceRequest(server, conn, OTP_OUTCOME_OK);
+				otpStatsRequest(server->stats, &conn->timer, conn->position);
+				otpStatsAdd(server->stats, completed, 1);
+				return -1; //done
+			case CONN_STREAM_WINDOW:
+				if (conn->length == 0)
+				{
+					if (!conn->v2)
+					{
+						requestDone(server, conn);
+						return -1; //done
+					}
+					if (conn->checked && !conn->discard)
+					{
+						otpPackFrame(conn->frame, &conn->check);
+						startSend(conn, CONN_V2_CHECK_FRAME, (const char*)conn->frame, OTP_FRAME_LENGTH);
+						break;
+					}
+					if (!conn->discard)
+						requestDone(server, conn);
+					else
+						traceRequest(server, conn, OTP_OUTCOME_REFUSED);
+					conn->state = CONN_V2_FRAME;
+					break;
+				}
+				conn->window = conn->length < OTP_STREAM_WINDOW ? conn->length : OTP_STREAM_WINDOW;
+				//the window's text and key arrive back to back, or just its text with a pad
+				{
+					size_t wire = conn->packed ? OTP_PACKED_LENGTH(conn->window) : conn->window;
+					r = receiveStep(conn, conn->packed ? conn->key : conn->text, conn->textOnly ? wire : 2 * wire);
+					//the text is in once wire bytes are; what comes after it is key
+					if (r == 0 && !conn->textIn && !conn->textOnly && conn->done >= wire)
+					{
+						otpStageMark(&conn->timer, OTP_STAGE_TEXT);
+						conn->textIn = 1;
+					}
+					if (r <= 0) return r;
+					if (!conn->textIn)
+						otpStageMark(&conn->timer, OTP_STAGE_TEXT);
+					if (!conn->textOnly)
+						otpStageMark(&conn->timer, OTP_STAGE_KEY);
+					conn->textIn = 0;
+					conn->length -= conn->window;
+					if (conn->discard)
+						break;
+					if (conn->packed)
+					{
+						otpUnpack((const unsigned char*)conn->key, conn->text, conn->window);
+						if (!conn->textOnly)
+							otpUnpack((const unsigned char*)conn->key + wire, conn->text + conn->window, conn->window);
+					}
+				}
+				if (!otpTransformChecked(conn->op, conn->text, conn->textOnly ? conn->padKey : conn->text + conn->window,
+							 conn->out, conn->window, conn->position, &conn->check) && !conn->v2)
+				{
+					otpStatsAdd(server->stats, invalid, 1);
+					traceRequest(server, conn, OTP_OUTCOME_INVALID);
+					return -1; //the streaming mode has no error reply
+				}
+				conn->position += conn->window;
+				if (conn->textOnly)
+					conn->padKey += conn->window;
+				if (conn->packed)
+				{
+					otpPack(conn->out, (unsigned char*)conn->key, conn->window);
+					otpStageMark(&conn->timer, OTP_STAGE_TRANSFORM);
+					startSend(conn, CONN_STREAM_REPLY, conn->key, OTP_PACKED_LENGTH(conn->window));
+				}
+				else
+				{
+					otpStageMark(&conn->timer, OTP_STAGE_TRANSFORM);
+					startSend(conn, CONN_STREAM_REPLY, conn->out, conn->window);
+				}
+				break;
+			case CONN_STREAM_REPLY:
+				if ((r = sendStep(conn)) <= 0) return r;
+				otpStageMark(&conn->timer, OTP_STAGE_REPLY);
+				conn->state = CONN_STREAM_WINDOW;
+				break;
+			case CONN_V2_FRAME:
+			{
+				struct otpFrame frame;
+				//the client closing here is the normal end of the connection
+				if ((r = receiveStep(conn, (char*)conn->frame, OTP_FRAME_LENGTH)) <= 0) return r;
+				otpStageStart(&conn->timer); //waiting for the frame is the client's idle time
+				conn->inRequest = 1;
+				otpUnpackFrame(conn->frame, &frame);
+				//requests for an op the daemon does not run are answered with an error and their payload is skipped
+				conn->discard = !otpFrameOp(server, frame.code, &conn->op);
+				conn->length = conn->total = frame.length;
+				conn->textOnly = (frame.flags & OTP_V2_FLAG_PAD) != 0;
+				conn->checked = (frame.flags & OTP_V2_FLAG_CHECK) != 0;
+				conn->check.id = frame.id;
+				conn->check.code = OTP_V2_OK;
+				conn->check.flags = 0;
+				conn->check.length = frame.length;
+				conn->position = 0;
+				frame.code = conn->discard ? OTP_V2_BAD_OP : OTP_V2_OK;
+				if (conn->textOnly)
+				{
+					conn->state = CONN_V2_KEYREF;
+					break;
+				}
+				otpPackFrame(conn->frame, &frame);
+				startSend(conn, CONN_V2_REPLY_FRAME, (const char*)conn->frame, OTP_FRAME_LENGTH);
+				break;
+			}
+			case CONN_V2_KEYREF:
+			{
+				struct otpFrame frame;
+				struct otpKeyRef ref;
+				int code = OTP_V2_BAD_OP;
+				if ((r = receiveStep(conn, (char*)conn->keyRef, OTP_KEYREF_LENGTH)) <= 0) return r;
+				otpUnpackKeyRef(conn->keyRef, &ref);
+				if (!conn->discard)
+				{
+					conn->padKey = otpKeyStoreClaim(server->keys, ref.pad, conn->op, ref.offset, conn->length, &code);
+					if (conn->padKey)
+						code = OTP_V2_OK;
+					else
+						conn->discard = 1;
+				}
+				otpUnpackFrame(conn->frame, &frame);
+				frame.code = code;
+				otpPackFrame(conn->frame, &frame);
+				startSend(conn, CONN_V2_REPLY_FRAME, (const char*)conn->frame, OTP_FRAME_LENGTH);
+				break;
+			}
+			case CONN_V2_REPLY_FRAME:
+				if ((r = sendStep(conn)) <= 0) return r;
+				otpStageMark(&conn->timer, OTP_STAGE_REPLY);
+				if (conn->discard)
+					otpStatsAdd(server->stats, refused, 1);
+				conn->state = CONN_STREAM_WINDOW;
+				break;
+			case CONN_V2_CHECK_FRAME:
+				if ((r = sendStep(conn)) <= 0) return r;
+				otpStageMark(&conn->timer, OTP_STAGE_REPLY);
+				requestDone(server, conn);
+				conn->state = CONN_V2_FRAME;
+				break;
+		}
+	}
+}
+
+//ask epoll for the events the connection's current state waits for
+static int updateEvents(struct epollThread* thread, struct connection* conn)
+{
+	struct epoll_event ev;
+	uint32_t events = (conn->state == CONN_HANDSHAKE_REPLY || conn->state == CONN_REPLY ||
+			   conn->state == CONN_STREAM_REPLY || conn->state == CONN_V2_REPLY_FRAME ||
+			   conn->state == CONN_V2_CHECK_FRAME) ? EPOLLOUT : EPOLLIN;
+	if (events == conn->events)
+		return 0;
+	ev.events = events;
+	ev.data.ptr = conn;
+	conn->events = events;
+	return epoll_ctl(thread->epollFD, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+//register a connection with this thread's epoll set and serve what it has sent already; on a ring,
+//queue its first recv
+static void startConnection(struct epollThread* thread, struct connection* conn)
+{
+	struct epoll_event ev;
+	thread->active++;
+	otpStatsAdd(thread->server->stats, inFlight, 1);
+	otpStatsObserve(thread->server->stats, OTP_STAGE_QUEUE, otpStatsNow() - conn->acceptedAt);
+	otpStageStart(&conn->timer);
+	if (conn->ring)
+	{
+		if (advance(thread->server, conn) < 0)
+			closeConnection(thread, conn);
+		return;
+	}
+	conn->events = EPOLLIN;
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(thread->epollFD, EPOLL_CTL_ADD, conn->fd, &ev) < 0 ||
+	    advance(thread->server, conn) < 0 || updateEvents(thread, conn) < 0)
+		closeConnection(thread, conn);
+}
+
+//serve, park or reject a connection just accepted from addr (NULL: ask the socket)
+static void acceptConnection(struct epollThread* thread, int fd, const struct sockaddr* addr)
+{
+	struct connection* conn;
+	otpStatsAdd(thread->server->stats, accepted, 1);
+	if (thread->active >= thread->maxActive && thread->parked >= thread->maxParked)
+	{
+		otpRejectConnection(thread->server, fd);
+		return;
+	}
+	conn = calloc(1, sizeof(struct connection));
+	if (!conn)
+	{
+		otpRejectConnection(thread->server, fd);
+		return;
+	}
+	conn->fd = fd;
+	conn->state = CONN_HANDSHAKE;
+	conn->ring = thread->ring;
+	conn->pool = &thread->pool;
+	conn->acceptedAt = otpStatsNow();
+	if (addr)
+		otpPeerSet(&conn->peer, addr);
+	else
+		otpPeerOf(fd, &conn->peer);
+	if (thread->active < thread->maxActive)
+	{
+		startConnection(thread, conn);
+		return;
+	}
+	//no free slot: park it until a connection of this thread finishes
+	if (thread->parkedTail)
+		thread->parkedTail->next = conn;
+	else
+		thread->parkedHead = conn;
+	thread->parkedTail = conn;
+	thread->parked++;
+	otpStatsAdd(thread->server->stats, queued, 1);
+}
+
+//accept up to ACCEPT_BATCH pending connections of listenFD
+static void acceptBatch(struct epollThread* thread, int listenFD)
+{
+	int i, fd;
+	struct sockaddr_storage addr;
+	socklen_t length;
+	for (i = 0; i < ACCEPT_BATCH; i++)
+	{
+		length = sizeof(addr);
+		fd = accept4(listenFD, (struct sockaddr*)&addr, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("ERROR on accept"); //out of descriptors or memory: retry on the next wakeup
+			return;
+		}
+		acceptConnection(thread, fd, (struct sockaddr*)&addr);
+	}
+}
+
+//event loop of one server thread
+static void* epollLoop(void* arg)
+{
+	struct epollThread* thread = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct connection* conn;
+	int i, n;
+	while (1)
+	{
+		n = epoll_wait(thread->epollFD, events, MAX_EVENTS, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			error("ERROR on epoll_wait");
+		}
+		for (i = 0; i < n; i++)
+		{
+			conn = events[i].data.ptr;
+			if (conn->state == CONN_LISTENING)
+			{
+				acceptBatch(thread, conn->fd);
+				continue;
+			}
+			if (advance(thread->server, conn) < 0 || updateEvents(thread, conn) < 0)
+				closeConnection(thread, conn);
+		}
+	}
+	return NULL;
+}
+
+//split server's limits evenly between its threads, rounding up
+static struct epollThread* createThreads(struct otpServer* server)
+{
+	int i;
+	struct epollThread* threads = calloc(server->threads, sizeof(struct epollThread));
+	if (!threads) error("ERROR allocating memory in otp server");
+	for (i = 0; i < server->threads; i++)
+	{
+		threads[i].server = server;
+		threads[i].maxActive = (server->maxConns + server->threads - 1) / server->threads;
+		threads[i].maxParked = (server->queueLimit + server->threads - 1) / server->threads;
+		otpPoolInit(&threads[i].pool, OTP_POOL_LIMIT, server->hugePages);
+	}
+	return threads;
+}
+
+/****************************************************************************************************
+ * Function: otpServeEpoll
+ * Description: This function serves connections with server->threads epoll threads
+ * Arguments: server: struct otpServer*, the daemon with its non-blocking listening sockets
+ * Postcondition: never returns
+ * ****************************************************************************************************/
+void otpServeEpoll(struct otpServer* server)
+{
+	int i, port;
+	struct epoll_event ev;
+	struct connection* listener;
+	struct epollThread* threads = createThreads(server);
+	pthread_t* ids = calloc(server->threads, sizeof(pthread_t));
+	if (!ids) error("ERROR allocating memory in otp server");
+
+	//a client closing early must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < server->threads; i++)
+	{
+		threads[i].epollFD = epoll_create1(EPOLL_CLOEXEC);
+		if (threads[i].epollFD < 0) error("ERROR on epoll_create1");
+		for (port = 0; port < server->nPorts; port++)
+		{
+			listener = calloc(1, sizeof(struct connection));
+			if (!listener) error("ERROR allocating memory in otp server");
+			listener->fd = server->listenFDs[port];
+			listener->state = CONN_LISTENING;
+			ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+			ev.data.ptr = listener;
+			if (epoll_ctl(threads[i].epollFD, EPOLL_CTL_ADD, listener->fd, &ev) < 0)
+				error("ERROR adding the listening socket to epoll");
+		}
+		if (i > 0 && pthread_create(&ids[i], NULL, epollLoop, &threads[i]) != 0)
+			error("ERROR creating server thread");
+	}
+	epollLoop(&threads[0]); //the main thread is the first server thread
+}
+
+#ifdef OTP_URING
+/****************************************************************************************************
+ * Function: uringLoop
+ * Description: This function is the loop of one io_uring server thread. Every pass submits the
+ * 		operations queued while handling the previous completions and waits for new ones
+ * 		in a single io_uring_enter; then every completion advances its connection, which
+ * 		queues that connection's next recv or send. Under load the completions of many
+ * 		connections arrive together, so a request costs a fraction of a system call.
+ * Arguments: arg: struct epollThread*, the thread with its ring set up and its accepts queued
+ * Postcondition: never returns
+ * ****************************************************************************************************/
+static void* uringLoop(void* arg)
+{
+	struct epollThread* thread = arg;
+	struct ring* ring = thread->ring;
+	struct io_uring_cqe* cqe;
+	struct connection* conn;
+	unsigned flags;
+	int res;
+	while (1)
+	{
+		//EBUSY: completions are backed up in the kernel; reaping ours makes room for them
+		if (otpRingEnter(&ring->io, 1) < 0 && errno != EINTR && errno != EBUSY)
+			error("ERROR on io_uring_enter");
+		while ((cqe = otpRingPeek(&ring->io)))
+		{
+			conn = (struct connection*)(uintptr_t)cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			otpRingSeen(&ring->io);
+			if (conn->state == CONN_LISTENING)
+			{
+				if (res >= 0)
+					acceptConnection(thread, res, NULL); //a multishot accept gives no address
+				else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN)
+				{
+					errno = -res;
+					perror("ERROR on accept");
+				}
+				if (!(flags & IORING_CQE_F_MORE))
+					ringAccept(ring, conn); //the multishot accept ended: start another one
+				continue;
+			}
+			conn->pending = 0;
+			if (res > 0)
+				conn->done += res;
+			else if (res == 0 || (res != -EINTR && res != -EAGAIN))
+				conn->failed = 1;
+			if (advance(thread->server, conn) < 0)
+				closeConnection(thread, conn);
+		}
+	}
+	return NULL;
+}
+
+//start an io_uring server thread: set up its ring unless it has one, queue a multishot accept on
+//every listening socket and run uringLoop
+static void* uringThread(void* arg)
+{
+	struct epollThread* thread = arg;
+	struct connection* listener;
+	int port;
+	if (!thread->ring && (!(thread->ring = malloc(sizeof(struct ring))) || ringSetup(thread->ring) < 0))
+		error("ERROR setting up io_uring");
+	for (port = 0; port < thread->server->nPorts; port++)
+	{
+		listener = calloc(1, sizeof(struct connection));
+		if (!listener) error("ERROR allocating memory in otp server");
+		listener->fd = thread->server->listenFDs[port];
+		listener->state = CONN_LISTENING;
+		ringAccept(thread->ring, listener);
+	}
+	return uringLoop(thread);
+}
+#endif
+
+/****************************************************************************************************
+ * Function: otpServeUring
+ * Description: This function serves connections with server->threads io_uring threads. They run the
+ * 		epoll threads' state machine, limits and counters, with the I/O done by the ring. A
+ * 		daemon built without io_uring, or on a kernel that refuses one, serves with epoll.
+ * Arguments: server: struct otpServer*, the daemon with its listening sockets
+ * Postcondition: never returns
+ * ****************************************************************************************************/
+void otpServeUring(struct otpServer* server)
+{
+#ifdef OTP_URING
+	int i;
+	struct epollThread* threads = createThreads(server);
+	pthread_t id;
+
+	//a client closing early must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	//each ring belongs to its thread, so the main thread only checks that rings can be had
+	if (!(threads[0].ring = malloc(sizeof(struct ring)))) error("ERROR allocating memory in otp server");
+	if (ringSetup(threads[0].ring) < 0)
+	{
+		fprintf(stderr, "%s: io_uring is not available (%s), serving with epoll\n", server->name, strerror(errno));
+		free(threads[0].ring);
+		free(threads);
+		otpServeEpoll(server);
+	}
+	for (i = 1; i < server->threads; i++)
+		if (pthread_create(&id, NULL, uringThread, &threads[i]) != 0)
+			error("ERROR creating server thread");
+	uringThread(&threads[0]); //the main thread is the first server thread
+#else
+	fprintf(stderr, "%s: built without io_uring, serving with epoll\n", server->name);
+	otpServeEpoll(server);
+#endif
+}
@@ -0,0 +1,919 @@
+/**************************************************************************************
+ * Description: Socket helpers shared by the otp clients and daemons. They return -1
+ * 		with errno set on failure and leave reporting the error to the caller.
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "otp_io.h"
+#include "otp_codec.h"
+#include "otp_ring.h"
+#include "otp_protocol.h"
+
+//largest single send/recv; OTP_IO_CHUNK in the environment overrides it at startup
+static size_t ioChunk = OTP_IO_CHUNK;
+
+/********************************************************************************************
+ * Function: readChunkSizeAtStartup
+ * Description: Runs before main() and takes the I/O chunk size from the environment
+ * 		variable OTP_IO_CHUNK if it is set (1024 reproduces the original I/O path).
+ * *****************************************************************************************/
+__attribute__((constructor))
+static void readChunkSizeAtStartup(void)
+{
+	const char* chunk = getenv("OTP_IO_CHUNK");
+	if (chunk)
+		otpSetIoChunk(strtoull(chunk, NULL, 10));
+}
+
+//set the largest single send/recv, 0 for the default
+void otpSetIoChunk(size_t chunk)
+{
+	ioChunk = chunk > 0 ? chunk : OTP_IO_CHUNK;
+}
+
+/***********************************************************************************************
+ * Function: otpWriteToSocket
+ * Description: This function writes a string to a socket. Strings longer than the I/O chunk
+ * 		size (OTP_IO_CHUNK, 1 MB by default) are sent a chunk at a time.
+ * Arguments: socketFD: int, the file descriptor of the socket that the string is written to
+ * 	      text: const char*, a pointer to the string that will be written to socket
+ * 	      ntext: size_t, the length of text
+ * Precondition: N/A
+ * Postcondition: the whole string is written to socket
+ * Return: 0 on success, -1 if send fails
+ * **********************************************************************************************/
+int otpWriteToSocket(int socketFD, const char* text, size_t ntext)
+{
+	ssize_t charsWritten;
+	while (ntext > 0)
+	{
+		charsWritten = send(socketFD, text, ntext < ioChunk ? ntext : ioChunk, MSG_NOSIGNAL);
+		if (charsWritten < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		ntext -= charsWritten;
+		text += charsWritten;
+	}
+	return 0;
+}
+
+/***********************************************************************************************
+ * Function: otpWritevToSocket
+ * Description: This function writes several buffers to a socket with as few sendmsg calls as
+ * 		the socket allows, e.g. a length field and its payload in one call.
+ * Arguments: socketFD: int, the file descriptor of the socket
+ * 	      iov: struct iovec*, the buffers; they are modified to track partial writes
+ * 	      iovcnt: int, the number of buffers
+ * Postcondition: all the buffers are written to socket
+ * Return: 0 on success, -1 if sendmsg fails
+ * **********************************************************************************************/
+int otpWritevToSocket(int socketFD, struct iovec* iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t charsWritten;
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt > 0)
+	{
+		if (iov->iov_len == 0) { iov++; iovcnt--; continue; }
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		charsWritten = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+		if (charsWritten < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		//skip what was written
+		while (iovcnt > 0 && (size_t)charsWritten >= iov->iov_len)
+		{
+			charsWritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + charsWritten;
+			iov->iov_len -= charsWritten;
+		}
+	}
+	return 0;
+}
+
+/***********************************************************************************************
+ * Function: otpReadFromSocket
+ * Description: This function reads a string from a socket. Each recv waits for a whole I/O chunk
+ * 		(MSG_WAITALL), so a large message takes few calls.
+ * Arguments: socketFD: int, the file descriptor of the socket that the string is read from
+ * 	      text: char*, a pointer to the memory location that the string will be written to
+ * 	      ntext: size_t, the length of string
+ * Precondition: the memory for text is allocated. The length of the string is known.
+ * Postcondition: the whole is read from socket and written into text.
+ * Return: 0 on success, -1 if recv fails or if the peer closes the connection first (errno is
+ * 	   then ECONNRESET)
+ * **********************************************************************************************/
+int otpReadFromSocket(int socketFD, char* text, size_t ntext)
+{
+	ssize_t charsRead;
+	while (ntext > 0)
+	{
+		charsRead = recv(socketFD, text, ntext < ioChunk ? ntext : ioChunk, MSG_WAITALL);
+		if (charsRead < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (charsRead == 0) //the peer closed the connection
+		{
+			errno = ECONNRESET;
+			return -1;
+		}
+		ntext -= charsRead;
+		text += charsRead;
+	}
+	return 0;
+}
+
+/***********************************************************************************************
+ * Function: otpSizeSocketBuffers
+ * Description: This function grows the socket's send and receive buffers so that a message of n
+ * 		bytes fits in them, up to OTP_SOCKET_BUFFER_MAX. Buffers that are large enough
+ * 		already are left alone, so small messages keep the kernel's autotuning.
+ * Arguments: socketFD: int, the socket
+ * 	      n: size_t, the message length
+ * **********************************************************************************************/
+void otpSizeSocketBuffers(int socketFD, size_t n)
+{
+	static const int options[] = { SO_SNDBUF, SO_RCVBUF };
+	int i, size, current;
+	socklen_t len;
+	size = n < OTP_SOCKET_BUFFER_MAX ? (int)n : OTP_SOCKET_BUFFER_MAX;
+	for (i = 0; i < 2; i++)
+	{
+		len = sizeof(current);
+		if (getsockopt(socketFD, SOL_SOCKET, options[i], &current, &len) == 0 && current < size)
+			setsockopt(socketFD, SOL_SOCKET, options[i], &size, sizeof(size)); //best effort
+	}
+}
+
+/***********************************************************************************************
+ * Function: otpConnect
+ * Description: This function opens a TCP connection to hostname:port
+ * Arguments: hostname: const char*, the server's name
+ * 	      port: int, the server's port
+ * Return: the connected socket, or -1 if the host is unknown or the connection fails
+ * **********************************************************************************************/
+int otpConnect(const char* hostname, int port)
+{
+	int socketFD;
+	struct sockaddr_in serverAddress;
+	struct hostent* serverHostInfo;
+
+	//set up the server address struct
+	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); //clear out the address struct
+	serverAddress.sin_family = AF_INET; //create a network-capable socket
+	serverAddress.sin_port = htons(port); //store the port number
+	serverHostInfo = gethostbyname(hostname); //convert the machine name into a special form of address
+	if (serverHostInfo == NULL) { errno = EHOSTUNREACH; return -1; }
+	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); //copy in address
+
+	//set up the socket and connect to server
+	socketFD = socket(AF_INET, SOCK_STREAM, 0);
+	if (socketFD < 0) return -1;
+	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+	{
+		close(socketFD);
+		return -1;
+	}
+	//requests are written in several pieces (frame, windows); don't hold them back for ACKs
+	setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	return socketFD;
+}
+
+//the part of the streaming upload at position pos of a message of n characters: text and key
+//alternate in windows of OTP_STREAM_WINDOW bytes. Returns 0 if the part is text and 1 if it is key,
+//with its offset in the text or key in *offset and its contiguous length in *len
+static int streamSegment(uint64_t n, uint64_t pos, uint64_t* offset, size_t* len)
+{
+	uint64_t start = pos / (2 * OTP_STREAM_WINDOW) * OTP_STREAM_WINDOW;
+	size_t within = pos % (2 * OTP_STREAM_WINDOW);
+	size_t length = n - start < OTP_STREAM_WINDOW ? n - start : OTP_STREAM_WINDOW;
+	if (within < length)
+	{
+		*offset = start + within;
+		*len = length - within;
+		return 0;
+	}
+	*offset = start + within - length;
+	*len = 2 * length - within;
+	return 1;
+}
+
+//write a v2 frame into buf, OTP_FRAME_LENGTH bytes, big-endian
+void otpPackFrame(unsigned char* buf, const struct otpFrame* frame)
+{
+	int i;
+	memset(buf, 0, OTP_FRAME_LENGTH);
+	for (i = 0; i < 4; i++)
+		buf[i] = frame->id >> (24 - 8 * i);
+	buf[4] = frame->code;
+	buf[5] = frame->flags;
+	for (i = 0; i < 8; i++)
+		buf[8 + i] = frame->length >> (56 - 8 * i);
+}
+
+//read a v2 frame from buf, OTP_FRAME_LENGTH bytes
+void otpUnpackFrame(const unsigned char* buf, struct otpFrame* frame)
+{
+	int i;
+	frame->id = 0;
+	for (i = 0; i < 4; i++)
+		frame->id = frame->id << 8 | buf[i];
+	frame->code = buf[4];
+	frame->flags = buf[5];
+	frame->length = 0;
+	for (i = 0; i < 8; i++)
+		frame->length = frame->length << 8 | buf[8 + i];
+}
+
+//write a key reference into buf, OTP_KEYREF_LENGTH bytes, big-endian
+void otpPackKeyRef(unsigned char* buf, const struct otpKeyRef* ref)
+{
+	int i;
+	memset(buf, 0, OTP_KEYREF_LENGTH);
+	for (i = 0; i < 4; i++)
+		buf[i] = ref->pad >> (24 - 8 * i);
+	for (i = 0; i < 8; i++)
+		buf[8 + i] = ref->offset >> (56 - 8 * i);
+}
+
+//read a key reference from buf, OTP_KEYREF_LENGTH bytes
+void otpUnpackKeyRef(const unsigned char* buf, struct otpKeyRef* ref)
+{
+	int i;
+	ref->pad = 0;
+	for (i = 0; i < 4; i++)
+		ref->pad = ref->pad << 8 | buf[i];
+	ref->offset = 0;
+	for (i = 0; i < 8; i++)
+		ref->offset = ref->offset << 8 | buf[8 + i];
+}
+
+//write the frame of request id, and its key reference when usePad is set, into buf. Returns the
+//number of bytes written
+static size_t packRequest(unsigned char* buf, uint32_t id, int op, uint64_t length, int usePad,
+		uint32_t pad, uint64_t offset)
+{
+	struct otpFrame frame;
+	struct otpKeyRef ref;
+	frame.id = id;
+	frame.code = op;
+	frame.flags = OTP_V2_FLAG_CHECK | (usePad ? OTP_V2_FLAG_PAD : 0);
+	frame.length = length;
+	otpPackFrame(buf, &frame);
+	if (!usePad)
+		return OTP_FRAME_LENGTH;
+	ref.pad = pad;
+	ref.offset = offset;
+	otpPackKeyRef(buf + OTP_FRAME_LENGTH, &ref);
+	return OTP_FRAME_LENGTH + OTP_KEYREF_LENGTH;
+}
+
+//progress of one connection of otpV2TransferAll
+struct channelState
+{
+	struct otpChannel* channel;
+	size_t up, down; //requests being uploaded and downloaded
+	uint64_t sent, received; //bytes of them so far, frames included
+	unsigned char upFrame[OTP_FRAME_LENGTH + OTP_KEYREF_LENGTH], downFrame[OTP_FRAME_LENGTH];
+	size_t upFrameLength;
+	uint64_t upLength; //everything the request being uploaded sends
+	uint64_t downPayload; //wire bytes of the transformed text of the request being downloaded
+	uint64_t staged; //offset of the window packed into upStage
+	//packed windows are packed into upStage (text, then key) and unpacked from downStage
+	unsigned char *upStage, *downStage;
+	int flags; //the socket's file status flags before the transfer
+	int sending, receiving; //io_uring: a send or a recv is in flight
+};
+
+#define PACKED_WINDOW OTP_PACKED_LENGTH(OTP_STREAM_WINDOW)
+
+//characters of the window of a length-character request that starts at offset
+static size_t windowAt(uint64_t length, uint64_t offset)
+{
+	return length - offset < OTP_STREAM_WINDOW ? length - offset : OTP_STREAM_WINDOW;
+}
+
+//what a channel sends next: its request frames, then windows of text and key. Returns 0 once
+//every request is uploaded
+static int uploadSegment(struct channelState* st, const char** segment, size_t* len)
+{
+	const struct otpChannel* channel = st->channel;
+	const struct otpRequest* request;
+	uint64_t offset, unit, pos;
+	size_t window, wire;
+	if (st->up == channel->n)
+		return 0;
+	request = &channel->requests[st->up];
+	if (st->sent == 0)
+	{
+		st->upFrameLength = packRequest(st->upFrame, st->up, channel->op, request->length, !request->key,
+						request->pad, request->offset);
+		st->upLength = st->upFrameLength + (request->key ? 2 : 1) *
+			       (channel->packed ? OTP_PACKED_LENGTH(request->length) : request->length);
+		st->staged = UINT64_MAX;
+	}
+	if (st->sent < st->upFrameLength)
+	{
+		*segment = (const char*)st->upFrame + st->sent;
+		*len = st->upFrameLength - st->sent;
+	}
+	else if (channel->packed)
+	{
+		//window by window: its text and key packed back to back into upStage
+		unit = (request->key ? 2 : 1) * PACKED_WINDOW;
+		pos = st->sent - st->upFrameLength;
+		offset = pos / unit * OTP_STREAM_WINDOW;
+		window = windowAt(request->length, offset);
+		wire = OTP_PACKED_LENGTH(window);
+		if (st->staged != offset)
+		{
+			otpPack(request->text + offset, st->upStage, window);
+			if (request->key)
+				otpPack(request->key + offset, st->upStage + wire, window);
+			st->staged = offset;
+		}
+		*segment = (const char*)st->upStage + pos % unit;
+		*len = (request->key ? 2 : 1) * wire - pos % unit;
+	}
+	else if (!request->key) //only the text
+	{
+		*segment = request->text + (st->sent - st->upFrameLength);
+		*len = st->upLength - st->sent;
+	}
+	else if (streamSegment(request->length, st->sent - st->upFrameLength, &offset, len))
+		*segment = request->key + offset;
+	else
+		*segment = request->text + offset;
+	return 1;
+}
+
+//account for r bytes of the segment uploadSegment gave
+static void uploaded(struct channelState* st, size_t r)
+{
+	if ((st->sent += r) == st->upLength)
+	{
+		st->up++;
+		st->sent = 0;
+	}
+}
+
+//where a channel receives next: a reply frame, the transformed text (packed windows go to
+//downStage), then the check frame. Returns 0 once every reply is in
+static int downloadSegment(struct channelState* st, char** buf, size_t* len)
+{
+	const struct otpChannel* channel = st->channel;
+	struct otpRequest* request;
+	uint64_t pos;
+	if (st->down == channel->n)
+		return 0;
+	request = &channel->requests[st->down];
+	if (st->received < OTP_FRAME_LENGTH)
+	{
+		*buf = (char*)st->downFrame + st->received;
+		*len = OTP_FRAME_LENGTH - st->received;
+	}
+	else if (st->received < OTP_FRAME_LENGTH + st->downPayload && channel->packed)
+	{
+		pos = st->received - OTP_FRAME_LENGTH;
+		*buf = (char*)st->downStage + pos % PACKED_WINDOW;
+		*len = OTP_PACKED_LENGTH(windowAt(request->length, pos / PACKED_WINDOW * OTP_STREAM_WINDOW)) - pos % PACKED_WINDOW;
+	}
+	else if (st->received < OTP_FRAME_LENGTH + st->downPayload)
+	{
+		*buf = request->out + (st->received - OTP_FRAME_LENGTH);
+		*len = OTP_FRAME_LENGTH + st->downPayload - st->received;
+	}
+	else
+	{
+		*buf = (char*)st->downFrame + (st->received - OTP_FRAME_LENGTH - st->downPayload);
+		*len = 2 * OTP_FRAME_LENGTH + st->downPayload - st->received;
+	}
+	return 1;
+}
+
+//account for r > 0 bytes received where downloadSegment said. Returns -1 with errno EPROTO if the
+//daemon sent a malformed reply
+static int downloaded(struct channelState* st, size_t r)
+{
+	const struct otpChannel* channel = st->channel;
+	struct otpRequest* request = &channel->requests[st->down];
+	struct otpFrame frame;
+	uint64_t pos, offset;
+	size_t window;
+	if (channel->packed && st->received >= OTP_FRAME_LENGTH && st->received < OTP_FRAME_LENGTH + st->downPayload)
+	{
+		//a packed window is unpacked once all of it is in
+		pos = st->received - OTP_FRAME_LENGTH;
+		offset = pos / PACKED_WINDOW * OTP_STREAM_WINDOW;
+		window = windowAt(request->length, offset);
+		if (pos % PACKED_WINDOW + r == OTP_PACKED_LENGTH(window))
+		{
+			otpUnpack(st->downStage, request->out + offset, window);
+			request->done = offset + window;
+		}
+	}
+	else if (st->received >= OTP_FRAME_LENGTH && st->received < OTP_FRAME_LENGTH + st->downPayload)
+		request->done = st->received - OTP_FRAME_LENGTH + r;
+	st->received += r;
+	if (st->received == OTP_FRAME_LENGTH)
+	{
+		otpUnpackFrame(st->downFrame, &frame);
+		request->status = frame.code;
+		st->downPayload = channel->packed ? OTP_PACKED_LENGTH(request->length) : request->length;
+		if (frame.id != st->down || (frame.code == OTP_V2_OK && frame.length != request->length))
+		{
+			errno = EPROTO;
+			return -1;
+		}
+	}
+	else if (st->received == 2 * OTP_FRAME_LENGTH + st->downPayload)
+	{
+		otpUnpackFrame(st->downFrame, &frame);
+		request->status = frame.code;
+		if (frame.id != st->down)
+		{
+			errno = EPROTO;
+			return -1;
+		}
+	}
+	//a refused request has no payload and no check frame
+	if (st->received >= OTP_FRAME_LENGTH &&
+	    (request->status != OTP_V2_OK || st->received == 2 * OTP_FRAME_LENGTH + st->downPayload))
+	{
+		st->down++;
+		st->received = 0;
+	}
+	return 0;
+}
+
+//run the channels with poll and non-blocking send and recv. Returns 0, or -1 with errno set
+static int pollChannels(struct channelState* states, size_t n)
+{
+	struct pollfd* pfds = calloc(n, sizeof(struct pollfd));
+	const char* segment;
+	char* buf;
+	size_t i, len, busy;
+	ssize_t r;
+	int status = -1;
+	if (!pfds)
+		return -1;
+	while (1)
+	{
+		//a rejected request's reply can arrive before its payload is sent
+		for (i = 0, busy = 0; i < n; i++)
+		{
+			struct channelState* st = &states[i];
+			pfds[i].events = (st->down < st->channel->n ? POLLIN : 0) | (st->up < st->channel->n ? POLLOUT : 0);
+			pfds[i].fd = pfds[i].events ? st->channel->socketFD : -1;
+			busy += pfds[i].events != 0;
+		}
+		if (busy == 0)
+			break;
+		if (poll(pfds, n, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			goto done;
+		}
+		for (i = 0; i < n; i++)
+		{
+			struct channelState* st = &states[i];
+			if ((pfds[i].revents & POLLOUT) && uploadSegment(st, &segment, &len))
+			{
+				r = send(pfds[i].fd, segment, len, MSG_NOSIGNAL);
+				if (r > 0)
+					uploaded(st, r);
+				else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					goto done;
+			}
+			if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && downloadSegment(st, &buf, &len))
+			{
+				r = recv(pfds[i].fd, buf, len, 0);
+				if (r == 0)
+				{
+					errno = ECONNRESET;
+					goto done;
+				}
+				if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					goto done;
+				if (r > 0 && downloaded(st, r) < 0)
+					goto done;
+			}
+		}
+	}
+	status = 0;
+done:
+	free(pfds);
+	return status;
+}
+
+#ifdef OTP_URING
+/***********************************************************************************************
+ * Function: ringChannels
+ * Description: This function runs the channels on an io_uring. Every channel keeps a send and a
+ * 		recv in flight, and each pass queues the next ones of every channel that moved,
+ * 		submits them and waits for completions in a single io_uring_enter.
+ * Arguments: ring: struct otpRing*, a ring of this thread
+ * 	      states: struct channelState*, the channels
+ * 	      n: size_t, the number of channels
+ * Return: 0, or -1 with errno set; after an error the sockets are shut down and the operations
+ * 	   in flight are waited for, so that none of them touches the buffers once this returns
+ * **********************************************************************************************/
+static int ringChannels(struct otpRing* ring, struct channelState* states, size_t n)
+{
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+	struct channelState* st;
+	const char* segment;
+	char* buf;
+	size_t i, len, inFlight = 0;
+	uintptr_t data;
+	int res, err = 0, shut = 0;
+	while (1)
+	{
+		for (i = 0; i < n && !err; i++)
+		{
+			st = &states[i];
+			if (!st->sending && uploadSegment(st, &segment, &len))
+			{
+				if (!(sqe = otpRingGet(ring, st->channel->socketFD, st)))
+				{
+					err = EBUSY;
+					break;
+				}
+				sqe->opcode = IORING_OP_SEND;
+				sqe->addr = (uintptr_t)segment;
+				sqe->len = len < (1u << 30) ? len : (1u << 30);
+				sqe->msg_flags = MSG_NOSIGNAL;
+				st->sending = 1;
+				inFlight++;
+			}
+			if (!st->receiving && downloadSegment(st, &buf, &len))
+			{
+				//the low bit of the completion's data tells a recv from a send
+				if (!(sqe = otpRingGet(ring, st->channel->socketFD, (char*)st + 1)))
+				{
+					err = EBUSY;
+					break;
+				}
+				sqe->opcode = IORING_OP_RECV;
+				sqe->addr = (uintptr_t)buf;
+				sqe->len = len < (1u << 30) ? len : (1u << 30);
+				st->receiving = 1;
+				inFlight++;
+			}
+		}
+		//nothing new is queued after an error, and what is in flight may wait on a daemon that
+		//stopped reading: shutting the sockets down makes it complete
+		if (err && !shut)
+		{
+			for (i = 0; i < n; i++)
+				shutdown(states[i].channel->socketFD, SHUT_RDWR);
+			shut = 1;
+		}
+		if (inFlight == 0)
+			break;
+		if (otpRingEnter(ring, 1) < 0 && errno != EINTR && errno != EBUSY)
+		{
+			err = errno; //the ring is unusable: closing it cancels what is in flight
+			break;
+		}
+		while ((cqe = otpRingPeek(ring)))
+		{
+			data = cqe->user_data;
+			res = cqe->res;
+			otpRingSeen(ring);
+			inFlight--;
+			st = (struct channelState*)(data & ~(uintptr_t)1);
+			if (data & 1)
+				st->receiving = 0;
+			else
+				st->sending = 0;
+			if (err || res == -EINTR || res == -EAGAIN)
+				continue; //failed already, or to be queued again
+			if (res < 0)
+				err = -res;
+			else if (!(data & 1))
+				uploaded(st, res);
+			else if (res == 0)
+				err = ECONNRESET;
+			else if (downloaded(st, res) < 0)
+				err = errno;
+		}
+	}
+	errno = err;
+	return err ? -1 : 0;
+}
+#endif
+
+/***********************************************************************************************
+ * Function: otpV2TransferAll
+ * Description: This function runs the protocol v2 requests of several connections at once from
+ * 		this thread. Every connection pipelines its requests: the frames and windows of
+ * 		all of them are uploaded while the replies are downloaded, so that neither side
+ * 		waits for the other. A request without a key sends a reference to its pad range
+ * 		and only the text; on a packed connection the windows travel packed. The I/O goes
+ * 		through an io_uring where there is one, and through poll otherwise or when
+ * 		OTP_CLIENT_POLL is set in the environment.
+ * Arguments: channels: struct otpChannel*, the connections, each with its handshake done, and
+ * 	      		their requests
+ * 	      n: size_t, the number of connections
+ * Postcondition: each request's status is set, and its out holds the transformed text when the
+ * 		  status is OTP_V2_OK; the daemon checks the input, and invalid text or key gets
+ * 		  OTP_V2_BAD_TEXT or OTP_V2_BAD_KEY. Each request's done tells how much of out
+ * 		  is in, so a transfer that fails can go on from there in a new request
+ * Return: 0 on success, -1 with errno set on errors, if a daemon closes early or if it sends a
+ * 	   malformed reply (EPROTO)
+ * **********************************************************************************************/
+int otpV2TransferAll(struct otpChannel* channels, size_t n)
+{
+	struct channelState* states = calloc(n, sizeof(struct channelState));
+	size_t i, j, ready = 0;
+	int status = -1, err;
+	if (!states)
+		return -1;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < channels[i].n; j++)
+			channels[i].requests[j].done = 0;
+	for (i = 0; i < n; i++, ready++)
+	{
+		struct channelState* st = &states[i];
+		st->channel = &channels[i];
+		st->flags = fcntl(channels[i].socketFD, F_GETFL);
+		if (st->flags < 0 || fcntl(channels[i].socketFD, F_SETFL, st->flags | O_NONBLOCK) < 0)
+			goto done;
+		if (channels[i].packed && (!(st->upStage = malloc(2 * PACKED_WINDOW)) || !(st->downStage = malloc(PACKED_WINDOW))))
+		{
+			ready++; //its flags are to be restored
+			goto done;
+		}
+	}
+
+#ifdef OTP_URING
+	struct otpRing ring;
+	if (!getenv("OTP_CLIENT_POLL") && otpRingSetup(&ring, 2 * n < 4096 ? 2 * n : 4096) == 0)
+	{
+		status = ringChannels(&ring, states, n);
+		err = errno;
+		otpRingClose(&ring);
+		errno = err;
+		goto done;
+	}
+#endif
+	status = pollChannels(states, n);
+done:
+	err = errno;
+	for (i = 0; i < ready; i++)
+	{
+		fcntl(channels[i].socketFD, F_SETFL, states[i].flags);
+		free(states[i].upStage);
+		free(states[i].downStage);
+	}
+	free(states);
+	errno = err;
+	return status;
+}
+
+//otpV2TransferAll on one connection
+int otpV2Transfer(int socketFD, int op, struct otpRequest* requests, size_t n)
+{
+	struct otpChannel channel = { socketFD, op, 0, requests, n };
+	return otpV2TransferAll(&channel, 1);
+}
+
+//otpV2Transfer over a connection with the packed v2 handshake: the windows travel packed, and
+//characters outside the alphabet arrive at the daemon as invalid ones
+int otpV2TransferPacked(int socketFD, int op, struct otpRequest* requests, size_t n)
+{
+	struct otpChannel channel = { socketFD, op, 1, requests, n };
+	return otpV2TransferAll(&channel, 1);
+}
+
+//write all n bytes of buf to fd, which need not be a socket, at *position (advanced) or, with
+//position NULL, at the file position. Returns 0 or -1
+static int writeAll(int fd, const char* buf, size_t n, off_t* position)
+{
+	ssize_t written;
+	while (n > 0)
+	{
+		written = position ? pwrite(fd, buf, n, *position) : write(fd, buf, n);
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += written;
+		n -= written;
+		if (position)
+			*position += written;
+	}
+	return 0;
+}
+
+//move n bytes from the pipe to outFD like writeAll, by splice while outFD takes it. Returns 0 or -1
+static int drainPipe(int pipeFD, int outFD, size_t n, int* canSplice, off_t* position)
+{
+	char buf[16384];
+	ssize_t r;
+	while (n > 0)
+	{
+		if (*canSplice)
+		{
+			r = splice(pipeFD, NULL, outFD, position, n, SPLICE_F_MOVE);
+			if (r < 0 && errno == EINVAL) //e.g. a terminal or an O_APPEND file
+			{
+				*canSplice = 0;
+				continue;
+			}
+		}
+		else
+		{
+			r = read(pipeFD, buf, n < sizeof(buf) ? n : sizeof(buf));
+			if (r > 0 && writeAll(outFD, buf, r, position) < 0)
+				return -1;
+		}
+		if (r < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		n -= r;
+	}
+	return 0;
+}
+
+/***********************************************************************************************
+ * Function: otpV2TransferFile
+ * Description: This function runs one protocol v2 request whose text and key are files, without
+ * 		reading them into memory: the upload goes from the files to the socket with
+ * 		sendfile (only request->length characters of key), and the reply goes from the
+ * 		socket to request->outFD with splice through a pipe, or through a small buffer
+ * 		where splice does not work. Upload and download overlap like in otpV2Transfer.
+ * Arguments: socketFD: int, a connected socket whose v2 handshake is done
+ * 	      op: int, OTP_V2_OP_ENCODE or OTP_V2_OP_DECODE
+ * 	      request: struct otpFileRequest*, the request; text and key start at request->start
+ * 	      	       in their files
+ * Postcondition: request->status is set; with OTP_V2_OK the transformed text was written to outFD.
+ * 		  request->done counts the characters written, so a transfer that fails can go
+ * 		  on from there in a new request
+ * Return: 0 on success, -1 with errno set on errors, if a file is shorter than the request (EIO),
+ * 	   if the daemon closes early or if it sends a malformed reply (EPROTO)
+ * **********************************************************************************************/
+int otpV2TransferFile(int socketFD, int op, struct otpFileRequest* request)
+{
+	unsigned char header[OTP_FRAME_LENGTH + OTP_KEYREF_LENGTH], downFrame[OTP_FRAME_LENGTH];
+	int usePad = request->keyFD < 0, canSplice = 1, status = -1, err;
+	size_t headerLength = packRequest(header, 0, op, request->length, usePad, request->pad, request->offset);
+	uint64_t upLength = headerLength + (usePad ? 1 : 2) * request->length;
+	uint64_t sent = 0, received = 0, replyLength = OTP_FRAME_LENGTH, offset;
+	struct otpFrame frame;
+	struct pollfd pfd;
+	size_t len;
+	ssize_t r;
+	off_t fileOffset, outPosition = request->outOffset, *position = request->outOffset >= 0 ? &outPosition : NULL;
+	char buf[16384];
+	int pipeFDs[2] = { -1, -1 };
+	int flags = fcntl(socketFD, F_GETFL);
+	request->done = 0;
+	if (flags < 0 || fcntl(socketFD, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	if (pipe2(pipeFDs, O_CLOEXEC) < 0)
+		canSplice = 0;
+
+	pfd.fd = socketFD;
+	while (sent < upLength || received < replyLength)
+	{
+		pfd.events = (received < replyLength ? POLLIN : 0) | (sent < upLength ? POLLOUT : 0);
+		if (poll(&pfd, 1, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			goto done;
+		}
+		if (sent < upLength && (pfd.revents & POLLOUT))
+		{
+			if (sent < headerLength)
+				r = send(socketFD, header + sent, headerLength - sent, MSG_NOSIGNAL);
+			else
+			{
+				//the text alone with a pad, else alternating windows of text and key
+				if (usePad)
+				{
+					offset = sent - headerLength;
+					len = upLength - sent;
+					fileOffset = request->start + offset;
+					r = sendfile(socketFD, request->textFD, &fileOffset, len);
+				}
+				else
+				{
+					int isKey = streamSegment(request->length, sent - headerLength, &offset, &len);
+					fileOffset = request->start + offset;
+					r = sendfile(socketFD, isKey ? request->keyFD : request->textFD, &fileOffset, len);
+				}
+				if (r == 0)
+				{
+					errno = EIO;
+					goto done;
+				}
+			}
+			if (r > 0)
+				sent += r;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				goto done;
+		}
+		if (received < replyLength && (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			//reply frame, transformed text, check frame
+			if (received < OTP_FRAME_LENGTH)
+				r = recv(socketFD, downFrame + received, OTP_FRAME_LENGTH - received, 0);
+			else if (received >= replyLength - OTP_FRAME_LENGTH)
+				r = recv(socketFD, downFrame + (received - (replyLength - OTP_FRAME_LENGTH)), replyLength - received, 0);
+			else if (pipeFDs[0] >= 0)
+			{
+				r = splice(socketFD, NULL, pipeFDs[1], NULL, replyLength - OTP_FRAME_LENGTH - received,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (r > 0 && drainPipe(pipeFDs[0], request->outFD, r, &canSplice, position) < 0)
+					goto done;
+				if (r > 0)
+					request->done += r;
+			}
+			else
+			{
+				r = recv(socketFD, buf, replyLength - OTP_FRAME_LENGTH - received < sizeof(buf) ?
+						replyLength - OTP_FRAME_LENGTH - received : sizeof(buf), 0);
+				if (r > 0 && writeAll(request->outFD, buf, r, position) < 0)
+					goto done;
+				if (r > 0)
+					request->done += r;
+			}
+			if (r == 0)
+			{
+				errno = ECONNRESET;
+				goto done;
+			}
+			if (r < 0)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					goto done;
+				continue;
+			}
+			received += r;
+			if (received == OTP_FRAME_LENGTH)
+			{
+				otpUnpackFrame(downFrame, &frame);
+				request->status = frame.code;
+				if (frame.id != 0 || (frame.code == OTP_V2_OK && frame.length != request->length))
+				{
+					errno = EPROTO;
+					goto done;
+				}
+				if (frame.code == OTP_V2_OK)
+					replyLength += request->length + OTP_FRAME_LENGTH;
+			}
+			else if (received == replyLength)
+			{
+				otpUnpackFrame(downFrame, &frame);
+				request->status = frame.code;
+				if (frame.id != 0)
+				{
+					errno = EPROTO;
+					goto done;
+				}
+			}
+		}
+	}
+	status = 0;
+done:
+	err = errno;
+	if (pipeFDs[0] >= 0)
+	{
+		close(pipeFDs[0]);
+		close(pipeFDs[1]);
+	}
+	fcntl(socketFD, F_SETFL, flags);
+	errno = err;
+	return status;
+}
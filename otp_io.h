@@ -0,0 +1,65 @@
+/**************************************************************************************
+ * Description: Socket helpers shared by the otp clients and daemons.
+ *************************************************************************************/
+
+#ifndef OTP_IO_H
+#define OTP_IO_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "otp_protocol.h"
+
+#define OTP_IO_CHUNK (1 << 20) //default largest single send/recv
+#define OTP_SOCKET_BUFFER_MAX (4 << 20) //largest socket buffer otpSizeSocketBuffers asks for
+
+//one protocol v2 request of a client
+struct otpRequest
+{
+	const char *text, *key; //length characters each; no key to use a pad of the daemon
+	char* out; //receives the length transformed characters
+	uint64_t length;
+	int status; //the daemon's reply status
+	uint32_t pad; //without a key: the pad and the offset of the key in it
+	uint64_t offset;
+	uint64_t done; //characters at the start of out that came back, also when the transfer fails
+};
+
+//one protocol v2 request of a client whose text and key are files
+struct otpFileRequest
+{
+	int textFD, keyFD; //length characters each from offset start; keyFD -1 to use a pad of the daemon
+	uint64_t start, length;
+	int outFD; //receives the length transformed characters
+	int64_t outOffset; //where in outFD they go, or -1 for its file position
+	int status; //the daemon's reply status
+	uint32_t pad; //without a key file: the pad and the offset of the key in it
+	uint64_t offset;
+	uint64_t done; //characters written to outFD, also when the transfer fails
+};
+
+//one v2 connection of otpV2TransferAll and the requests to run over it
+struct otpChannel
+{
+	int socketFD; //connected, with its v2 handshake done
+	int op; //OTP_V2_OP_ENCODE or OTP_V2_OP_DECODE
+	int packed; //1 if the handshake was the packed one
+	struct otpRequest* requests; //request i gets id i
+	size_t n;
+};
+
+void otpSetIoChunk(size_t chunk);
+int otpWriteToSocket(int socketFD, const char* text, size_t ntext);
+int otpWritevToSocket(int socketFD, struct iovec* iov, int iovcnt);
+int otpReadFromSocket(int socketFD, char* text, size_t ntext);
+void otpSizeSocketBuffers(int socketFD, size_t n);
+int otpConnect(const char* hostname, int port);
+void otpPackFrame(unsigned char* buf, const struct otpFrame* frame);
+void otpUnpackFrame(const unsigned char* buf, struct otpFrame* frame);
+void otpPackKeyRef(unsigned char* buf, const struct otpKeyRef* ref);
+void otpUnpackKeyRef(const unsigned char* buf, struct otpKeyRef* ref);
+int otpV2TransferAll(struct otpChannel* channels, size_t n);
+int otpV2Transfer(int socketFD, int op, struct otpRequest* requests, size_t n);
+int otpV2TransferPacked(int socketFD, int op, struct otpRequest* requests, size_t n);
+int otpV2TransferFile(int socketFD, int op, struct otpFileRequest* request);
+
+#endif
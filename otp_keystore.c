@@ -0,0 +1,121 @@
+/**************************************************************************************
+ * Description: Pad files mapped by the daemons and their consumption cursors. The
+ * 		daemons read keys straight from the mapping; nothing is copied.
+ *************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_protocol.h"
+#include "otp_keystore.h"
+
+/***********************************************************************************************
+ * Function: otpKeyStoreAdd
+ * Description: This function maps the pad file at path and its cursor file "path.used", which
+ * 		is created with both cursors at 0 the first time. A pad is a line of key characters,
+ * 		like keygen writes; a trailing new line is not part of the key.
+ * Arguments: store: struct otpKeyStore*, the daemon's pads
+ * 	      path: const char*, the pad file
+ * Return: the pad's id, or -1 with errno set if the files cannot be mapped, the store is full
+ * 	   (ENOSPC) or the pad holds something other than key characters (EINVAL)
+ * **********************************************************************************************/
+int otpKeyStoreAdd(struct otpKeyStore* store, const char* path)
+{
+	struct otpPad* pad;
+	struct stat st;
+	char* cursorPath;
+	int fd, err;
+	void* map;
+
+	if (store->n == OTP_MAX_PADS) { errno = ENOSPC; return -1; }
+	pad = &store->pads[store->n];
+	pad->path = path;
+
+	//the pad itself, read only
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	pad->data = map;
+	pad->length = st.st_size;
+	if (pad->data[pad->length - 1] == '\n')
+		pad->length--;
+	if (otpValidate(pad->data, pad->length) != pad->length)
+	{
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	//the cursors, one per op, shared with every process and kept across restarts
+	if (!(cursorPath = malloc(strlen(path) + sizeof(".used"))))
+		return -1;
+	sprintf(cursorPath, "%s.used", path);
+	fd = open(cursorPath, O_RDWR | O_CREAT, 0600);
+	free(cursorPath);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, 2 * sizeof(uint64_t)) < 0 ||
+	    (map = mmap(NULL, 2 * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	close(fd);
+	pad->cursors = map;
+	return store->n++;
+}
+
+/***********************************************************************************************
+ * Function: otpKeyStoreClaim
+ * Description: This function hands out length characters of a pad starting at offset for one
+ * 		request, and moves the op's cursor past them with a compare-and-swap, so that no two
+ * 		requests, in any process, ever get overlapping ranges. Characters skipped over by
+ * 		a higher offset are never handed out either.
+ * Arguments: store: struct otpKeyStore*, the daemon's pads
+ * 	      pad: uint32_t, the pad id
+ * 	      op: enum otpOp, the request's op; encode and decode have their own cursors
+ * 	      offset, length: uint64_t, the range of the pad
+ * 	      status: int*, set to OTP_V2_NO_PAD, OTP_V2_KEY_RANGE or OTP_V2_KEY_USED on failure
+ * Return: the key, pointing into the mapped pad, or NULL if the range cannot be used
+ * **********************************************************************************************/
+const char* otpKeyStoreClaim(struct otpKeyStore* store, uint32_t pad, enum otpOp op,
+		uint64_t offset, uint64_t length, int* status)
+{
+	struct otpPad* p;
+	uint64_t* cursor;
+	uint64_t used;
+
+	if (!store || pad >= (uint32_t)store->n) { *status = OTP_V2_NO_PAD; return NULL; }
+	p = &store->pads[pad];
+	if (offset > p->length || length > p->length - offset) { *status = OTP_V2_KEY_RANGE; return NULL; }
+	cursor = &p->cursors[op];
+	used = __atomic_load_n(cursor, __ATOMIC_ACQUIRE);
+	do {
+		if (offset < used) { *status = OTP_V2_KEY_USED; return NULL; }
+	} while (!__atomic_compare_exchange_n(cursor, &used, offset + length, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return p->data + offset;
+}
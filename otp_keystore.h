@@ -0,0 +1,35 @@
+/**************************************************************************************
+ * Description: Pad files mapped by the daemons, so that clients can name a range of a
+ * 		pad instead of sending the key. Every pad has a consumption cursor per op
+ * 		in a small file next to it ("pad.used"), mapped shared so that all the
+ * 		daemon's processes, and the daemon after a restart, see the same cursors;
+ * 		a range below the cursor has been used and is refused.
+ *************************************************************************************/
+
+#ifndef OTP_KEYSTORE_H
+#define OTP_KEYSTORE_H
+
+#include <stdint.h>
+#include "otp_codec.h"
+
+#define OTP_MAX_PADS 16 //pads one daemon can load
+
+struct otpPad
+{
+	const char* path;
+	const char* data; //the mapped pad, length characters
+	uint64_t length;
+	uint64_t* cursors; //per op: the first character not used yet, shared with "path.used"
+};
+
+struct otpKeyStore
+{
+	int n;
+	struct otpPad pads[OTP_MAX_PADS];
+};
+
+int otpKeyStoreAdd(struct otpKeyStore* store, const char* path);
+const char* otpKeyStoreClaim(struct otpKeyStore* store, uint32_t pad, enum otpOp op,
+		uint64_t offset, uint64_t length, int* status);
+
+#endif
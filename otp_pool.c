@@ -0,0 +1,95 @@
+/**************************************************************************************
+ * Description: Request buffer pool, see otp_pool.h. Buffers are anonymous mappings of
+ * 		their class size, so a kept one needs no bookkeeping besides the free
+ * 		list threaded through it, and huge pages can be asked for per mapping.
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "otp_pool.h"
+
+//set up an empty pool keeping up to limit bytes; hugePages backs large buffers with huge pages
+void otpPoolInit(struct otpPool* pool, size_t limit, int hugePages)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->limit = limit;
+	pool->hugePages = hugePages;
+}
+
+//the class of a buffer of n bytes and its size; classes past the last one are rounded up to pages
+static int sizeClass(size_t n, size_t* size)
+{
+	int c = 0;
+	if (n > ((size_t)1 << OTP_POOL_MIN_SHIFT))
+		c = 64 - __builtin_clzll((uint64_t)n - 1) - OTP_POOL_MIN_SHIFT;
+	if (c >= OTP_POOL_CLASSES)
+		*size = (n + ((size_t)1 << OTP_POOL_MIN_SHIFT) - 1) & ~(((size_t)1 << OTP_POOL_MIN_SHIFT) - 1);
+	else
+		*size = (size_t)1 << (c + OTP_POOL_MIN_SHIFT);
+	return c;
+}
+
+//map size bytes: from the reserved huge pages if asked and there are any, else transparent huge
+//pages are asked for. Returns NULL with errno set if out of memory
+static void* mapBuffer(size_t size, int hugePages)
+{
+	void* buffer;
+	hugePages = hugePages && size >= OTP_POOL_HUGE;
+	if (hugePages)
+	{
+		buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buffer != MAP_FAILED)
+			return buffer;
+	}
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED)
+		return NULL;
+	if (hugePages)
+		madvise(buffer, size, MADV_HUGEPAGE);
+	return buffer;
+}
+
+/****************************************************************************************************
+ * Function: otpPoolGet
+ * Description: This function hands out a buffer of at least n bytes: the last one given back in its
+ * 		class if there is one, else a new mapping. A kept buffer still holds what it held
+ * 		before; only new ones are zeroed.
+ * Arguments: pool: struct otpPool*, the worker's pool, or NULL to map a buffer that is not kept
+ * 	      n: size_t, the bytes needed, more than 0
+ * Return: the buffer, to be given back with otpPoolPut(pool, buffer, n), or NULL with errno set
+ * ****************************************************************************************************/
+void* otpPoolGet(struct otpPool* pool, size_t n)
+{
+	size_t size;
+	int c = sizeClass(n, &size);
+	void* buffer;
+	if (pool && c < OTP_POOL_CLASSES && (buffer = pool->free[c]))
+	{
+		pool->free[c] = *(void**)buffer;
+		pool->cached -= size;
+		return buffer;
+	}
+	return mapBuffer(size, pool && pool->hugePages);
+}
+
+//give back a buffer otpPoolGet handed out for n bytes: it is kept if the pool has room, else unmapped.
+//A NULL buffer is ignored
+void otpPoolPut(struct otpPool* pool, void* buffer, size_t n)
+{
+	size_t size;
+	int c;
+	if (!buffer)
+		return;
+	c = sizeClass(n, &size);
+	if (pool && c < OTP_POOL_CLASSES && pool->cached + size <= pool->limit)
+	{
+		*(void**)buffer = pool->free[c];
+		pool->free[c] = buffer;
+		pool->cached += size;
+		return;
+	}
+	munmap(buffer, size);
+}
+
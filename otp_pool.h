@@ -0,0 +1,31 @@
+/**************************************************************************************
+ * Description: A pool of request buffers for one worker (a process or a server thread),
+ * 		in power-of-two size classes. A buffer given back is kept for the next
+ * 		request of its class, so its pages stay mapped and warm instead of being
+ * 		faulted in and zeroed again for every request. Buffers from 2 MB up can
+ * 		be backed by huge pages. A pool is not locked: only its worker uses it.
+ *************************************************************************************/
+
+#ifndef OTP_POOL_H
+#define OTP_POOL_H
+
+#include <stddef.h>
+
+#define OTP_POOL_MIN_SHIFT 12 //the smallest class: 4 KB
+#define OTP_POOL_CLASSES 20 //4 KB, 8 KB, ... 2 GB; larger buffers are mapped and unmapped each time
+#define OTP_POOL_HUGE (2u << 20) //buffers from this size get huge pages if the pool asks for them
+#define OTP_POOL_LIMIT (64u << 20) //default bytes a pool keeps
+
+struct otpPool
+{
+	void* free[OTP_POOL_CLASSES]; //kept buffers of each class, linked through their first bytes
+	size_t cached; //bytes kept in free
+	size_t limit; //most bytes kept; a buffer given back past it is unmapped
+	int hugePages; //back buffers from OTP_POOL_HUGE up with huge pages
+};
+
+void otpPoolInit(struct otpPool* pool, size_t limit, int hugePages);
+void* otpPoolGet(struct otpPool* pool, size_t n);
+void otpPoolPut(struct otpPool* pool, void* buffer, size_t n);
+
+#endif
@@ -0,0 +1,82 @@
+/**************************************************************************************
+ * Description: Wire protocol shared by the otp clients and daemons. A client sends a
+ * 		3 byte handshake ("enc" or "dec"), the daemon answers with its own, then
+ * 		the client sends a 10 byte ASCII length field, the text and the key, and
+ * 		the daemon answers with the transformed text.
+ * 		Streaming mode: the client sends "ens" or "des" instead. A daemon that
+ * 		streams answers with the same string; an older one answers "enc"/"dec"
+ * 		and closes, and the client falls back to the mode above. After the
+ * 		length field (now the exact text length, no '\0') the client sends
+ * 		the text and key in alternating windows of OTP_STREAM_WINDOW bytes
+ * 		each (the last ones shorter), and the daemon sends each transformed
+ * 		window back as soon as it has both halves.
+ * 		Protocol v2: the client sends "en2" or "de2" and a v2 daemon echoes it
+ * 		(an older one answers "enc"/"dec" and closes). The connection then
+ * 		carries any number of requests, each a OTP_FRAME_LENGTH byte frame
+ * 		(request id, op, 64-bit length, big-endian) followed by text and key
+ * 		in the windows of the streaming mode. The daemon answers each request,
+ * 		in order, with a frame holding the same id, a status and the length,
+ * 		followed by the transformed text when the status is OTP_V2_OK. The
+ * 		client may send further requests before the earlier answers arrive,
+ * 		and closes the connection when it is done.
+ * 		A v2 request with OTP_V2_FLAG_PAD set carries no key: a key reference
+ * 		(pad id, offset) follows its frame, then just the text, and the daemon
+ * 		takes the key from that range of a pad it has loaded.
+ * 		A v2 request with OTP_V2_FLAG_CHECK set asks the daemon to check its
+ * 		text and key while transforming them: the transformed text of an
+ * 		OTP_V2_OK reply is then followed by a check frame with the same id, a
+ * 		status (OTP_V2_OK, OTP_V2_BAD_TEXT or OTP_V2_BAD_KEY) and, when the
+ * 		input was bad, the position of its first invalid character as length.
+ * 		Packed v2: the client sends "enp" or "dep" and a daemon that packs
+ * 		echoes it (an older one answers "enc"/"dec" and closes). The connection
+ * 		is v2, except that every window of text, key and transformed text
+ * 		travels packed: OTP_PACKED_LENGTH(window) bytes, 8 symbols in 5 bytes
+ * 		(see otp_codec.c).
+ *************************************************************************************/
+
+#ifndef OTP_PROTOCOL_H
+#define OTP_PROTOCOL_H
+
+#include <stdint.h>
+
+#define OTP_HANDSHAKE_LENGTH 3 //"enc" or "dec"
+#define OTP_LENGTH_FIELD 10 //ASCII message length sent after the handshake
+#define OTP_BUSY "bsy" //handshake reply of a saturated daemon that rejects the connection
+#define OTP_STREAM_ENC "ens" //streaming handshakes
+#define OTP_STREAM_DEC "des"
+#define OTP_STREAM_WINDOW 65536 //bytes of text, and of key, per window in streaming mode
+#define OTP_V2_ENC "en2" //protocol v2 handshakes
+#define OTP_V2_DEC "de2"
+#define OTP_V2_PACKED_ENC "enp" //packed v2 handshakes
+#define OTP_V2_PACKED_DEC "dep"
+#define OTP_FRAME_LENGTH 16 //id (4 bytes), op or status (1), flags (1), reserved (2), length (8)
+#define OTP_KEYREF_LENGTH 16 //pad id (4 bytes), reserved (4), offset (8)
+#define OTP_V2_FLAG_PAD 1 //request flag: the key is a range of a pad held by the daemon
+#define OTP_V2_FLAG_CHECK 2 //request flag: the daemon checks text and key and sends a check frame
+#define OTP_V2_OP_ENCODE 0 //request ops
+#define OTP_V2_OP_DECODE 1
+#define OTP_V2_OK 0 //reply statuses
+#define OTP_V2_BAD_OP 1 //the daemon does not run this op; the request's payload is skipped
+#define OTP_V2_NO_PAD 2 //the daemon has no pad with this id
+#define OTP_V2_KEY_RANGE 3 //the key range is past the end of the pad
+#define OTP_V2_KEY_USED 4 //the key range, or part of it, has been used before
+#define OTP_V2_BAD_TEXT 5 //check frame: the text has a character outside A-Z and space
+#define OTP_V2_BAD_KEY 6 //check frame: the key has a character outside A-Z and space
+
+//a v2 request or reply frame
+struct otpFrame
+{
+	uint32_t id;
+	uint8_t code; //op in requests, status in replies
+	uint8_t flags; //OTP_V2_FLAG_PAD and OTP_V2_FLAG_CHECK, in requests
+	uint64_t length;
+};
+
+//the key of a v2 request with OTP_V2_FLAG_PAD
+struct otpKeyRef
+{
+	uint32_t pad;
+	uint64_t offset;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/**************************************************************************************
+ * Description: Key material generator. Each otpRand is a ChaCha20 keystream; streams
+ * 		sharing a seed but with different stream numbers are independent, so
+ * 		several threads can fill disjoint parts of one pad. Bytes are mapped onto
+ * 		the 27 symbols by rejection sampling: only bytes below 243 = 27 * 9 are
+ * 		used, which makes every symbol equally likely.
+ *************************************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+#include "otp_rand.h"
+
+//OTP_RAND_BLOCKS lanes of one ChaCha20 state word
+typedef uint32_t lanes __attribute__((vector_size(4 * OTP_RAND_BLOCKS)));
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7)
+
+#define REJECT 243 //bytes at or above this are discarded
+
+//key character of each keystream byte, 0 for rejected bytes
+static const char keyChar[256] = {
+#define R9 "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+	R9 R9 R9 R9 R9 R9 R9 R9 R9
+#undef R9
+};
+
+/***********************************************************************************************
+ * Function: chachaBlocks
+ * Description: This function computes the next OTP_RAND_BLOCKS keystream blocks at once, one
+ * 		block per vector lane, and advances the block counter past them. It is compiled
+ * 		for AVX-512, AVX2 and generic x86-64, and the loader picks the variant.
+ * Arguments: state: uint32_t[16], the ChaCha20 state
+ * 	      out: uint32_t*, receives the 16 * OTP_RAND_BLOCKS words in stream order
+ * **********************************************************************************************/
+#if defined(__x86_64__) && defined(__GLIBC__)
+__attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+static void chachaBlocks(uint32_t state[16], uint32_t* out)
+{
+	int i, j;
+	uint64_t counter = (uint64_t)state[13] << 32 | state[12];
+	lanes x[16], start[16];
+	for (i = 0; i < 16; i++)
+		for (j = 0; j < OTP_RAND_BLOCKS; j++)
+			start[i][j] = state[i];
+	//64-bit block counter in words 12 and 13
+	for (j = 0; j < OTP_RAND_BLOCKS; j++)
+	{
+		start[12][j] = (uint32_t)(counter + j);
+		start[13][j] = (uint32_t)((counter + j) >> 32);
+	}
+	memcpy(x, start, sizeof(x));
+	for (i = 0; i < 10; i++)
+	{
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+	{
+		x[i] += start[i];
+		for (j = 0; j < OTP_RAND_BLOCKS; j++)
+			out[j * 16 + i] = x[i][j];
+	}
+	counter += OTP_RAND_BLOCKS;
+	state[12] = (uint32_t)counter;
+	state[13] = (uint32_t)(counter >> 32);
+}
+
+/***********************************************************************************************
+ * Function: otpRandInit
+ * Description: This function starts a ChaCha20 stream from a 256-bit seed
+ * Arguments: rng: struct otpRand*, the stream to initialize
+ * 	      seed: const unsigned char[32], the ChaCha20 key
+ * 	      stream: uint64_t, the stream number (ChaCha20 nonce); different numbers give
+ * 	      	      independent streams from the same seed
+ * Postcondition: rng produces the keystream from its first block
+ * **********************************************************************************************/
+void otpRandInit(struct otpRand* rng, const unsigned char seed[32], uint64_t stream)
+{
+	static const char constants[16] = "expand 32-byte k";
+	memcpy(rng->state, constants, 16);
+	memcpy(rng->state + 4, seed, 32);
+	rng->state[12] = 0;
+	rng->state[13] = 0;
+	rng->state[14] = (uint32_t)stream;
+	rng->state[15] = (uint32_t)(stream >> 32);
+	rng->used = sizeof(rng->block);
+}
+
+/***********************************************************************************************
+ * Function: otpRandSeed
+ * Description: This function draws a fresh 256-bit seed from the kernel with getrandom() and
+ * 		starts stream 0 from it
+ * Arguments: rng: struct otpRand*, the stream to initialize
+ * 	      seed: unsigned char[32], receives the seed so that more streams can be started
+ * Return: 0 on success, -1 with errno set if getrandom() fails
+ * **********************************************************************************************/
+int otpRandSeed(struct otpRand* rng, unsigned char seed[32])
+{
+	size_t got = 0;
+	ssize_t n;
+	while (got < 32)
+	{
+		n = getrandom(seed + got, 32 - got, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		got += n;
+	}
+	otpRandInit(rng, seed, 0);
+	return 0;
+}
+
+//fill buf with n bytes of keystream
+void otpRandBytes(struct otpRand* rng, unsigned char* buf, size_t n)
+{
+	size_t take;
+	while (n > 0)
+	{
+		if (rng->used == sizeof(rng->block))
+		{
+			chachaBlocks(rng->state, rng->block);
+			rng->used = 0;
+		}
+		take = sizeof(rng->block) - rng->used;
+		if (take > n)
+			take = n;
+		memcpy(buf, (unsigned char*)rng->block + rng->used, take);
+		rng->used += take;
+		buf += take;
+		n -= take;
+	}
+}
+
+/***********************************************************************************************
+ * Function: otpRandKey
+ * Description: This function generates n uniformly distributed key characters (A-Z, space)
+ * Arguments: rng: struct otpRand*, the stream to draw from
+ * 	      key: char*, receives n characters; it is not '\0' ended
+ * 	      n: size_t, the number of characters
+ * **********************************************************************************************/
+void otpRandKey(struct otpRand* rng, char* key, size_t n)
+{
+	const unsigned char* bytes = (const unsigned char*)rng->block;
+	size_t i;
+	char c;
+	while (n > 0)
+	{
+		if (rng->used == sizeof(rng->block))
+		{
+			chachaBlocks(rng->state, rng->block);
+			rng->used = 0;
+		}
+		if (n >= sizeof(rng->block) - rng->used)
+		{
+			//room for every remaining byte: store each one and only advance past accepted ones
+			for (i = rng->used; i < sizeof(rng->block); i++)
+			{
+				c = keyChar[bytes[i]];
+				*key = c;
+				key += c != 0;
+				n -= c != 0;
+			}
+		}
+		else
+		{
+			for (i = rng->used; i < sizeof(rng->block) && n > 0; i++)
+			{
+				c = keyChar[bytes[i]];
+				if (c)
+				{
+					*key++ = c;
+					n--;
+				}
+			}
+		}
+		rng->used = i;
+	}
+}
@@ -0,0 +1,27 @@
+/**************************************************************************************
+ * Description: Key material generator. A ChaCha20 stream seeded from getrandom() is
+ * 		mapped uniformly onto the 27 symbols A-Z and space.
+ *************************************************************************************/
+
+#ifndef OTP_RAND_H
+#define OTP_RAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_RAND_BLOCKS 16 //ChaCha20 blocks computed together
+
+//state of one ChaCha20 stream
+struct otpRand
+{
+	uint32_t state[16];
+	uint32_t block[16 * OTP_RAND_BLOCKS]; //the current keystream blocks
+	size_t used; //bytes of block already handed out
+};
+
+int otpRandSeed(struct otpRand* rng, unsigned char seed[32]);
+void otpRandInit(struct otpRand* rng, const unsigned char seed[32], uint64_t stream);
+void otpRandBytes(struct otpRand* rng, unsigned char* buf, size_t n);
+void otpRandKey(struct otpRand* rng, char* key, size_t n);
+
+#endif
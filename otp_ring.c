@@ -0,0 +1,151 @@
+/**************************************************************************************
+ * Description: io_uring through its system calls, see otp_ring.h.
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "otp_ring.h"
+
+#ifdef OTP_URING
+/****************************************************************************************************
+ * Function: otpRingSetup
+ * Description: This function creates an io_uring and maps its queues. It must run on the thread
+ * 		that will use the ring.
+ * Arguments: ring: struct otpRing*, the ring to set up
+ * 	      entries: unsigned, the size of its submission queue
+ * Return: 0 on success, -1 with errno set if the kernel has no io_uring or refuses one
+ * ****************************************************************************************************/
+int otpRingSetup(struct otpRing* ring, unsigned entries)
+{
+	//submit every entry even if one fails, and run completion work only in io_uring_enter of the
+	//thread that owns the ring; older kernels get fewer of these flags
+	static const unsigned flags[] = {
+		IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+		IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+		0,
+	};
+	struct io_uring_params params;
+	char *sq, *cq;
+	int i;
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	for (i = 0; i < 3 && ring->fd < 0; i++)
+	{
+		memset(&params, 0, sizeof(params));
+		params.flags = flags[i];
+		ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+		if (ring->fd < 0 && errno != EINVAL)
+			return -1;
+	}
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqSize > ring->sqSize)
+			ring->sqSize = ring->cqSize;
+		ring->cqSize = 0; //one mapping for both
+	}
+	ring->sq = ring->cq = ring->sqes = MAP_FAILED;
+	ring->sq = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq = ring->cqSize ? mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				       ring->fd, IORING_OFF_CQ_RING) : ring->sq;
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		int err = errno;
+		otpRingClose(ring);
+		errno = err;
+		return -1;
+	}
+	sq = ring->sq;
+	cq = ring->cq;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	ring->entries = params.sq_entries;
+	ring->tail = *ring->sqTail;
+	return 0;
+}
+
+//register length bytes at base as fixed buffer 0. Returns -1 with errno set if the kernel refuses
+//(RLIMIT_MEMLOCK)
+int otpRingRegister(struct otpRing* ring, void* base, size_t length)
+{
+	struct iovec iov = { base, length };
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0 ? -1 : 0;
+}
+
+//submit what is queued and, if wait, wait for at least one completion. Returns -1 with errno set on errors
+int otpRingEnter(struct otpRing* ring, int wait)
+{
+	int n;
+	__atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+	n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (n < 0)
+		return -1;
+	ring->queued -= n;
+	return 0;
+}
+
+//a cleared submission queue entry for fd whose completion carries data, or NULL if the queue is
+//full even after submitting it
+struct io_uring_sqe* otpRingGet(struct otpRing* ring, int fd, void* data)
+{
+	struct io_uring_sqe* sqe;
+	unsigned index;
+	if (ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->entries &&
+	    (otpRingEnter(ring, 0) < 0 || ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->entries))
+		return NULL;
+	index = ring->tail & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)data;
+	ring->sqArray[index] = index;
+	ring->tail++;
+	ring->queued++;
+	return sqe;
+}
+
+//the oldest completion not seen yet, or NULL
+struct io_uring_cqe* otpRingPeek(struct otpRing* ring)
+{
+	unsigned head = *ring->cqHead;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+//hand the completion otpRingPeek returned back to the kernel
+void otpRingSeen(struct otpRing* ring)
+{
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+//unmap the queues and close the ring; operations still in flight are cancelled
+void otpRingClose(struct otpRing* ring)
+{
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqSize && ring->cq != MAP_FAILED)
+		munmap(ring->cq, ring->cqSize);
+	if (ring->sq != MAP_FAILED)
+		munmap(ring->sq, ring->sqSize);
+	close(ring->fd);
+	ring->fd = -1;
+}
+#endif
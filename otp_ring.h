@@ -0,0 +1,53 @@
+/**************************************************************************************
+ * Description: A minimal io_uring driven through its system calls, so that no liburing
+ * 		is needed: setting a ring up, queueing submissions, reaping completions.
+ * 		It exists where <linux/io_uring.h> has multishot accept (OTP_URING is
+ * 		then defined); build with -DOTP_NO_URING to leave it out. The --uring
+ * 		server and the client engine use it, and fall back to epoll and poll.
+ *************************************************************************************/
+
+#ifndef OTP_RING_H
+#define OTP_RING_H
+
+#include <stddef.h>
+
+#if !defined(OTP_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(__NR_io_uring_setup)
+#define OTP_URING 1
+#endif
+#ifndef IORING_SETUP_DEFER_TASKRUN //older headers: kernels without these flags refuse them with EINVAL
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+#endif
+#endif
+
+#ifdef OTP_URING
+//an io_uring and its mapped queues; only the thread that set it up may use it
+struct otpRing
+{
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	unsigned entries;
+	unsigned tail; //our submission tail, published by otpRingEnter
+	unsigned queued; //entries filled and not submitted yet
+	void *sq, *cq; //the mappings, for otpRingClose
+	size_t sqSize, cqSize, sqesSize;
+};
+
+int otpRingSetup(struct otpRing* ring, unsigned entries);
+int otpRingRegister(struct otpRing* ring, void* base, size_t length);
+int otpRingEnter(struct otpRing* ring, int wait);
+struct io_uring_sqe* otpRingGet(struct otpRing* ring, int fd, void* data);
+struct io_uring_cqe* otpRingPeek(struct otpRing* ring);
+void otpRingSeen(struct otpRing* ring);
+void otpRingClose(struct otpRing* ring);
+#endif
+
+#endif
@@ -0,0 +1,1001 @@
+/**************************************************************************************
+ * Description: Server core shared by otp_enc_d, otp_dec_d and otp_d: command line
+ * 		handling, the listening sockets, admission control, the fork-per-connection
+ * 		server and the pre-forked worker pool. The event-driven server lives in
+ * 		otp_epoll.c.
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include "otp_io.h"
+#include "otp_server.h"
+
+static void error(const char* msg){ perror(msg); exit(1); } //Error function to report issues
+
+//parse the ASCII length field of the original protocol or the streaming mode, OTP_LENGTH_FIELD + 1
+//bytes, into 64 bits: up to 9999999999. Returns the length, or -1 if it is malformed
+long long otpStreamLength(char* field)
+{
+	char* end;
+	field[OTP_LENGTH_FIELD] = '\0';
+	errno = 0;
+	long long n = strtoll(field, &end, 10);
+	if (errno || end == field || *end != '\0' || n < 0)
+		return -1;
+	return n;
+}
+
+//every handshake a client can send, with the op and wire mode it asks for
+static const struct
+{
+	const char* handshake;
+	enum otpOp op;
+	enum otpWire wire;
+} handshakes[] = {
+	{ "enc", OTP_ENCODE, OTP_WIRE_V1 },
+	{ "dec", OTP_DECODE, OTP_WIRE_V1 },
+	{ OTP_STREAM_ENC, OTP_ENCODE, OTP_WIRE_STREAM },
+	{ OTP_STREAM_DEC, OTP_DECODE, OTP_WIRE_STREAM },
+	{ OTP_V2_ENC, OTP_ENCODE, OTP_WIRE_V2 },
+	{ OTP_V2_DEC, OTP_DECODE, OTP_WIRE_V2 },
+	{ OTP_V2_PACKED_ENC, OTP_ENCODE, OTP_WIRE_V2_PACKED },
+	{ OTP_V2_PACKED_DEC, OTP_DECODE, OTP_WIRE_V2_PACKED },
+};
+
+/****************************************************************************************************
+ * Function: otpMatchHandshake
+ * Description: This function decides how to serve a client from its handshake. A daemon accepts
+ * 		the handshake of every op it runs and answers it with the same string; v2 clients
+ * 		then choose the op of each request in its frame.
+ * Arguments: server: const struct otpServer*, the daemon
+ * 	      handshake: const char*, the OTP_HANDSHAKE_LENGTH bytes the client sent
+ * 	      op: enum otpOp*, set to the op the handshake asks for
+ * Return: the wire mode, or OTP_WIRE_REJECT if the daemon does not serve this handshake
+ * ****************************************************************************************************/
+enum otpWire otpMatchHandshake(const struct otpServer* server, const char* handshake, enum otpOp* op)
+{
+	size_t i;
+	for (i = 0; i < sizeof(handshakes) / sizeof(handshakes[0]); i++)
+	{
+		if (memcmp(handshake, handshakes[i].handshake, OTP_HANDSHAKE_LENGTH) == 0 &&
+		    (server->ops & OTP_OP_BIT(handshakes[i].op)))
+		{
+			*op = handshakes[i].op;
+			return handshakes[i].wire;
+		}
+	}
+	return OTP_WIRE_REJECT;
+}
+
+//map the op code of a v2 request frame to op. Returns 1 if the daemon runs it, 0 otherwise
+int otpFrameOp(const struct otpServer* server, int code, enum otpOp* op)
+{
+	if (code == OTP_V2_OP_ENCODE)
+		*op = OTP_ENCODE;
+	else if (code == OTP_V2_OP_DECODE)
+		*op = OTP_DECODE;
+	else
+		return 0;
+	return (server->ops & OTP_OP_BIT(*op)) != 0;
+}
+
+//read and drop n bytes of a request that is not served, a window at a time. Returns 0 or -1
+static int skipPayload(int fd, char* buffer, uint64_t n)
+{
+	size_t window;
+	while (n > 0)
+	{
+		window = n < OTP_STREAM_WINDOW ? (size_t)n : OTP_STREAM_WINDOW;
+		if (otpReadFromSocket(fd, buffer, window) < 0)
+			return -1;
+		n -= window;
+	}
+	return 0;
+}
+
+/****************************************************************************************************
+ * Function: otpTransformChecked
+ * Description: This function transforms a window of a request and checks it in the same pass. The
+ * 		first invalid character of the request is kept in check; later windows are still
+ * 		transformed so the reply keeps its length.
+ * Arguments: op: enum otpOp, the transform
+ * 	      text, key, out: the window's text, key and output, n characters each
+ * 	      position: uint64_t, where the window starts in the request
+ * 	      check: struct otpFrame*, its code (OTP_V2_OK until an invalid character is found,
+ * 	      	     then OTP_V2_BAD_TEXT or OTP_V2_BAD_KEY) and length (that character's position)
+ * Return: 1 if the window is valid, 0 if not
+ * ****************************************************************************************************/
+int otpTransformChecked(enum otpOp op, const char* text, const char* key, char* out, size_t n,
+			uint64_t position, struct otpFrame* check)
+{
+	size_t invalid = otpTransform(op, text, key, out, n);
+	if (invalid == n)
+		return 1;
+	if (check->code == OTP_V2_OK)
+	{
+		check->code = otpValidate(text + invalid, 1) == 0 ? OTP_V2_BAD_TEXT : OTP_V2_BAD_KEY;
+		check->length = position + invalid;
+	}
+	return 0;
+}
+
+//read a window of n characters into dest: as they are, or packed into stage and unpacked. Returns 0 or -1
+static int readWindow(int fd, char* dest, size_t n, unsigned char* stage)
+{
+	if (!stage)
+		return otpReadFromSocket(fd, dest, n);
+	if (otpReadFromSocket(fd, (char*)stage, OTP_PACKED_LENGTH(n)) < 0)
+		return -1;
+	otpUnpack(stage, dest, n);
+	return 0;
+}
+
+//read text and key windows for a message of remaining bytes and write each window transformed by op
+//back. With padKey the client sends only the text and the key is read from the pad. buffer holds
+//3 windows, and stage, for packed windows, OTP_PACKED_LENGTH(OTP_STREAM_WINDOW) bytes (NULL if the
+//windows are not packed). With check, invalid characters are noted there; without, they end the
+//transfer with EINVAL before their window is sent. The time of each step goes to its stage in
+//timer. Returns 0 or -1 with errno set
+static int transformWindows(enum otpOp op, int fd, char* buffer, uint64_t remaining, const char* padKey,
+			    struct otpFrame* check, unsigned char* stage, struct otpStageTimer* timer)
+{
+	size_t window;
+	uint64_t position = 0;
+	struct otpFrame unchecked = { 0, OTP_V2_OK, 0, 0 };
+	const char* key = buffer + OTP_STREAM_WINDOW;
+	char* out = buffer + 2 * OTP_STREAM_WINDOW;
+	while (remaining > 0)
+	{
+		window = remaining < OTP_STREAM_WINDOW ? (size_t)remaining : OTP_STREAM_WINDOW;
+		if (readWindow(fd, buffer, window, stage) < 0)
+			return -1;
+		otpStageMark(timer, OTP_STAGE_TEXT);
+		if (!padKey)
+		{
+			if (readWindow(fd, buffer + OTP_STREAM_WINDOW, window, stage) < 0)
+				return -1;
+			otpStageMark(timer, OTP_STAGE_KEY);
+		}
+		remaining -= window;
+		if (padKey)
+		{
+			key = padKey;
+			padKey += window;
+		}
+		if (!otpTransformChecked(op, buffer, key, out, window, position, check ? check : &unchecked) && !check)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		position += window;
+		if (stage)
+			otpPack(out, stage, window);
+		otpStageMark(timer, OTP_STAGE_TRANSFORM);
+		if (otpWriteToSocket(fd, stage ? (const char*)stage : out, stage ? OTP_PACKED_LENGTH(window) : window) < 0)
+			return -1;
+		otpStageMark(timer, OTP_STAGE_REPLY);
+	}
+	return 0;
+}
+
+/****************************************************************************************************
+ * Function: streamTransform
+ * Description: This function serves the streaming mode after its handshake: it reads the length
+ * 		field, then reads text and key a window at a time and writes each transformed window
+ * 		back, so the daemon holds three windows whatever the message size.
+ * Arguments: op: enum otpOp, the transform the client asked for
+ * 	      establishedConnectionFD: int, the connected socket
+ * 	      timer: struct otpStageTimer*, gets the time of each step
+ * 	      pool: struct otpPool*, where the windows come from
+ * Return: the message length on success, -1 with errno set on errors (EINVAL for invalid
+ * 	   characters), or with errno 0 if the length is malformed
+ * ****************************************************************************************************/
+static long long streamTransform(enum otpOp op, int establishedConnectionFD, struct otpStageTimer* timer,
+		struct otpPool* pool)
+{
+	char field[OTP_LENGTH_FIELD + 1];
+	long long length;
+	int status;
+	char* buffer;
+
+	if (otpReadFromSocket(establishedConnectionFD, field, OTP_LENGTH_FIELD) < 0)
+		return -1;
+	if ((length = otpStreamLength(field)) < 0) { errno = 0; return -1; }
+
+	//text window, key window and transformed window
+	if (!(buffer = otpPoolGet(pool, 3 * OTP_STREAM_WINDOW)))
+		return -1;
+	status = transformWindows(op, establishedConnectionFD, buffer, length, NULL, NULL, NULL, timer);
+	otpPoolPut(pool, buffer, 3 * OTP_STREAM_WINDOW);
+	return status < 0 ? -1 : length;
+}
+
+/****************************************************************************************************
+ * Function: serveV2
+ * Description: This function serves a protocol v2 connection after its handshake: it answers
+ * 		requests one after the other until the client closes the connection. Each request
+ * 		names its own op and is transformed a window at a time like in the streaming mode.
+ * 		A request with OTP_V2_FLAG_PAD gets its key from a pad of server->keys, and one with
+ * 		OTP_V2_FLAG_CHECK is followed by a check frame.
+ * Arguments: server: const struct otpServer*, the daemon
+ * 	      establishedConnectionFD: int, the connected socket
+ * 	      packed: int, 1 if the windows travel packed
+ * 	      peer: const struct otpPeer*, the client, for the trace
+ * Return: 0 when the client closes the connection between requests, -1 with errno set on errors
+ * ****************************************************************************************************/
+static int serveV2(const struct otpServer* server, int establishedConnectionFD, int packed, const struct otpPeer* peer)
+{
+	unsigned char header[OTP_FRAME_LENGTH], keyRef[OTP_KEYREF_LENGTH];
+	struct otpFrame frame, check;
+	struct otpKeyRef ref;
+	struct otpStageTimer timer;
+	const char* padKey;
+	enum otpOp op;
+	ssize_t charsRead;
+	int status = -1, code, inRequest = 0;
+	char* buffer;
+	unsigned char* stage;
+
+	//text, key and transformed windows, then the packed form of one of them
+	const size_t size = 3 * OTP_STREAM_WINDOW + OTP_PACKED_LENGTH(OTP_STREAM_WINDOW);
+	if (!(buffer = otpPoolGet(server->pool, size)))
+		return -1;
+	stage = packed ? (unsigned char*)buffer + 3 * OTP_STREAM_WINDOW : NULL;
+	while (1)
+	{
+		charsRead = recv(establishedConnectionFD, header, OTP_FRAME_LENGTH, MSG_WAITALL);
+		if (charsRead < 0 && errno == EINTR)
+			continue;
+		if (charsRead == 0) //the client is done
+			break;
+		if (charsRead != OTP_FRAME_LENGTH)
+		{
+			if (charsRead >= 0) errno = ECONNRESET;
+			goto done;
+		}
+		//a request's time starts with its frame; waiting for the frame is the client's idle time
+		otpStageStart(&timer);
+		inRequest = 1;
+		op = OTP_ENCODE;
+		otpUnpackFrame(header, &frame);
+		//requests for an op the daemon does not run are answered with an error and their payload is skipped
+		code = otpFrameOp(server, frame.code, &op) ? OTP_V2_OK : OTP_V2_BAD_OP;
+		padKey = NULL;
+		if (frame.flags & OTP_V2_FLAG_PAD)
+		{
+			if (otpReadFromSocket(establishedConnectionFD, (char*)keyRef, OTP_KEYREF_LENGTH) < 0)
+				goto done;
+			otpUnpackKeyRef(keyRef, &ref);
+			if (code == OTP_V2_OK)
+				padKey = otpKeyStoreClaim(server->keys, ref.pad, op, ref.offset, frame.length, &code);
+		}
+		frame.code = code;
+		otpPackFrame(header, &frame);
+		if (otpWriteToSocket(establishedConnectionFD, (const char*)header, OTP_FRAME_LENGTH) < 0)
+			goto done;
+		otpStageMark(&timer, OTP_STAGE_REPLY);
+		if (code != OTP_V2_OK)
+		{
+			otpStatsAdd(server->stats, refused, 1);
+			//the text, and the key unless it was to come from a pad
+			uint64_t length = packed ? OTP_PACKED_LENGTH(frame.length) : frame.length;
+			if (skipPayload(establishedConnectionFD, buffer, (frame.flags & OTP_V2_FLAG_PAD) ? length : 2 * length) < 0)
+				goto done;
+			otpTraceRequest(server->stats, &timer, peer, op, frame.length, OTP_OUTCOME_REFUSED);
+			inRequest = 0;
+			continue;
+		}
+		check.id = frame.id;
+		check.code = OTP_V2_OK;
+		check.flags = 0;
+		check.length = frame.length;
+		if (transformWindows(op, establishedConnectionFD, buffer, frame.length, padKey, &check, stage, &timer) < 0)
+			goto done;
+		if (frame.flags & OTP_V2_FLAG_CHECK)
+		{
+			otpPackFrame(header, &check);
+			if (otpWriteToSocket(establishedConnectionFD, (const char*)header, OTP_FRAME_LENGTH) < 0)
+				goto done;
+			otpStageMark(&timer, OTP_STAGE_REPLY);
+		}
+		if (check.code != OTP_V2_OK)
+			otpStatsAdd(server->stats, invalid, 1);
+		otpTraceRequest(server->stats, &timer, peer, op, frame.length,
+				check.code != OTP_V2_OK ? OTP_OUTCOME_INVALID : OTP_OUTCOME_OK);
+		inRequest = 0;
+		otpStatsRequest(server->stats, &timer, frame.length);
+		otpStatsAdd(server->stats, completed, 1);
+	}
+	status = 0;
+done:
+	if (inRequest)
+		otpTraceRequest(server->stats, &timer, peer, op, frame.length, OTP_OUTCOME_FAILED);
+	otpPoolPut(server->pool, buffer, size);
+	return status;
+}
+
+/****************************************************************************************************
+ * Function: otpCheckAndTransform
+ * Description: This server function makes sure that the connected client is one the daemon serves
+ * 		(otp_enc for otp_enc_d, otp_dec for otp_dec_d, both for otp_d) and encodes or decodes
+ * 		the message with the key both of which are sent by the client. A client asking for the
+ * 		streaming mode or protocol v2 gets it through streamTransform or serveV2.
+ * Arguments: server: const struct otpServer*, the daemon
+ * 	      establishedConnectionFD: int, the file descriptor of the connected socket
+ * Precondition: the socket is already connected
+ * Postcondition: If the client matches, then this function receives the text and key, then sends
+ * 		  the transformed text to client. The connection is closed in every case. The time
+ * 		  of each stage goes to server->stats, and each request to its trace rings.
+ * Return: 0 on success, 1 on errors (reported to stderr), 2 if the client does not match
+ * ****************************************************************************************************/
+int otpCheckAndTransform(const struct otpServer* server, int establishedConnectionFD)
+{
+	//get the verification message from client
+	int charsRead, charsWritten, status = 1;
+	char *text = NULL, *key = NULL;
+	size_t capacity = 0; //of text and key
+	const char* failure = NULL;
+	char buffer[64];
+	enum otpOp op = OTP_ENCODE;
+	enum otpWire wire = OTP_WIRE_REJECT;
+	enum otpOutcome outcome = OTP_OUTCOME_FAILED;
+	struct otpStageTimer timer;
+	struct otpPeer peer;
+	long long length = 0;
+	otpStageStart(&timer);
+	otpPeerOf(establishedConnectionFD, &peer);
+	memset(buffer, '\0', sizeof(buffer));
+	charsRead = recv(establishedConnectionFD, buffer, OTP_HANDSHAKE_LENGTH, MSG_WAITALL); //read the client's message from the socket
+	if (charsRead < 0) { failure = "ERROR reading from socket"; goto done; }
+
+	//send a verification message back to the client: its own handshake if the daemon serves it
+	wire = otpMatchHandshake(server, buffer, &op);
+	charsWritten = send(establishedConnectionFD, wire == OTP_WIRE_REJECT ? server->handshake : buffer,
+			OTP_HANDSHAKE_LENGTH, MSG_NOSIGNAL);
+	if (charsWritten < 0) { failure = "ERROR writing to socket"; goto done; }
+	otpStageMark(&timer, OTP_STAGE_HANDSHAKE);
+
+	switch (wire)
+	{
+		case OTP_WIRE_REJECT: //if the client does not match, then close this connection
+			status = 2;
+			goto done;
+		case OTP_WIRE_STREAM:
+			if ((length = streamTransform(op, establishedConnectionFD, &timer, server->pool)) < 0)
+			{
+				length = 0;
+				if (errno == EINVAL)
+				{
+					otpStatsAdd(server->stats, invalid, 1);
+					outcome = OTP_OUTCOME_INVALID;
+				}
+				if (errno) failure = "SERVER: ERROR streaming";
+				goto done;
+			}
+			status = 0;
+			outcome = OTP_OUTCOME_OK;
+			otpTraceRequest(server->stats, &timer, &peer, op, length, outcome);
+			otpStatsRequest(server->stats, &timer, length);
+			otpStatsAdd(server->stats, completed, 1);
+			goto done;
+		case OTP_WIRE_V2:
+		case OTP_WIRE_V2_PACKED:
+			otpStatsStages(server->stats, &timer); //the handshake; each request is timed on its own
+			if (serveV2(server, establishedConnectionFD, wire == OTP_WIRE_V2_PACKED, &peer) < 0)
+			{
+				failure = "SERVER: ERROR serving v2 request";
+				goto done;
+			}
+			status = 0;
+			goto done;
+		case OTP_WIRE_V1:
+			break;
+	}
+
+	//receive the length of the text
+	memset(buffer, '\0', sizeof(buffer));
+	if (otpReadFromSocket(establishedConnectionFD, buffer, OTP_LENGTH_FIELD) < 0) { failure = "ERROR reading from socket"; goto done; }
+	long long ntext = otpStreamLength(buffer);
+	if (ntext <= 0) goto done;
+	length = ntext - 1; //the field counts the text's '\0'
+	otpSizeSocketBuffers(establishedConnectionFD, 2 * (size_t)ntext);
+
+	//receive the text and the key into buffers of the worker's pool; the text is transformed in place
+	capacity = ntext;
+	text = otpPoolGet(server->pool, capacity);
+	key = otpPoolGet(server->pool, capacity);
+	if (!text || !key) { failure = "ERROR allocating memory in otp server"; goto done; }
+	if (otpReadFromSocket(establishedConnectionFD, text, ntext) < 0)
+	{
+		failure = "SERVER: ERROR reading from socket";
+		goto done;
+	}
+	otpStageMark(&timer, OTP_STAGE_TEXT);
+	if (otpReadFromSocket(establishedConnectionFD, key, ntext) < 0)
+	{
+		failure = "SERVER: ERROR reading from socket";
+		goto done;
+	}
+	otpStageMark(&timer, OTP_STAGE_KEY);
+
+	//transform the message; the original protocol has no error reply, so bad input closes the connection
+	length = strnlen(text, ntext); //the client sends the text with its '\0'
+	if (otpTransform(op, text, key, text, length) != (size_t)length)
+	{
+		fprintf(stderr, "SERVER: invalid characters in the message\n");
+		otpStatsAdd(server->stats, invalid, 1);
+		outcome = OTP_OUTCOME_INVALID;
+		goto done;
+	}
+	memset(text + length, '\0', ntext - length); //the reply ends in '\0' like the text
+	otpStageMark(&timer, OTP_STAGE_TRANSFORM);
+	//write the result to socket
+	if (otpWriteToSocket(establishedConnectionFD, text, ntext) < 0) { failure = "SERVER: ERROR writing to socket"; goto done; }
+	otpStageMark(&timer, OTP_STAGE_REPLY);
+	status = 0;
+	outcome = OTP_OUTCOME_OK;
+	otpTraceRequest(server->stats, &timer, &peer, op, length, outcome);
+	otpStatsRequest(server->stats, &timer, length);
+	otpStatsAdd(server->stats, completed, 1);
+
+done:
+	//a v1 or streaming request that was not answered; v2 requests are traced by serveV2
+	if ((wire == OTP_WIRE_V1 || wire == OTP_WIRE_STREAM) && outcome != OTP_OUTCOME_OK)
+		otpTraceRequest(server->stats, &timer, &peer, op, length, outcome);
+	if (failure)
+		perror(failure);
+	//close down
+	otpPoolPut(server->pool, text, capacity);
+	otpPoolPut(server->pool, key, capacity);
+	close(establishedConnectionFD); //close the existing socket which is connected to the client
+	return status;
+}
+
+/****************************************************************************************************
+ * Function: otpRejectConnection
+ * Description: This function turns a client away because the daemon is saturated: it answers the
+ * 		handshake with OTP_BUSY instead of echoing it and closes the connection.
+ * Arguments: server: const struct otpServer*, the daemon
+ * 	      establishedConnectionFD: int, the accepted connection
+ * Postcondition: the connection is closed and counted as rejected
+ * ****************************************************************************************************/
+void otpRejectConnection(const struct otpServer* server, int establishedConnectionFD)
+{
+	char handshake[OTP_HANDSHAKE_LENGTH];
+	//take the client's handshake if it is there, so that closing does not reset the connection
+	recv(establishedConnectionFD, handshake, sizeof(handshake), MSG_DONTWAIT);
+	send(establishedConnectionFD, OTP_BUSY, OTP_HANDSHAKE_LENGTH, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(establishedConnectionFD);
+	otpStatsAdd(server->stats, rejected, 1);
+}
+
+/****************************************************************************************************
+ * Function: otpListen
+ * Description: This function creates a TCP socket listening on port on any address
+ * Arguments: port: int, the port number
+ * 	      backlog: int, the length of the queue of pending connections
+ * 	      reusePort: int, 1 to set SO_REUSEPORT so that several processes can each bind their
+ * 	      		 own socket to port and the kernel spreads connections across them
+ * Return: the listening socket; the program exits on failure
+ * ****************************************************************************************************/
+int otpListen(int port, int backlog, int reusePort)
+{
+	int listenSocketFD, on = 1;
+	struct sockaddr_in serverAddress;
+
+	//set up address struct for this server process
+	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); //clear out the address struct
+	serverAddress.sin_family = AF_INET; // create a network-capable socket
+	serverAddress.sin_port = htons(port); // store the port number
+	serverAddress.sin_addr.s_addr = INADDR_ANY; // any address is allowed for connection to this process
+
+	//set up the socket
+	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); // create the socket
+	if (listenSocketFD < 0) error("ERROR opening socket");
+	if (reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		error("ERROR setting SO_REUSEPORT");
+	//accepted connections inherit it: v2 replies go out as a frame and then windows
+	setsockopt(listenSocketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	//Enable the socket to begin listening
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) //connect socket to port
+		error("ERROR on binding");
+	if (listen(listenSocketFD, backlog) < 0) //Flip the socket on - it can now receive up to backlog connections
+		error("ERROR on listen");
+	return listenSocketFD;
+}
+
+//open a non-blocking listening socket on each of the daemon's ports
+static void listenAll(struct otpServer* server, int reusePort)
+{
+	int i;
+	for (i = 0; i < server->nPorts; i++)
+	{
+		server->listenFDs[i] = otpListen(server->ports[i], server->backlog, reusePort);
+		if (fcntl(server->listenFDs[i], F_SETFL, fcntl(server->listenFDs[i], F_GETFL) | O_NONBLOCK) < 0)
+			error("ERROR making the listening socket non-blocking");
+	}
+}
+
+//connections accepted by the fork server that wait for a free child slot
+struct acceptQueue
+{
+	int* fds;
+	int64_t* since; //when each was accepted
+	int head, count, limit;
+};
+
+//fork off a child serving establishedConnectionFD, accepted at acceptedAt. Returns 0, or -1 if fork fails
+static int spawnChild(struct otpServer* server, int establishedConnectionFD, int64_t acceptedAt,
+		struct acceptQueue* queue, int signalFD, const sigset_t* blocked)
+{
+	int i;
+	int64_t forkedAt = otpStatsNow();
+	pid_t spawnPid = fork();
+	if (spawnPid == -1) return -1;
+	else if (spawnPid == 0) //child process
+	{
+		otpStatsObserve(server->stats, OTP_STAGE_FORK, otpStatsNow() - forkedAt);
+		//the child only needs its own connection
+		for (i = 0; i < server->nPorts; i++)
+			close(server->listenFDs[i]);
+		close(signalFD);
+		for (i = 0; i < queue->count; i++)
+			close(queue->fds[(queue->head + i) % queue->limit]);
+		sigprocmask(SIG_UNBLOCK, blocked, NULL);
+		exit(otpCheckAndTransform(server, establishedConnectionFD)); //establishedConnectionFD is closed in this call
+	}
+	//parent process
+	close(establishedConnectionFD);
+	otpStatsObserve(server->stats, OTP_STAGE_QUEUE, forkedAt - acceptedAt);
+	otpStatsAdd(server->stats, inFlight, 1);
+	return 0;
+}
+
+/****************************************************************************************************
+ * Function: otpServeForking
+ * Description: This function accepts connections forever and forks off a child process for each
+ * 		of them, with at most server->maxConns children at a time. When all slots are taken,
+ * 		up to server->queueLimit accepted connections wait for a child to finish, and any
+ * 		further connection is rejected right away. The parent sleeps in poll() on the
+ * 		listening sockets and a signalfd for SIGCHLD, so it never spins.
+ * Arguments: server: struct otpServer*, the daemon with its listening sockets
+ * Postcondition: never returns
+ * ****************************************************************************************************/
+void otpServeForking(struct otpServer* server)
+{
+	int i, establishedConnectionFD, nChildren = 0;
+	struct acceptQueue queue;
+	struct signalfd_siginfo info;
+	struct pollfd fds[OTP_MAX_PORTS + 1]; //the listening sockets, then the signalfd
+	int sig = server->nPorts;
+	pid_t childPid;
+
+	queue.head = queue.count = 0;
+	queue.limit = server->queueLimit > 0 ? server->queueLimit : 1;
+	queue.fds = calloc(queue.limit, sizeof(int));
+	queue.since = calloc(queue.limit, sizeof(int64_t));
+	if (!queue.fds || !queue.since) error("ERROR allocating memory in otp server");
+
+	//SIGCHLD is only delivered through the signalfd
+	sigset_t toBlock;
+	if (sigemptyset(&toBlock) == -1) error("Fail to set sigset_t toBlock");
+	if (sigaddset(&toBlock, SIGCHLD) == -1)
+		error("Fail to add SIGCHLD to sigset_t toBlock");
+	if (sigprocmask(SIG_BLOCK, &toBlock, NULL) != 0)
+		error("SIGCHLD is not blocked");
+	int signalFD = signalfd(-1, &toBlock, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFD < 0) error("ERROR on signalfd");
+
+	for (i = 0; i < server->nPorts; i++)
+	{
+		fds[i].fd = server->listenFDs[i];
+		fds[i].events = POLLIN;
+	}
+	fds[sig].fd = signalFD;
+	fds[sig].events = POLLIN;
+	while (1)
+	{
+		if (poll(fds, server->nPorts + 1, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			error("ERROR on poll");
+		}
+
+		//reap finished children and hand their slots to queued connections
+		if (fds[sig].revents & POLLIN)
+		{
+			while (read(signalFD, &info, sizeof(info)) > 0)
+				;
+			while ((childPid = waitpid(-1, NULL, WNOHANG)) > 0)
+			{
+				nChildren--;
+				otpStatsAdd(server->stats, inFlight, -1);
+			}
+			while (nChildren < server->maxConns && queue.count > 0)
+			{
+				establishedConnectionFD = queue.fds[queue.head];
+				int64_t acceptedAt = queue.since[queue.head];
+				queue.head = (queue.head + 1) % queue.limit;
+				queue.count--;
+				otpStatsAdd(server->stats, queued, -1);
+				if (spawnChild(server, establishedConnectionFD, acceptedAt, &queue, signalFD, &toBlock) < 0)
+				{
+					perror("Hull Breach!");
+					otpRejectConnection(server, establishedConnectionFD);
+				}
+				else
+					nChildren++;
+			}
+		}
+
+		//accept every pending connection: serve it, queue it or reject it
+		for (i = 0; i < server->nPorts; i++)
+		{
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			while ((establishedConnectionFD = accept(server->listenFDs[i], NULL, NULL)) >= 0)
+			{
+				otpStatsAdd(server->stats, accepted, 1);
+				if (nChildren < server->maxConns && queue.count == 0 &&
+				    spawnChild(server, establishedConnectionFD, otpStatsNow(), &queue, signalFD, &toBlock) == 0)
+					nChildren++;
+				else if (queue.count < server->queueLimit)
+				{
+					queue.fds[(queue.head + queue.count) % queue.limit] = establishedConnectionFD;
+					queue.since[(queue.head + queue.count) % queue.limit] = otpStatsNow();
+					queue.count++;
+					otpStatsAdd(server->stats, queued, 1);
+				}
+				else
+					otpRejectConnection(server, establishedConnectionFD);
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				perror("ERROR on accept"); //out of descriptors: retry on the next wakeup
+		}
+	}
+}
+
+//connections a serial worker's accept thread admitted, waiting for the worker
+struct serialQueue
+{
+	struct otpServer* server;
+	struct acceptQueue queue; //room for the connection being served and server->queueLimit more
+	int serving; //the worker is serving a connection
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+};
+
+//accept thread of a serial worker: queue every pending connection for the worker while it serves
+//one, and reject those past server->queueLimit
+static void* admitSerially(void* arg)
+{
+	struct serialQueue* serial = arg;
+	struct otpServer* server = serial->server;
+	struct acceptQueue* queue = &serial->queue;
+	struct pollfd fds[OTP_MAX_PORTS];
+	int i, establishedConnectionFD, admitted;
+	for (i = 0; i < server->nPorts; i++)
+	{
+		fds[i].fd = server->listenFDs[i];
+		fds[i].events = POLLIN;
+	}
+	while (1)
+	{
+		if (poll(fds, server->nPorts, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			error("ERROR on poll");
+		}
+		for (i = 0; i < server->nPorts; i++)
+		{
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			while ((establishedConnectionFD = accept4(server->listenFDs[i], NULL, NULL, SOCK_CLOEXEC)) >= 0)
+			{
+				otpStatsAdd(server->stats, accepted, 1);
+				pthread_mutex_lock(&serial->lock);
+				admitted = serial->serving + queue->count < 1 + server->queueLimit;
+				if (admitted)
+				{
+					queue->fds[(queue->head + queue->count) % queue->limit] = establishedConnectionFD;
+					queue->since[(queue->head + queue->count) % queue->limit] = otpStatsNow();
+					queue->count++;
+					pthread_cond_signal(&serial->ready);
+				}
+				pthread_mutex_unlock(&serial->lock);
+				if (admitted)
+					otpStatsAdd(server->stats, queued, 1);
+				else
+					otpRejectConnection(server, establishedConnectionFD);
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				perror("ERROR on accept"); //out of descriptors: retry on the next wakeup
+		}
+	}
+	return NULL;
+}
+
+/****************************************************************************************************
+ * Function: serveSerially
+ * Description: This function serves connections forever, one at a time, in this process. It is
+ * 		the loop of a worker without --epoll or --uring. A thread accepts the connections
+ * 		meanwhile: up to server->queueLimit of them wait while one is served, and any
+ * 		further connection is rejected right away, as with the fork server. Serving one
+ * 		connection at a time, the worker has no use for server->maxConns.
+ * Arguments: server: struct otpServer*, the daemon with its listening sockets
+ * Postcondition: never returns
+ * ****************************************************************************************************/
+static void serveSerially(struct otpServer* server)
+{
+	struct serialQueue serial;
+	struct acceptQueue* queue = &serial.queue;
+	sigset_t all, old;
+	pthread_t id;
+	int establishedConnectionFD;
+	int64_t acceptedAt;
+
+	serial.server = server;
+	serial.serving = 0;
+	queue->head = queue->count = 0;
+	queue->limit = server->queueLimit + 1;
+	queue->fds = calloc(queue->limit, sizeof(int));
+	queue->since = calloc(queue->limit, sizeof(int64_t));
+	if (!queue->fds || !queue->since) error("ERROR allocating memory in otp server");
+	pthread_mutex_init(&serial.lock, NULL);
+	pthread_cond_init(&serial.ready, NULL);
+	//the accept thread takes no signals, which stay with this one
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if ((errno = pthread_create(&id, NULL, admitSerially, &serial)) != 0)
+		error("ERROR creating the accept thread");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	while (1)
+	{
+		pthread_mutex_lock(&serial.lock);
+		serial.serving = 0;
+		while (queue->count == 0)
+			pthread_cond_wait(&serial.ready, &serial.lock);
+		establishedConnectionFD = queue->fds[queue->head];
+		acceptedAt = queue->since[queue->head];
+		queue->head = (queue->head + 1) % queue->limit;
+		queue->count--;
+		serial.serving = 1;
+		pthread_mutex_unlock(&serial.lock);
+
+		otpStatsAdd(server->stats, queued, -1);
+		otpStatsObserve(server->stats, OTP_STAGE_QUEUE, otpStatsNow() - acceptedAt);
+		otpStatsAdd(server->stats, inFlight, 1);
+		otpCheckAndTransform(server, establishedConnectionFD); //establishedConnectionFD is closed in this call
+		otpStatsAdd(server->stats, inFlight, -1);
+	}
+}
+
+//start worker number index: pin it if asked, bind its own listener and serve until killed
+static pid_t spawnWorker(struct otpServer* server, int index)
+{
+	pid_t spawnPid = fork();
+	if (spawnPid != 0)
+		return spawnPid;
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM); //do not outlive the supervising parent
+	if (server->pin)
+	{
+		cpu_set_t cpus;
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		CPU_ZERO(&cpus);
+		CPU_SET(index % (ncpus > 0 ? ncpus : 1), &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			perror("ERROR pinning worker");
+	}
+	signal(SIGPIPE, SIG_IGN); //a client closing early must not kill the worker
+	listenAll(server, 1);
+	if (server->mode == OTP_SERVE_EPOLL)
+		otpServeEpoll(server);
+	else if (server->mode == OTP_SERVE_URING)
+		otpServeUring(server);
+	else
+		serveSerially(server);
+	exit(1);
+}
+
+/****************************************************************************************************
+ * Function: otpServeWorkers
+ * Description: This function forks server->workers long-lived workers, each with its own
+ * 		SO_REUSEPORT listener on every port, so that no process is created on the request path. The parent
+ * 		only supervises: a worker killed by a signal is replaced, while a worker that exits
+ * 		(it could not set up its listener) stops the daemon.
+ * Arguments: server: struct otpServer*, the daemon
+ * Postcondition: returns only after a worker failed; the remaining workers are killed
+ * ****************************************************************************************************/
+void otpServeWorkers(struct otpServer* server)
+{
+	int i, status;
+	pid_t childPid;
+	pid_t* workers = calloc(server->workers, sizeof(pid_t));
+	if (!workers) error("ERROR allocating memory in otp server");
+
+	for (i = 0; i < server->workers; i++)
+		if ((workers[i] = spawnWorker(server, i)) < 0) error("Hull Breach!");
+
+	while (1)
+	{
+		childPid = waitpid(-1, &status, 0);
+		if (childPid < 0)
+		{
+			if (errno == EINTR) continue;
+			error("ERROR waiting for workers");
+		}
+		for (i = 0; i < server->workers && workers[i] != childPid; i++)
+			;
+		if (i == server->workers)
+			continue;
+		if (!WIFSIGNALED(status))
+			break;
+		fprintf(stderr, "%s: worker %d killed by signal %d, restarting it\n", server->name, i, WTERMSIG(status));
+		if ((workers[i] = spawnWorker(server, i)) < 0) error("Hull Breach!");
+	}
+
+	fprintf(stderr, "%s: worker %d failed, stopping\n", server->name, i);
+	workers[i] = 0;
+	for (i = 0; i < server->workers; i++)
+		if (workers[i] > 0) kill(workers[i], SIGTERM);
+	free(workers);
+}
+
+//print how to run the daemon and exit
+static void usage(const char* name)
+{
+	fprintf(stderr, "USAGE: %s [--epoll | --uring [--threads N]] [--workers N [--pin]]\n"
+			"\t[--max-conns N] [--queue N] [--backlog N] [--stats-port P] [--trace-file F] [--huge-pages]\n"
+			"\t[--pad file]... port [port...]\n", name);
+	exit(1);
+}
+
+/****************************************************************************************************
+ * Function: otpServerMain
+ * Description: This function is the main() of otp_enc_d, otp_dec_d and otp_d. It parses the command
+ * 		line, opens the listening sockets and runs the chosen server. Every port serves every
+ * 		op in ops; one set of processes, threads, limits and counters covers all of them.
+ * Arguments: argc, argv: the daemon's command line
+ * 	      ops: unsigned, OTP_OP_BIT of each op to run: OTP_ENCODE for otp_enc_d, OTP_DECODE for
+ * 	      	   otp_dec_d, both for otp_d
+ * Return: never returns on success; exits with 1 on bad usage or errors
+ * ****************************************************************************************************/
+int otpServerMain(int argc, char* argv[], unsigned ops)
+{
+	static const struct option options[] = {
+		{ "epoll", no_argument, NULL, 'e' },
+		{ "uring", no_argument, NULL, 'u' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "pin", no_argument, NULL, 'p' },
+		{ "max-conns", required_argument, NULL, 'm' },
+		{ "queue", required_argument, NULL, 'q' },
+		{ "backlog", required_argument, NULL, 'b' },
+		{ "stats-port", required_argument, NULL, 's' },
+		{ "trace-file", required_argument, NULL, 'f' },
+		{ "huge-pages", no_argument, NULL, 'H' },
+		{ "pad", required_argument, NULL, 'k' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct otpServer server;
+	int i, opt, threadsGiven = 0;
+	char traceFile[64];
+	static struct otpPool pool; //each process of the daemon gets its own copy when it forks
+
+	memset(&server, 0, sizeof(server));
+	server.name = argv[0];
+	server.ops = ops;
+	//a single-op daemon tells the clients of the other one who it is
+	server.handshake = ops == OTP_OP_BIT(OTP_ENCODE) ? "enc" : ops == OTP_OP_BIT(OTP_DECODE) ? "dec" : "otp";
+	server.mode = OTP_SERVE_FORK;
+	server.maxConns = 0; //chosen per mode below
+	server.queueLimit = 64;
+	server.backlog = SOMAXCONN;
+	snprintf(traceFile, sizeof(traceFile), "/tmp/otp_trace.%d", (int)getpid());
+	server.traceFile = traceFile;
+	server.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (server.threads < 1)
+		server.threads = 1;
+
+	//check the command line usage and arguments
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'e': server.mode = OTP_SERVE_EPOLL;
+				  break;
+			case 'u': server.mode = OTP_SERVE_URING;
+				  break;
+			case 't': server.threads = atoi(optarg);
+				  if (server.threads < 1) usage(argv[0]);
+				  threadsGiven = 1;
+				  break;
+			case 'w': server.workers = atoi(optarg);
+				  if (server.workers < 1) usage(argv[0]);
+				  break;
+			case 'p': server.pin = 1;
+				  break;
+			case 'm': server.maxConns = atoi(optarg);
+				  if (server.maxConns < 1) usage(argv[0]);
+				  break;
+			case 'q': server.queueLimit = atoi(optarg);
+				  if (server.queueLimit < 0) usage(argv[0]);
+				  break;
+			case 'b': server.backlog = atoi(optarg);
+				  if (server.backlog < 1) usage(argv[0]);
+				  break;
+			case 's': server.statsPort = atoi(optarg);
+				  break;
+			case 'f': server.traceFile = optarg;
+				  break;
+			case 'H': server.hugePages = 1;
+				  break;
+			case 'k': if (!server.keys && !(server.keys = calloc(1, sizeof(struct otpKeyStore))))
+					  error("ERROR allocating memory in otp server");
+				  if (otpKeyStoreAdd(server.keys, optarg) < 0)
+				  {
+					  fprintf(stderr, "%s: cannot load pad \"%s\": %s\n", argv[0], optarg, strerror(errno));
+					  exit(1);
+				  }
+				  break;
+			default: usage(argv[0]);
+		}
+	}
+	server.nPorts = argc - optind;
+	if (server.nPorts < 1 || server.nPorts > OTP_MAX_PORTS) usage(argv[0]);
+	for (i = 0; i < server.nPorts; i++)
+		server.ports[i] = atoi(argv[optind + i]); //get the port number, convert to an integer from a string
+	if (server.maxConns == 0)
+		server.maxConns = server.mode != OTP_SERVE_FORK ? 4096 : 5;
+
+	//counters and trace rings shared by every process of the daemon, served on the stats port if
+	//asked; SIGUSR1 writes the trace to server.traceFile
+	server.stats = otpStatsCreate();
+	server.stats->maxConns = server.maxConns;
+	server.stats->queueLimit = server.queueLimit;
+	otpTraceStart(server.stats, server.traceFile);
+	otpPoolInit(&pool, OTP_POOL_LIMIT, server.hugePages);
+	server.pool = &pool;
+	if (server.statsPort > 0)
+		otpStatsStart(server.stats, server.statsPort);
+
+	if (server.workers > 0)
+	{
+		//each worker is its own process: one epoll thread apiece unless told otherwise
+		if (!threadsGiven)
+			server.threads = 1;
+		otpServeWorkers(&server);
+		return 1;
+	}
+	listenAll(&server, 0);
+	if (server.mode == OTP_SERVE_EPOLL)
+		otpServeEpoll(&server);
+	else if (server.mode == OTP_SERVE_URING)
+		otpServeUring(&server);
+	else
+		otpServeForking(&server);
+
+	for (i = 0; i < server.nPorts; i++)
+		close(server.listenFDs[i]); //close the listening sockets
+	return 0;
+}
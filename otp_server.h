@@ -0,0 +1,74 @@
+/**************************************************************************************
+ * Description: Server core shared by otp_enc_d, otp_dec_d and otp_d. The daemons differ
+ * 		only in the ops they run (encode, decode or both), so all of them hand
+ * 		their command line to otpServerMain.
+ *************************************************************************************/
+
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include "otp_codec.h"
+#include "otp_protocol.h"
+#include "otp_stats.h"
+#include "otp_keystore.h"
+#include "otp_pool.h"
+
+#define OTP_MAX_PORTS 8 //ports one daemon listens on
+#define OTP_OP_BIT(op) (1u << (op)) //an op in struct otpServer's ops
+
+//how a connection talks, decided by its handshake
+enum otpWire
+{
+	OTP_WIRE_REJECT, //unknown handshake, or an op this daemon does not run
+	OTP_WIRE_V1, //"enc"/"dec": length field, text, key
+	OTP_WIRE_STREAM, //"ens"/"des": length field, then windows
+	OTP_WIRE_V2, //"en2"/"de2": framed requests until the client closes
+	OTP_WIRE_V2_PACKED, //"enp"/"dep": v2 with packed windows
+};
+
+//how the daemon serves connections
+enum otpServeMode
+{
+	OTP_SERVE_FORK, //fork a child per connection (default)
+	OTP_SERVE_EPOLL, //non-blocking connections on a fixed set of epoll threads
+	OTP_SERVE_URING, //the epoll threads' state machine with its I/O on an io_uring per thread
+};
+
+struct otpServer
+{
+	const char* name; //program name, used in messages
+	unsigned ops; //OTP_OP_BIT of each op this daemon runs
+	const char* handshake; //reply to a handshake the daemon rejects
+	enum otpServeMode mode;
+	int nPorts;
+	int ports[OTP_MAX_PORTS];
+	int threads; //epoll or io_uring threads
+	int workers; //pre-forked worker processes, 0 for none
+	int pin; //pin worker i to CPU i
+	int maxConns; //connections served at once (per worker with --workers)
+	int queueLimit; //accepted connections waiting for a slot before new ones are rejected
+	int backlog; //listen() backlog
+	int statsPort; //0 for no stats listener
+	const char* traceFile; //where SIGUSR1 writes the trace rings
+	struct otpStats* stats;
+	struct otpPool* pool; //request buffers of the serving process (epoll threads have their own); NULL: not kept
+	int hugePages; //back large request buffers with huge pages
+	struct otpKeyStore* keys; //pads loaded with --pad, in order: pad id 0, 1, ...; NULL for none
+	int listenFDs[OTP_MAX_PORTS]; //one listening socket per port
+};
+
+int otpServerMain(int argc, char* argv[], unsigned ops);
+int otpListen(int port, int backlog, int reusePort);
+enum otpWire otpMatchHandshake(const struct otpServer* server, const char* handshake, enum otpOp* op);
+int otpFrameOp(const struct otpServer* server, int code, enum otpOp* op);
+long long otpStreamLength(char* field);
+int otpTransformChecked(enum otpOp op, const char* text, const char* key, char* out, size_t n,
+			uint64_t position, struct otpFrame* check);
+int otpCheckAndTransform(const struct otpServer* server, int establishedConnectionFD);
+void otpRejectConnection(const struct otpServer* server, int establishedConnectionFD);
+void otpServeForking(struct otpServer* server);
+void otpServeEpoll(struct otpServer* server);
+void otpServeUring(struct otpServer* server);
+void otpServeWorkers(struct otpServer* server);
+
+#endif
@@ -0,0 +1,447 @@
+/**************************************************************************************
+ * Description: Daemon counters in a shared anonymous mapping, and a thread answering
+ * 		every connection to the stats port with a snapshot of them. Stage times are
+ * 		added to their histograms with atomic increments, like the counters, so the
+ * 		threads and processes of a daemon all feed the same ones. The trace rings
+ * 		live in the same mapping: a writer claims a record with one atomic increment
+ * 		and fills it in place, so keeping them costs a few stores per request.
+ *************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "otp_io.h"
+#include "otp_server.h"
+#include "otp_stats.h"
+
+static void error(const char* msg){ perror(msg); exit(1); } //Error function to report issues
+
+#define TRACE_WAIT_MS 100 //how long a stats client has to ask for the trace before it gets the counters
+
+//this thread's id, which picks its trace ring; 0 until its first record, and again in a forked child
+static __thread int traceTid;
+static void forgetTraceTid(void) { traceTid = 0; }
+
+struct statsListener
+{
+	struct otpStats* stats;
+	int listenFD;
+};
+
+struct traceSignal
+{
+	struct otpStats* stats;
+	char* path;
+};
+
+//create zeroed counters shared with every process forked afterwards
+struct otpStats* otpStatsCreate(void)
+{
+	struct otpStats* stats = mmap(NULL, sizeof(struct otpStats), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) error("ERROR mapping the stats region");
+	pthread_atfork(NULL, NULL, forgetTraceTid); //a forked child writes under its own id
+	return stats;
+}
+
+//names of the stages in the otp_stage_seconds histogram
+static const char* stageNames[OTP_STAGES] = { "queue", "fork", "handshake", "text", "key", "transform", "reply", "request" };
+
+//current time of the monotonic clock in ns
+int64_t otpStatsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//add ns spent in stage to its histogram
+void otpStatsObserve(struct otpStats* stats, enum otpStage stage, int64_t ns)
+{
+	int bucket = 0;
+	if (ns < 0)
+		ns = 0;
+	//the first bound 1000 * 2^bucket that is not below ns
+	if (ns > 1000)
+		bucket = 64 - __builtin_clzll((uint64_t)(ns - 1) / 1000);
+	if (bucket > OTP_STATS_BUCKETS)
+		bucket = OTP_STATS_BUCKETS;
+	otpStatsAdd(stats, stages[stage].buckets[bucket], 1);
+	otpStatsAdd(stats, stages[stage].sumNs, ns);
+}
+
+//start timing a request: no stage marked, the clock at now
+void otpStageStart(struct otpStageTimer* timer)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->begin = timer->last = otpStatsNow();
+}
+
+//charge the time since the previous mark (or the start) to stage
+void otpStageMark(struct otpStageTimer* timer, enum otpStage stage)
+{
+	int64_t t = otpStatsNow();
+	timer->ns[stage] += t - timer->last;
+	timer->seen |= 1u << stage;
+	timer->last = t;
+}
+
+//add every stage the timer marked to the histograms, and start it over
+void otpStatsStages(struct otpStats* stats, struct otpStageTimer* timer)
+{
+	int stage;
+	for (stage = 0; stage < OTP_STAGES; stage++)
+		if (timer->seen & (1u << stage))
+			otpStatsObserve(stats, stage, timer->ns[stage]);
+	otpStageStart(timer);
+}
+
+//account for an answered request of length characters: its stages, its whole time and its bytes
+void otpStatsRequest(struct otpStats* stats, struct otpStageTimer* timer, uint64_t length)
+{
+	otpStatsObserve(stats, OTP_STAGE_REQUEST, timer->last - timer->begin);
+	otpStatsAdd(stats, bytes, (long)length);
+	otpStatsStages(stats, timer);
+}
+
+//fill peer in from addr; other families than IPv4 and IPv6 leave it unknown
+void otpPeerSet(struct otpPeer* peer, const struct sockaddr* addr)
+{
+	memset(peer, 0, sizeof(*peer));
+	if (addr->sa_family == AF_INET)
+	{
+		const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+		peer->port = ntohs(in->sin_port);
+		memcpy(peer->addr, &in->sin_addr, 4);
+	}
+	else if (addr->sa_family == AF_INET6)
+	{
+		const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+		peer->port = ntohs(in6->sin6_port);
+		memcpy(peer->addr, &in6->sin6_addr, 16);
+	}
+	else
+		return;
+	peer->family = addr->sa_family;
+}
+
+//the peer of the connected socket fd, unknown if getpeername fails
+void otpPeerOf(int fd, struct otpPeer* peer)
+{
+	struct sockaddr_storage addr;
+	socklen_t length = sizeof(addr);
+	memset(peer, 0, sizeof(*peer));
+	if (getpeername(fd, (struct sockaddr*)&addr, &length) == 0)
+		otpPeerSet(peer, (struct sockaddr*)&addr);
+}
+
+/****************************************************************************************************
+ * Function: otpTraceRequest
+ * Description: This function keeps a request in the trace ring of the calling thread, over the
+ * 		oldest record there. It takes no lock: the record is claimed with an atomic increment,
+ * 		and its sequence number is cleared while it is filled in, so otpTraceDump skips it
+ * 		until it is whole.
+ * Arguments: stats: struct otpStats*, the daemon's counters and trace rings
+ * 	      timer: const struct otpStageTimer*, the request's stages; call this before
+ * 	      	     otpStatsRequest or otpStatsStages start the timer over
+ * 	      peer: const struct otpPeer*, the client
+ * 	      op: enum otpOp, what the request asked for
+ * 	      length: uint64_t, characters of text the request announced
+ * 	      outcome: enum otpOutcome, how it ended
+ * ****************************************************************************************************/
+void otpTraceRequest(struct otpStats* stats, const struct otpStageTimer* timer, const struct otpPeer* peer,
+		enum otpOp op, uint64_t length, enum otpOutcome outcome)
+{
+	struct otpTraceRing* ring;
+	struct otpTraceRecord* record;
+	uint64_t n;
+	int stage;
+	if (!traceTid)
+		traceTid = syscall(SYS_gettid);
+	ring = &stats->trace[traceTid % OTP_TRACE_RINGS];
+	n = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+	record = &ring->records[n % OTP_TRACE_RECORDS];
+	__atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	record->begin = timer->begin;
+	for (stage = 0; stage < OTP_STAGES; stage++)
+		record->ns[stage] = timer->seen & (1u << stage) ? timer->ns[stage] : 0;
+	record->ns[OTP_STAGE_REQUEST] = otpStatsNow() - timer->begin; //up to now, for requests that failed
+	record->length = length;
+	record->tid = traceTid;
+	record->op = op;
+	record->outcome = outcome;
+	record->peer = *peer;
+	__atomic_store_n(&record->sequence, n + 1, __ATOMIC_RELEASE);
+}
+
+//order trace records by their start
+static int compareRecords(const void* a, const void* b)
+{
+	int64_t x = ((const struct otpTraceRecord*)a)->begin, y = ((const struct otpTraceRecord*)b)->begin;
+	return x < y ? -1 : x > y;
+}
+
+/****************************************************************************************************
+ * Function: otpTraceDump
+ * Description: This function writes the requests of every trace ring to fd, oldest first, one line
+ * 		each: wall clock time of the start, thread or process, peer, op, outcome, length,
+ * 		then the microseconds of the whole request and of its handshake, text, key,
+ * 		transform and reply stages. The writers are not stopped; a record that is being
+ * 		written over while it is copied is left out.
+ * Arguments: stats: struct otpStats*, the daemon's trace rings
+ * 	      fd: int, a file or socket open for writing; it stays open
+ * Return: the number of requests written, -1 with errno set on errors
+ * ****************************************************************************************************/
+int otpTraceDump(struct otpStats* stats, int fd)
+{
+	static const char* outcomes[] = { "ok", "refused", "invalid", "failed" };
+	struct otpTraceRecord *records, *record;
+	struct timespec real;
+	int64_t offset;
+	uint64_t sequence;
+	char peer[INET6_ADDRSTRLEN];
+	int i, j, n = 0, dupFD;
+	FILE* out;
+
+	records = malloc(sizeof(struct otpTraceRecord) * OTP_TRACE_RINGS * OTP_TRACE_RECORDS);
+	if (!records) return -1;
+	for (i = 0; i < OTP_TRACE_RINGS; i++)
+		for (j = 0; j < OTP_TRACE_RECORDS; j++)
+		{
+			record = &stats->trace[i].records[j];
+			if (!(sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE)))
+				continue;
+			records[n] = *record;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) == sequence)
+				n++;
+		}
+	qsort(records, n, sizeof(struct otpTraceRecord), compareRecords);
+
+	if ((dupFD = dup(fd)) < 0 || !(out = fdopen(dupFD, "w")))
+	{
+		if (dupFD >= 0) close(dupFD);
+		free(records);
+		return -1;
+	}
+	//the records hold monotonic times; print them on the wall clock
+	clock_gettime(CLOCK_REALTIME, &real);
+	offset = (int64_t)real.tv_sec * 1000000000 + real.tv_nsec - otpStatsNow();
+	fprintf(out, "# time tid peer op outcome length request_us handshake_us text_us key_us transform_us reply_us\n");
+	for (i = 0; i < n; i++)
+	{
+		record = &records[i];
+		fprintf(out, "%.6f %d ", (record->begin + offset) / 1e9, record->tid);
+		if (record->peer.family && inet_ntop(record->peer.family, record->peer.addr, peer, sizeof(peer)))
+			fprintf(out, record->peer.family == AF_INET6 ? "[%s]:%u" : "%s:%u", peer, record->peer.port);
+		else
+			fputc('-', out);
+		fprintf(out, " %s %s %llu", record->op == OTP_DECODE ? "dec" : "enc", outcomes[record->outcome & 3],
+			(unsigned long long)record->length);
+		fprintf(out, " %.1f %.1f %.1f %.1f %.1f %.1f\n", record->ns[OTP_STAGE_REQUEST] / 1e3,
+			record->ns[OTP_STAGE_HANDSHAKE] / 1e3, record->ns[OTP_STAGE_TEXT] / 1e3, record->ns[OTP_STAGE_KEY] / 1e3,
+			record->ns[OTP_STAGE_TRANSFORM] / 1e3, record->ns[OTP_STAGE_REPLY] / 1e3);
+	}
+	free(records);
+	if (fclose(out) != 0)
+		return -1;
+	return n;
+}
+
+//write the stage histograms to buf in Prometheus text format, cumulative per bound; returns the length
+static int formatStages(struct otpStats* stats, char* buf, size_t size)
+{
+	int stage, bucket, n;
+	long count;
+	size_t length = snprintf(buf, size, "# TYPE otp_stage_seconds histogram\n");
+	for (stage = 0; stage < OTP_STAGES && length < size; stage++)
+	{
+		count = 0;
+		for (bucket = 0; bucket <= OTP_STATS_BUCKETS && length < size; bucket++)
+		{
+			count += otpStatsGet(stats, stages[stage].buckets[bucket]);
+			if (bucket < OTP_STATS_BUCKETS)
+				n = snprintf(buf + length, size - length, "otp_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %ld\n",
+					     stageNames[stage], (1L << bucket) / 1e6, count);
+			else
+				n = snprintf(buf + length, size - length, "otp_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %ld\n",
+					     stageNames[stage], count);
+			length += n;
+		}
+		if (length < size)
+			length += snprintf(buf + length, size - length,
+					   "otp_stage_seconds_sum{stage=\"%s\"} %.9f\notp_stage_seconds_count{stage=\"%s\"} %ld\n",
+					   stageNames[stage], otpStatsGet(stats, stages[stage].sumNs) / 1e9, stageNames[stage], count);
+	}
+	return length < size ? (int)length : (int)size - 1;
+}
+
+//write a snapshot of the counters to buf in Prometheus text format; returns its length
+static int formatStats(struct otpStats* stats, char* buf, size_t size)
+{
+	int n = snprintf(buf, size,
+			"# TYPE otp_connections_accepted_total counter\n"
+			"otp_connections_accepted_total %ld\n"
+			"# TYPE otp_connections_rejected_total counter\n"
+			"otp_connections_rejected_total %ld\n"
+			"# TYPE otp_connections_in_flight gauge\n"
+			"otp_connections_in_flight %ld\n"
+			"# TYPE otp_connections_queued gauge\n"
+			"otp_connections_queued %ld\n"
+			"# TYPE otp_requests_completed_total counter\n"
+			"otp_requests_completed_total %ld\n"
+			"# TYPE otp_request_bytes_total counter\n"
+			"otp_request_bytes_total %ld\n"
+			"# TYPE otp_requests_refused_total counter\n"
+			"otp_requests_refused_total %ld\n"
+			"# TYPE otp_requests_invalid_total counter\n"
+			"otp_requests_invalid_total %ld\n"
+			"# TYPE otp_connections_max gauge\n"
+			"otp_connections_max %ld\n"
+			"# TYPE otp_queue_max gauge\n"
+			"otp_queue_max %ld\n",
+			otpStatsGet(stats, accepted), otpStatsGet(stats, rejected),
+			otpStatsGet(stats, inFlight), otpStatsGet(stats, queued),
+			otpStatsGet(stats, completed), otpStatsGet(stats, bytes),
+			otpStatsGet(stats, refused), otpStatsGet(stats, invalid),
+			otpStatsGet(stats, maxConns), otpStatsGet(stats, queueLimit));
+	if (n < 0 || (size_t)n >= size)
+		return n < 0 ? 0 : (int)size - 1;
+	return n + formatStages(stats, buf + n, size - n);
+}
+
+//thread answering each connection to the stats port with one snapshot, or with the trace rings if
+//the client asks for "trace" first
+static void* serveStats(void* arg)
+{
+	struct statsListener* listener = arg;
+	char buf[32768], request[64];
+	struct pollfd pfd;
+	int fd, n;
+	while (1)
+	{
+		fd = accept(listener->listenFD, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			error("ERROR on accept of stats port");
+		}
+		memset(request, '\0', sizeof(request));
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, TRACE_WAIT_MS) > 0)
+			recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+		if (strstr(request, "trace"))
+			otpTraceDump(listener->stats, fd);
+		else
+		{
+			n = formatStats(listener->stats, buf, sizeof(buf));
+			otpWriteToSocket(fd, buf, n); //a reader that went away is not our problem
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+//thread writing the trace rings to a file at every SIGUSR1, which every other thread blocks. The
+//dump goes to a new file next to the path and is renamed onto it, so a file or symlink someone
+//else put at the path (the default one is in /tmp) is replaced, never written through
+static void* traceOnSignal(void* arg)
+{
+	struct traceSignal* trace = arg;
+	sigset_t usr1;
+	int sig, fd, n = -1;
+	char temp[PATH_MAX];
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	while (1)
+	{
+		if (sigwait(&usr1, &sig) != 0)
+			continue;
+		if (snprintf(temp, sizeof(temp), "%s.XXXXXX", trace->path) >= (int)sizeof(temp))
+		{
+			fprintf(stderr, "ERROR writing the trace: %s is too long a path\n", trace->path);
+			continue;
+		}
+		fd = mkostemp(temp, O_CLOEXEC); //a new file, only the daemon's user can read
+		if (fd < 0 || (n = otpTraceDump(trace->stats, fd)) < 0 || rename(temp, trace->path) < 0)
+		{
+			perror("ERROR writing the trace");
+			if (fd >= 0)
+				unlink(temp);
+		}
+		else
+			fprintf(stderr, "wrote %d requests to %s\n", n, trace->path);
+		if (fd >= 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+//start a detached thread running run(arg). It takes no signals: a SIGCHLD it took would never
+//reach the fork server's signalfd
+static void startThread(void* (*run)(void*), void* arg)
+{
+	pthread_t id;
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&id, NULL, run, arg) != 0)
+		error("ERROR creating stats thread");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(id);
+}
+
+/****************************************************************************************************
+ * Function: otpStatsStart
+ * Description: This function starts a thread that serves the counters on port: each connection
+ * 		receives one snapshot in Prometheus text format and is closed. A connection that
+ * 		sends "trace" within TRACE_WAIT_MS receives otpTraceDump instead.
+ * Arguments: stats: struct otpStats*, the counters
+ * 	      port: int, the stats port
+ * Postcondition: the thread runs until the process exits; the program exits if port cannot be bound
+ * ****************************************************************************************************/
+void otpStatsStart(struct otpStats* stats, int port)
+{
+	struct statsListener* listener = malloc(sizeof(struct statsListener));
+	if (!listener) error("ERROR allocating memory in otp server");
+	listener->stats = stats;
+	listener->listenFD = otpListen(port, 16, 0);
+	startThread(serveStats, listener);
+}
+
+/****************************************************************************************************
+ * Function: otpTraceStart
+ * Description: This function makes SIGUSR1 write the trace rings to path, through a thread that
+ * 		waits for it. It blocks SIGUSR1 in the calling thread, so it must run before the
+ * 		daemon starts other threads or forks, which then block it too.
+ * Arguments: stats: struct otpStats*, the trace rings
+ * 	      path: const char*, the file the trace is written to, replaced at every signal
+ * Postcondition: the thread runs until the process exits
+ * ****************************************************************************************************/
+void otpTraceStart(struct otpStats* stats, const char* path)
+{
+	struct traceSignal* trace = malloc(sizeof(struct traceSignal));
+	sigset_t usr1;
+	if (!trace || !(trace->path = strdup(path))) error("ERROR allocating memory in otp server");
+	trace->stats = stats;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+	startThread(traceOnSignal, trace);
+}
@@ -0,0 +1,128 @@
+/**************************************************************************************
+ * Description: Daemon counters kept in shared memory, so that forked children and
+ * 		worker processes all update the same numbers, and a stats listener that
+ * 		reports them in Prometheus text format. Next to the counters, each stage
+ * 		of serving a request has a histogram of the time spent in it, taken
+ * 		with the monotonic clock through a struct otpStageTimer. The last requests
+ * 		are also kept one by one, with their stages, length, peer and outcome, in
+ * 		trace rings that are written to a file on SIGUSR1 or sent to a stats
+ * 		client that asks for "trace".
+ *************************************************************************************/
+
+#ifndef OTP_STATS_H
+#define OTP_STATS_H
+
+#include <stdint.h>
+#include "otp_codec.h"
+
+#define OTP_STATS_BUCKETS 25 //histogram bounds: 1 us, 2 us, 4 us, ... 2^24 us, then +Inf
+#define OTP_TRACE_RINGS 16 //trace rings; each thread or process writes to the one its id picks
+#define OTP_TRACE_RECORDS 2048 //requests kept per trace ring
+
+//where the time of a request goes
+enum otpStage
+{
+	OTP_STAGE_QUEUE, //accepted, waiting for a free slot of the daemon
+	OTP_STAGE_FORK, //forking the child that serves the connection
+	OTP_STAGE_HANDSHAKE, //receiving the handshake and answering it
+	OTP_STAGE_TEXT, //receiving the length field and text (streaming and v2: all its windows)
+	OTP_STAGE_KEY, //receiving the key
+	OTP_STAGE_TRANSFORM, //encoding or decoding and checking, with the packing of packed windows
+	OTP_STAGE_REPLY, //sending the transformed text and the reply and check frames
+	OTP_STAGE_REQUEST, //a whole request: from the start of its connection (v1, streaming) or
+			   //from its frame (v2) to the end of its reply
+	OTP_STAGES
+};
+
+//times of one stage: counts per bucket (the last one past every bound) and their sum
+struct otpStageHistogram
+{
+	long buckets[OTP_STATS_BUCKETS + 1];
+	long sumNs;
+};
+
+//how a request ended
+enum otpOutcome
+{
+	OTP_OUTCOME_OK, //answered
+	OTP_OUTCOME_REFUSED, //v2: answered with an error status, its payload skipped
+	OTP_OUTCOME_INVALID, //its text or key held a character outside A-Z and space
+	OTP_OUTCOME_FAILED, //the connection failed or closed before the answer was out
+};
+
+//the address of a client: IPv4 addresses take the first 4 bytes of addr
+struct otpPeer
+{
+	uint16_t family; //AF_INET or AF_INET6, 0 if unknown
+	uint16_t port; //host byte order
+	unsigned char addr[16];
+};
+
+//one request in a trace ring. sequence is 0 while the record is written, so that a reader can
+//tell a torn copy from a whole one
+struct otpTraceRecord
+{
+	uint64_t sequence; //1 + the record's number in its ring
+	int64_t begin; //ns on the monotonic clock: the start of the connection (v1, streaming) or the frame (v2)
+	int64_t ns[OTP_STAGES]; //time in each stage; OTP_STAGE_REQUEST holds the whole request
+	uint64_t length; //characters of text the request announced
+	int32_t tid; //thread or process that served it
+	uint8_t op; //enum otpOp
+	uint8_t outcome; //enum otpOutcome
+	struct otpPeer peer;
+} __attribute__((aligned(64)));
+
+//the last OTP_TRACE_RECORDS requests of the threads writing to it
+struct otpTraceRing
+{
+	uint64_t next; //records written so far; the next one goes to next % OTP_TRACE_RECORDS
+	struct otpTraceRecord records[OTP_TRACE_RECORDS];
+} __attribute__((aligned(64)));
+
+//counters of one daemon; only touch them through otpStatsAdd/otpStatsGet and otpStatsObserve
+struct otpStats
+{
+	long accepted; //connections accepted
+	long rejected; //connections turned away because the daemon was saturated
+	long inFlight; //connections being served now
+	long queued; //accepted connections waiting for a free slot
+	long completed; //requests answered
+	long bytes; //characters of text transformed by the answered requests
+	long refused; //v2 requests answered with an error status
+	long invalid; //requests whose text or key held a character outside A-Z and space
+	long maxConns; //configured limits, reported next to the counters
+	long queueLimit;
+	struct otpStageHistogram stages[OTP_STAGES];
+	struct otpTraceRing trace[OTP_TRACE_RINGS]; //written by otpTraceRequest, read by otpTraceDump
+};
+
+//the stages of one request as it is served: each otpStageMark charges the time since the
+//previous mark to a stage
+struct otpStageTimer
+{
+	int64_t begin, last; //ns on the monotonic clock
+	int64_t ns[OTP_STAGES];
+	unsigned seen; //bit s: stage s was marked
+};
+
+#define otpStatsAdd(stats, field, n) __atomic_fetch_add(&(stats)->field, (n), __ATOMIC_RELAXED)
+#define otpStatsGet(stats, field) __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED)
+
+struct otpStats* otpStatsCreate(void);
+void otpStatsStart(struct otpStats* stats, int port);
+int64_t otpStatsNow(void);
+void otpStatsObserve(struct otpStats* stats, enum otpStage stage, int64_t ns);
+void otpStageStart(struct otpStageTimer* timer);
+void otpStageMark(struct otpStageTimer* timer, enum otpStage stage);
+void otpStatsStages(struct otpStats* stats, struct otpStageTimer* timer);
+void otpStatsRequest(struct otpStats* stats, struct otpStageTimer* timer, uint64_t length);
+
+struct sockaddr;
+void otpPeerSet(struct otpPeer* peer, const struct sockaddr* addr);
+void otpPeerOf(int fd, struct otpPeer* peer);
+void otpTraceRequest(struct otpStats* stats, const struct otpStageTimer* timer, const struct otpPeer* peer,
+		enum otpOp op, uint64_t length, enum otpOutcome outcome);
+int otpTraceDump(struct otpStats* stats, int fd);
+void otpTraceStart(struct otpStats* stats, const char* path);
+
+#endif